@@ -0,0 +1,808 @@
+// headless benchmark: runs scripted, seeded scenarios without a window and
+// reports per-phase timings of `Simulator::update()`
+//
+// usage: bench [--scenario fill|settled|stir|cloth|nbody|islands|all]
+//              [--frames N]
+//              [--particles N] [--threads N] [--seed N] [--world PX]
+//              [--settle-frames N] [--grid serial|parallel]
+//              [--pipeline fused|phased] [--slices auto|columns|rows]
+//              [--gravity down|up|left|right] [--max-radius PX]
+//              [--sleep on|off] [--reorder FRAMES] [--kernel auto|scalar|sse|avx2]
+//              [--solver gauss-seidel|jacobi] [--expect-hash HEX[,HEX...]]
+//              [--snapshot PATH] [--save-snapshot PATH] [--record PATH]
+//              [--constraints N] [--colliders PEGS] [--collider-sdf PX]
+//              [--theta X] [--attractors N] [--substeps fixed|adaptive]
+//              [--min-substeps N] [--broadphase auto|dense|sparse]
+//              [--islands N] [--trace PATH] [--json PATH|-]
+//
+// `cloth` hangs a sheet of about `--constraints` links from its top edge
+// over the settled pile, it only runs when asked for by name
+// `nbody` scatters the particles over a disc without uniform gravity and
+// lets them fall together under their mutual attraction, Barnes-Hut
+// approximated with opening angle `--theta`, also only run by name
+// `islands` scatters `--islands` packed discs of particles over the world,
+// each held together by an attractor at its center, without gravity, the
+// clustered open world the sparse grid is for, e.g. with `--world 100000`,
+// also only run by name
+// `--attractors` adds that many point attractors on a ring to every scenario
+// `--substeps adaptive` picks every frame's substep count from the fastest
+// particle instead of running 8 and clamping fast particles, never fewer than
+// `--min-substeps`, the report gives the mean count
+// `--broadphase` picks the level-0 grid, `auto` leaves it to the world size,
+// the sparse grid gives the same hashes as the dense one with
+// `--slices columns`
+// every scenario reports a hash of the final particle state, with
+// `--solver jacobi` it does not depend on `--threads`
+// `--expect-hash` takes one hash per scenario and exits with 2 on a mismatch,
+// a regression check on exact positions after N frames
+// the SIMD kernels' reciprocal square roots differ between CPU vendors, so
+// `--solver jacobi` with `--expect-hash` runs the scalar kernel unless
+// `--kernel` says otherwise, its hashes hold on any machine
+//
+// `--snapshot` starts every scenario from a saved state instead of building
+// and settling a pile, the world size comes from the file
+// `--save-snapshot` writes the state at the end of the last scenario, e.g.
+// `--scenario settled --frames 0` saves the settled pile
+// `--record` writes the timed frames of the last scenario to a trajectory
+// file, its cost shows up as the "record" phase
+// `--colliders` adds `ObstacleCourse` with that many pegs to every scenario,
+// 0 leaves the box empty, `--collider-sdf` samples it into a distance field
+// every `PX` px
+// `--trace` writes a Chrome trace JSON of the last frames of every thread,
+// for chrome://tracing or https://ui.perfetto.dev, needs a `make PROFILE=1`
+// build
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./physics/simulator.hpp"
+#include "./profiler.hpp"
+#include "./thread_pool.hpp"
+#include "./utils/color_utils.hpp"
+#include "./utils/obstacle_course.hpp"
+#include "./utils/spawner.hpp"
+
+constexpr float PARTICLE_RADIUS = 2.0f;
+#ifdef VERLET_FIXED_CONFIG
+constexpr const char *CONFIG_NAME = "fixed";
+#else
+constexpr const char *CONFIG_NAME = "dynamic";
+#endif
+// same radius as `InputHandler`
+constexpr float STIR_RADIUS = 120.0f;
+
+struct BenchConfig {
+  std::vector<std::string> scenarios = {"fill", "settled", "stir"};
+  int frames = 600;
+  unsigned particles = 12000;
+  int threads = std::thread::hardware_concurrency();
+  unsigned seed = 1;
+  float world_size = 512.0f;
+  int settle_frames = 240;
+  bool parallel_grid = true;
+  bool fused = true;
+  Simulator::SliceAxis slice_axis = Simulator::SliceAxis::Auto;
+  std::string gravity = "down";
+  // above `PARTICLE_RADIUS`, the pile mixes sizes from 1 px up to this
+  float max_radius = 0.0f;
+  bool sleeping = false;
+  int reorder_interval = 0;
+  collision_kernels::Kind kernel = collision_kernels::Kind::Auto;
+  // whether `--kernel` was given
+  bool kernel_pinned = false;
+  bool deterministic = false;
+  // per scenario, in order, empty to skip the check
+  std::vector<uint64_t> expected_hashes;
+  std::string snapshot_path;
+  std::string save_snapshot_path;
+  std::string record_path;
+  // links of the cloth scenario
+  int constraints = 20000;
+  // pegs of the obstacle course, -1 for none at all
+  int colliders = -1;
+  float collider_sdf = 0.0f;
+  float theta = 0.5f;
+  int attractors = 0;
+  bool adaptive_substeps = false;
+  int min_substeps = 8;
+  std::string broadphase = "auto";
+  int islands = 16;
+  std::string trace_path;
+  std::string json_path;
+};
+
+struct PhaseStats {
+  double p50_ms = 0.0, p99_ms = 0.0, max_ms = 0.0, mean_ms = 0.0;
+};
+
+struct ScenarioResult {
+  std::string scenario;
+  int frames = 0;
+  unsigned particles = 0;
+  size_t constraints = 0;
+  size_t colliders = 0;
+  bool sparse_grid = false;
+  double wall_ms = 0.0;
+  double particle_substeps = 0.0;
+  double mean_substeps = 0.0;
+  uint64_t state_hash = 0;
+  // phase name, stats
+  std::vector<std::pair<std::string, PhaseStats>> phases;
+
+  double throughput() const {
+    return wall_ms > 0.0 ? particle_substeps / (wall_ms / 1000.0) : 0.0;
+  }
+};
+
+static PhaseStats summarize(std::vector<double> samples) {
+  PhaseStats stats;
+  if (samples.empty())
+    return stats;
+
+  std::sort(samples.begin(), samples.end());
+  // nearest-rank percentile
+  auto percentile = [&](double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+    return samples[std::clamp<size_t>(rank, 1, samples.size()) - 1];
+  };
+  stats.p50_ms = percentile(0.50);
+  stats.p99_ms = percentile(0.99);
+  stats.max_ms = samples.back();
+  for (double sample : samples)
+    stats.mean_ms += sample;
+  stats.mean_ms /= samples.size();
+  return stats;
+}
+
+// mostly small particles up to `PARTICLE_RADIUS`, one in 64 larger, up to
+// `max_radius`
+static float pile_radius(const BenchConfig &config, std::mt19937 &rng) {
+  if (config.max_radius <= PARTICLE_RADIUS)
+    return PARTICLE_RADIUS;
+  if (rng() % 64 == 0)
+    return std::uniform_real_distribution<float>(PARTICLE_RADIUS,
+                                                 config.max_radius)(rng);
+  return std::uniform_real_distribution<float>(1.0f, PARTICLE_RADIUS)(rng);
+}
+
+// jittered rows resting on the floor, shaken down by `settle_frames` untimed
+// frames
+static void build_pile(Simulator &simulator, const BenchConfig &config,
+                       std::mt19937 &rng) {
+  const float spacing = 2 * PARTICLE_RADIUS;
+  // stay clear of the boundary inset, which is one cell wide
+  const float margin = 2 * spacing;
+  const int per_row = (config.world_size - 2 * margin) / spacing;
+  std::uniform_real_distribution<float> jitter(-0.1f * PARTICLE_RADIUS,
+                                               0.1f * PARTICLE_RADIUS);
+
+  for (unsigned i = 0; i < config.particles; i++) {
+    int row = i / per_row;
+    int col = i % per_row;
+    // offset odd rows for a hexagonal-ish packing
+    float x = margin + col * spacing + (row % 2) * PARTICLE_RADIUS + jitter(rng);
+    float y = config.world_size - margin - row * spacing + jitter(rng);
+
+    Particle entity = simulator.add_entity({x, y}, pile_radius(config, rng));
+    entity.set_color(color_utils::get_time_based_rgb(0.01f * row));
+  }
+
+  for (int frame = 0; frame < config.settle_frames; frame++)
+    simulator.update();
+}
+
+// grid of particles linked to their right and lower neighbours, the top row
+// pinned, sized to about `config.constraints` links and to fit the upper half
+// of the world
+static void build_cloth(Simulator &simulator, const BenchConfig &config) {
+  const float spacing = 2 * PARTICLE_RADIUS;
+  const float margin = 2 * spacing;
+  const int columns = (config.world_size - 2 * margin) / spacing;
+  const int max_rows = 0.5f * config.world_size / spacing;
+  const int rows =
+      std::clamp(config.constraints / (2 * columns), 2, std::max(2, max_rows));
+
+  std::vector<Particle> nodes;
+  nodes.reserve(rows * columns);
+  for (int row = 0; row < rows; row++) {
+    for (int col = 0; col < columns; col++) {
+      Particle node = simulator.add_entity(
+          {margin + col * spacing, margin + row * spacing}, PARTICLE_RADIUS);
+      node.set_color(color_utils::get_time_based_rgb(0.05f * row));
+      nodes.push_back(node);
+      if (col > 0)
+        simulator.add_link(nodes[nodes.size() - 2], node);
+      if (row > 0)
+        simulator.add_link(nodes[nodes.size() - 1 - columns], node);
+      else
+        simulator.add_anchor(node);
+    }
+  }
+}
+
+// uniform in a disc around the middle, at rest, the mutual attraction scaled
+// so that the rim starts falling inwards at the usual gravity
+static void build_cloud(Simulator &simulator, const BenchConfig &config,
+                        std::mt19937 &rng) {
+  const sf::Vector2f center = {0.5f * config.world_size,
+                               0.5f * config.world_size};
+  const float disc_radius = 0.35f * config.world_size;
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  float total_mass = 0.0f;
+  for (unsigned i = 0; i < config.particles; i++) {
+    float r = disc_radius * std::sqrt(unit(rng));
+    float angle = 2.0f * M_PI * unit(rng);
+    float radius = pile_radius(config, rng);
+    Particle entity = simulator.add_entity(
+        center + r * sf::Vector2f{std::cos(angle), std::sin(angle)}, radius);
+    entity.set_color(color_utils::get_time_based_rgb(r / disc_radius));
+    total_mass += radius * radius;
+  }
+  simulator.set_zero_gravity();
+  simulator.set_long_range_force(DynamicConfig::gravity_strength *
+                                     disc_radius * disc_radius / total_mass,
+                                 2 * PARTICLE_RADIUS);
+}
+
+// `config.islands` discs at seeded spots at least a disc apart from the
+// walls, each particle at rest, pulled towards its disc's center as strongly
+// as by gravity at the rim
+static void build_islands(Simulator &simulator, const BenchConfig &config,
+                          std::mt19937 &rng) {
+  const int per_island = std::max(1u, config.particles / config.islands);
+  const float spacing = 2 * PARTICLE_RADIUS;
+  // hexagonal packing covers about 0.9 of the disc
+  const float disc_radius = spacing * std::sqrt(per_island / (0.9f * M_PI));
+  std::uniform_real_distribution<float> spot(2 * disc_radius,
+                                             config.world_size - 2 * disc_radius);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  for (int island = 0; island < config.islands; island++) {
+    const sf::Vector2f center = {spot(rng), spot(rng)};
+    for (int i = 0; i < per_island; i++) {
+      float r = disc_radius * std::sqrt(unit(rng));
+      float angle = 2.0f * M_PI * unit(rng);
+      Particle entity = simulator.add_entity(
+          center + r * sf::Vector2f{std::cos(angle), std::sin(angle)},
+          pile_radius(config, rng));
+      entity.set_color(
+          color_utils::get_time_based_rgb(float(island) / config.islands));
+    }
+    simulator.add_attractor(center, DynamicConfig::gravity_strength *
+                                        disc_radius * disc_radius);
+  }
+  simulator.set_zero_gravity();
+}
+
+// evenly on a ring around the middle, together as strong as the cloud's pull
+static void add_attractors(Simulator &simulator, const BenchConfig &config) {
+  const float ring_radius = 0.3f * config.world_size;
+  for (int k = 0; k < config.attractors; k++) {
+    float angle = 2.0f * M_PI * k / config.attractors;
+    simulator.add_attractor(
+        {0.5f * config.world_size + ring_radius * std::cos(angle),
+         0.5f * config.world_size + ring_radius * std::sin(angle)},
+        DynamicConfig::gravity_strength * ring_radius * ring_radius /
+            config.attractors);
+  }
+}
+
+static ScenarioResult run_scenario(const std::string &scenario,
+                                   const BenchConfig &config) {
+  std::mt19937 rng(config.seed);
+  ThreadPool thread_pool(config.threads);
+  Simulator simulator(config.world_size, PARTICLE_RADIUS, thread_pool);
+  if (config.broadphase != "auto")
+    simulator.set_sparse_grid(config.broadphase == "sparse");
+  simulator.set_parallel_grid_build(config.parallel_grid);
+  simulator.set_fused_substeps(config.fused);
+  simulator.set_slice_axis(config.slice_axis);
+  if (!simulator.set_sleeping(config.sleeping))
+    std::cerr << scenario << ": sleeping is not available on the sparse grid, "
+                             "running without it\n";
+  // the pile is built on the floor, then slides against the wall gravity
+  // points at while settling
+  if (config.gravity == "up")
+    simulator.set_up_gravity();
+  else if (config.gravity == "left")
+    simulator.set_left_gravity();
+  else if (config.gravity == "right")
+    simulator.set_right_gravity();
+  simulator.set_reorder_interval(config.reorder_interval);
+  simulator.set_collision_kernel(config.kernel);
+#ifndef VERLET_FIXED_CONFIG
+  simulator.set_deterministic(config.deterministic);
+  simulator.set_adaptive_substeps(config.adaptive_substeps,
+                                  config.min_substeps);
+#endif
+  DualSpawner spawner{config.world_size, PARTICLE_RADIUS, config.particles};
+  if (config.colliders >= 0)
+    ObstacleCourse{config.world_size, config.colliders}.build(simulator);
+  simulator.set_collider_sdf(config.collider_sdf);
+
+  if (!config.snapshot_path.empty()) {
+    auto load_start = std::chrono::steady_clock::now();
+    std::string error;
+    if (!simulator.load_snapshot(config.snapshot_path, error)) {
+      std::cerr << error << "\n";
+      std::exit(1);
+    }
+    std::chrono::duration<double, std::milli> load_time =
+        std::chrono::steady_clock::now() - load_start;
+    std::cerr << "loaded " << simulator.entities.size() << " particles from "
+              << config.snapshot_path << " in " << load_time.count() << " ms\n";
+  } else if (scenario == "settled" || scenario == "stir" || scenario == "cloth")
+    build_pile(simulator, config, rng);
+  if (scenario == "cloth")
+    build_cloth(simulator, config);
+  if (scenario == "nbody" && config.snapshot_path.empty())
+    build_cloud(simulator, config, rng);
+  if (scenario == "islands" && config.snapshot_path.empty())
+    build_islands(simulator, config, rng);
+  simulator.set_opening_angle(config.theta);
+  add_attractors(simulator, config);
+
+  // the stirring cursor orbits the middle of the pile, starting at a seeded
+  // angle and direction
+  std::uniform_real_distribution<float> angle_dist(0.0f, 2.0f * M_PI);
+  const float start_angle = angle_dist(rng);
+  const float angular_speed = (rng() % 2 == 0 ? 1.0f : -1.0f) * 0.05f;
+  const sf::Vector2f stir_center = {0.5f * config.world_size,
+                                    0.75f * config.world_size};
+
+  trajectory::Recorder recorder;
+  if (!config.record_path.empty() && scenario == config.scenarios.back()) {
+    std::string error;
+    if (!recorder.open(config.record_path, error)) {
+      std::cerr << error << "\n";
+      std::exit(1);
+    }
+    simulator.set_recorder(&recorder);
+  }
+
+  std::vector<double> gravity, collisions, boundary, integration, grid, reorder,
+      sleep, record, constraints, long_range, total;
+  ScenarioResult result;
+  result.scenario = scenario;
+
+  for (int frame = 0; frame < config.frames; frame++) {
+    if (scenario == "fill")
+      spawner.spawn(simulator, color_utils::get_time_based_rgb(frame / 60.0f));
+
+    if (scenario == "stir") {
+      float angle = start_angle + angular_speed * frame;
+      sf::Vector2f cursor =
+          stir_center + 0.25f * config.world_size *
+                            sf::Vector2f{std::cos(angle), std::sin(angle)};
+      // pull for two seconds, push for one
+      if (frame % 180 < 120)
+        simulator.mouse_pull(cursor, STIR_RADIUS);
+      else
+        simulator.mouse_push(cursor, STIR_RADIUS);
+    }
+
+    simulator.update();
+
+    const Simulator::PhaseTimings &timings = simulator.last_timings;
+    gravity.push_back(timings.gravity_ms);
+    collisions.push_back(timings.collisions_ms);
+    constraints.push_back(timings.constraints_ms);
+    boundary.push_back(timings.boundary_ms);
+    integration.push_back(timings.integration_ms);
+    grid.push_back(timings.grid_ms);
+    reorder.push_back(timings.reorder_ms);
+    sleep.push_back(timings.sleep_ms);
+    record.push_back(timings.record_ms);
+    long_range.push_back(timings.long_range_ms);
+    total.push_back(timings.total_ms());
+
+    result.wall_ms += timings.total_ms();
+    result.particle_substeps +=
+        1.0 * simulator.entities.size() * simulator.get_sub_steps();
+    result.mean_substeps += simulator.get_sub_steps();
+  }
+  if (config.frames > 0)
+    result.mean_substeps /= config.frames;
+
+  result.frames = config.frames;
+  result.particles = simulator.entities.size();
+  result.constraints = simulator.constraint_count();
+  result.colliders = simulator.get_colliders().size();
+  result.sparse_grid = simulator.is_sparse_grid();
+  result.state_hash = simulator.state_hash();
+  if (recorder.is_open()) {
+    simulator.set_recorder(nullptr);
+    std::string error;
+    if (!recorder.close(error)) {
+      std::cerr << error << "\n";
+      std::exit(1);
+    }
+  }
+  if (!config.save_snapshot_path.empty() &&
+      scenario == config.scenarios.back()) {
+    std::string error;
+    if (!simulator.save_snapshot(config.save_snapshot_path, error)) {
+      std::cerr << error << "\n";
+      std::exit(1);
+    }
+  }
+  result.phases = {{"gravity", summarize(gravity)},
+                   {"collisions", summarize(collisions)},
+                   {"constraints", summarize(constraints)},
+                   {"boundary", summarize(boundary)},
+                   {"integration", summarize(integration)},
+                   {"grid", summarize(grid)},
+                   {"reorder", summarize(reorder)},
+                   {"sleep", summarize(sleep)},
+                   {"record", summarize(record)},
+                   {"long_range", summarize(long_range)},
+                   {"total", summarize(total)}};
+  return result;
+}
+
+static const char *slice_axis_name(Simulator::SliceAxis axis) {
+  switch (axis) {
+  case Simulator::SliceAxis::Columns:
+    return "columns";
+  case Simulator::SliceAxis::Rows:
+    return "rows";
+  default:
+    return "auto";
+  }
+}
+
+static std::string hash_hex(uint64_t hash) {
+  std::ostringstream out;
+  out << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return out.str();
+}
+
+static void print_text(const ScenarioResult &result, const BenchConfig &config) {
+  std::cout << "scenario: " << result.scenario
+            << "  particles: " << result.particles
+            << "  constraints: " << result.constraints
+            << "  frames: " << result.frames << "  threads: " << config.threads
+            << "  seed: " << config.seed
+            << "  grid: " << (config.parallel_grid ? "parallel" : "serial")
+            << "  pipeline: " << (config.fused ? "fused" : "phased")
+            << "  slices: " << slice_axis_name(config.slice_axis)
+            << "  gravity: " << config.gravity
+            << "  max radius: " << std::max(config.max_radius, PARTICLE_RADIUS)
+            << "  sleep: " << (config.sleeping ? "on" : "off")
+            << "  reorder: " << config.reorder_interval << "  kernel: "
+            << collision_kernels::name(collision_kernels::resolve(config.kernel))
+            << "  solver: " << (config.deterministic ? "jacobi" : "gauss-seidel")
+            << "  colliders: " << result.colliders
+            << "  sdf: " << config.collider_sdf << "  theta: " << config.theta
+            << "  attractors: " << config.attractors << "  broadphase: "
+            << (result.sparse_grid ? "sparse" : "dense") << "  substeps: "
+            << (config.adaptive_substeps
+                    ? "adaptive from " + std::to_string(config.min_substeps)
+                    : std::string("fixed"))
+            << "  config: " << CONFIG_NAME << "\n";
+  std::cout << std::left << std::setw(14) << "phase" << std::right
+            << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+            << std::setw(10) << "max ms" << std::setw(10) << "mean ms"
+            << "\n";
+  std::cout << std::fixed << std::setprecision(3);
+  for (const auto &[name, stats] : result.phases) {
+    std::cout << std::left << std::setw(14) << name << std::right
+              << std::setw(10) << stats.p50_ms << std::setw(10)
+              << stats.p99_ms << std::setw(10) << stats.max_ms
+              << std::setw(10) << stats.mean_ms << "\n";
+  }
+  std::cout << std::scientific << std::setprecision(3)
+            << "throughput: " << result.throughput()
+            << " particle-substeps/s\n"
+            << std::defaultfloat << "mean substeps: " << result.mean_substeps
+            << "\n"
+            << "state hash: " << hash_hex(result.state_hash) << "\n\n"
+            << std::defaultfloat;
+}
+
+static std::string to_json(const std::vector<ScenarioResult> &results,
+                           const BenchConfig &config) {
+  std::ostringstream out;
+  out << std::setprecision(6);
+  out << "{\n  \"threads\": " << config.threads
+      << ",\n  \"seed\": " << config.seed
+      << ",\n  \"world_size\": " << config.world_size
+      << ",\n  \"snapshot\": \"" << config.snapshot_path << "\""
+      << ",\n  \"grid\": \"" << (config.parallel_grid ? "parallel" : "serial")
+      << "\",\n  \"pipeline\": \"" << (config.fused ? "fused" : "phased")
+      << "\",\n  \"slices\": \"" << slice_axis_name(config.slice_axis)
+      << "\",\n  \"gravity\": \"" << config.gravity
+      << "\",\n  \"max_radius\": " << std::max(config.max_radius, PARTICLE_RADIUS)
+      << ",\n  \"sleep\": " << (config.sleeping ? "true" : "false")
+      << ",\n  \"reorder_interval\": " << config.reorder_interval
+      << ",\n  \"kernel\": \""
+      << collision_kernels::name(collision_kernels::resolve(config.kernel))
+      << "\",\n  \"solver\": \""
+      << (config.deterministic ? "jacobi" : "gauss-seidel")
+      << "\",\n  \"collider_sdf\": " << config.collider_sdf
+      << ",\n  \"theta\": " << config.theta
+      << ",\n  \"attractors\": " << config.attractors
+      << ",\n  \"substeps\": \""
+      << (config.adaptive_substeps ? "adaptive" : "fixed") << "\""
+      << ",\n  \"min_substeps\": " << config.min_substeps
+      << ",\n  \"broadphase\": \"" << config.broadphase << "\""
+      << ",\n  \"config\": \"" << CONFIG_NAME
+      << "\",\n  \"scenarios\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const ScenarioResult &result = results[i];
+    out << (i == 0 ? "\n" : ",\n") << "    {\n"
+        << "      \"scenario\": \"" << result.scenario << "\",\n"
+        << "      \"frames\": " << result.frames << ",\n"
+        << "      \"particles\": " << result.particles << ",\n"
+        << "      \"constraints\": " << result.constraints << ",\n"
+        << "      \"colliders\": " << result.colliders << ",\n"
+        << "      \"particle_substeps_per_sec\": " << result.throughput()
+        << ",\n"
+        << "      \"mean_substeps\": " << result.mean_substeps << ",\n"
+        << "      \"sparse_grid\": "
+        << (result.sparse_grid ? "true" : "false") << ",\n"
+        << "      \"state_hash\": \"" << hash_hex(result.state_hash) << "\",\n"
+        << "      \"phases\": {";
+    for (size_t j = 0; j < result.phases.size(); j++) {
+      const auto &[name, stats] = result.phases[j];
+      out << (j == 0 ? "\n" : ",\n") << "        \"" << name
+          << "\": {\"p50_ms\": " << stats.p50_ms
+          << ", \"p99_ms\": " << stats.p99_ms
+          << ", \"max_ms\": " << stats.max_ms
+          << ", \"mean_ms\": " << stats.mean_ms << "}";
+    }
+    out << "\n      }\n    }";
+  }
+  out << "\n  ]\n}\n";
+  return out.str();
+}
+
+static void print_usage() {
+  std::cerr << "usage: bench "
+               "[--scenario fill|settled|stir|cloth|nbody|islands|all] "
+               "[--frames N] [--particles N] [--threads N] [--seed N] "
+               "[--world PX] "
+               "[--settle-frames N] [--grid serial|parallel] "
+               "[--pipeline fused|phased] [--slices auto|columns|rows] "
+               "[--gravity down|up|left|right] [--max-radius PX] "
+               "[--sleep on|off] [--reorder FRAMES] [--kernel auto|scalar|sse|avx2] "
+               "[--solver gauss-seidel|jacobi] [--expect-hash HEX[,HEX...]] "
+               "[--snapshot PATH] [--save-snapshot PATH] [--record PATH] "
+               "[--constraints N] [--colliders PEGS] [--collider-sdf PX] "
+               "[--theta X] [--attractors N] [--substeps fixed|adaptive] "
+               "[--min-substeps N] [--broadphase auto|dense|sparse] "
+               "[--islands N] [--trace PATH] [--json PATH|-]\n";
+}
+
+static bool parse_args(int argc, char **argv, BenchConfig &config) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h")
+      return false;
+    if (i + 1 >= argc) {
+      std::cerr << "missing value for " << arg << "\n";
+      return false;
+    }
+    std::string value = argv[++i];
+
+    if (arg == "--scenario") {
+      if (value == "all")
+        config.scenarios = {"fill", "settled", "stir"};
+      else if (value == "fill" || value == "settled" || value == "stir" ||
+               value == "cloth" || value == "nbody" || value == "islands")
+        config.scenarios = {value};
+      else {
+        std::cerr << "unknown scenario " << value << "\n";
+        return false;
+      }
+    } else if (arg == "--frames")
+      config.frames = std::stoi(value);
+    else if (arg == "--particles")
+      config.particles = std::stoul(value);
+    else if (arg == "--threads")
+      config.threads = std::max(1, std::stoi(value));
+    else if (arg == "--seed")
+      config.seed = std::stoul(value);
+    else if (arg == "--world")
+      config.world_size = std::stof(value);
+    else if (arg == "--settle-frames")
+      config.settle_frames = std::stoi(value);
+    else if (arg == "--grid") {
+      if (value != "serial" && value != "parallel") {
+        std::cerr << "unknown grid build " << value << "\n";
+        return false;
+      }
+      config.parallel_grid = value == "parallel";
+    } else if (arg == "--pipeline") {
+      if (value != "fused" && value != "phased") {
+        std::cerr << "unknown pipeline " << value << "\n";
+        return false;
+      }
+      config.fused = value == "fused";
+    } else if (arg == "--slices") {
+      if (value == "auto")
+        config.slice_axis = Simulator::SliceAxis::Auto;
+      else if (value == "columns")
+        config.slice_axis = Simulator::SliceAxis::Columns;
+      else if (value == "rows")
+        config.slice_axis = Simulator::SliceAxis::Rows;
+      else {
+        std::cerr << "unknown slice axis " << value << "\n";
+        return false;
+      }
+    } else if (arg == "--gravity") {
+      if (value != "down" && value != "up" && value != "left" &&
+          value != "right") {
+        std::cerr << "unknown gravity " << value << "\n";
+        return false;
+      }
+      config.gravity = value;
+    } else if (arg == "--max-radius")
+      config.max_radius = std::stof(value);
+    else if (arg == "--sleep") {
+      if (value != "on" && value != "off") {
+        std::cerr << "unknown sleep mode " << value << "\n";
+        return false;
+      }
+      config.sleeping = value == "on";
+    } else if (arg == "--reorder")
+      config.reorder_interval = std::max(0, std::stoi(value));
+    else if (arg == "--kernel") {
+      config.kernel_pinned = true;
+      if (value == "auto")
+        config.kernel = collision_kernels::Kind::Auto;
+      else if (value == "scalar")
+        config.kernel = collision_kernels::Kind::Scalar;
+      else if (value == "sse")
+        config.kernel = collision_kernels::Kind::Sse;
+      else if (value == "avx2")
+        config.kernel = collision_kernels::Kind::Avx2;
+      else {
+        std::cerr << "unknown kernel " << value << "\n";
+        return false;
+      }
+    } else if (arg == "--solver") {
+      if (value != "gauss-seidel" && value != "jacobi") {
+        std::cerr << "unknown solver " << value << "\n";
+        return false;
+      }
+      config.deterministic = value == "jacobi";
+#ifdef VERLET_FIXED_CONFIG
+      if (config.deterministic) {
+        std::cerr << "this build fixes the solver to gauss-seidel\n";
+        return false;
+      }
+#endif
+    } else if (arg == "--expect-hash") {
+      std::istringstream hashes(value);
+      std::string hash;
+      config.expected_hashes.clear();
+      while (std::getline(hashes, hash, ','))
+        config.expected_hashes.push_back(std::stoull(hash, nullptr, 16));
+    } else if (arg == "--snapshot")
+      config.snapshot_path = value;
+    else if (arg == "--save-snapshot")
+      config.save_snapshot_path = value;
+    else if (arg == "--record")
+      config.record_path = value;
+    else if (arg == "--constraints")
+      config.constraints = std::max(0, std::stoi(value));
+    else if (arg == "--colliders")
+      config.colliders = std::max(0, std::stoi(value));
+    else if (arg == "--collider-sdf")
+      config.collider_sdf = std::max(0.0f, std::stof(value));
+    else if (arg == "--substeps") {
+      if (value != "fixed" && value != "adaptive") {
+        std::cerr << "unknown substeps mode " << value << "\n";
+        return false;
+      }
+      config.adaptive_substeps = value == "adaptive";
+#ifdef VERLET_FIXED_CONFIG
+      if (config.adaptive_substeps) {
+        std::cerr << "this build fixes the substeps to "
+                  << FixedConfig::sub_steps << "\n";
+        return false;
+      }
+#endif
+    } else if (arg == "--min-substeps")
+      config.min_substeps = std::max(1, std::stoi(value));
+    else if (arg == "--theta")
+      config.theta = std::max(0.0f, std::stof(value));
+    else if (arg == "--attractors")
+      config.attractors = std::max(0, std::stoi(value));
+    else if (arg == "--broadphase") {
+      if (value != "auto" && value != "dense" && value != "sparse") {
+        std::cerr << "unknown broadphase " << value << "\n";
+        return false;
+      }
+      config.broadphase = value;
+    } else if (arg == "--islands")
+      config.islands = std::max(1, std::stoi(value));
+    else if (arg == "--trace")
+      config.trace_path = value;
+    else if (arg == "--json")
+      config.json_path = value;
+    else {
+      std::cerr << "unknown option " << arg << "\n";
+      return false;
+    }
+  }
+  // a hash check meant to hold on other machines, see the top of the file
+  if (config.deterministic && !config.expected_hashes.empty() &&
+      !config.kernel_pinned)
+    config.kernel = collision_kernels::Kind::Scalar;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  if (!parse_args(argc, argv, config)) {
+    print_usage();
+    return 1;
+  }
+  PROFILE_THREAD_NAME("main");
+  if (!config.trace_path.empty() && !profiler::enabled) {
+    std::cerr << "profiling is not compiled in, rebuild with PROFILE=1\n";
+    return 1;
+  }
+
+  // the simulator must be built for the snapshot's world
+  if (!config.snapshot_path.empty()) {
+    snapshot::MappedSnapshot file;
+    std::string error;
+    if (!file.open(config.snapshot_path, error)) {
+      std::cerr << error << "\n";
+      return 1;
+    }
+    config.world_size = file.header->window_size;
+  }
+
+  std::vector<ScenarioResult> results;
+  for (const std::string &scenario : config.scenarios) {
+    results.push_back(run_scenario(scenario, config));
+    // keep stdout clean when it carries the json report
+    if (config.json_path != "-")
+      print_text(results.back(), config);
+  }
+
+  if (config.json_path == "-")
+    std::cout << to_json(results, config);
+  else if (!config.json_path.empty()) {
+    std::ofstream json_file(config.json_path);
+    if (!json_file) {
+      std::cerr << "could not open " << config.json_path << "\n";
+      return 1;
+    }
+    json_file << to_json(results, config);
+  }
+  if (!config.trace_path.empty() &&
+      !profiler::write_chrome_trace(config.trace_path)) {
+    std::cerr << "could not write " << config.trace_path << "\n";
+    return 1;
+  }
+
+  if (!config.expected_hashes.empty() &&
+      config.expected_hashes.size() != results.size()) {
+    std::cerr << "expected " << results.size() << " hashes, got "
+              << config.expected_hashes.size() << "\n";
+    return 2;
+  }
+  int mismatches = 0;
+  for (size_t i = 0; i < config.expected_hashes.size(); i++) {
+    if (results[i].state_hash == config.expected_hashes[i])
+      continue;
+    std::cerr << results[i].scenario << ": state hash "
+              << hash_hex(results[i].state_hash) << ", expected "
+              << hash_hex(config.expected_hashes[i]) << "\n";
+    mismatches++;
+  }
+  return mismatches > 0 ? 2 : 0;
+}
@@ -0,0 +1,191 @@
+// headless multi-process run: the world is split into vertical strips, each
+// simulated by its own process, see `physics/domain.hpp`
+//
+// usage: domains [--domains N] [--frames N] [--particles N] [--threads N]
+//                [--seed N] [--world PX] [--snapshot-interval FRAMES]
+//                [--pin on|off] [--save-snapshot PATH]
+//
+// starts from the same unsettled pile as the bench and reports, at every
+// global snapshot, the frame time and each domain's split between simulating
+// and waiting on its neighbours
+// `--threads` is per domain, by default the CPUs are shared out evenly
+// `--save-snapshot` writes the final global state, which the bench's
+// `--snapshot` loads
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./physics/domain.hpp"
+#include "./physics/simulator.hpp"
+#include "./thread_pool.hpp"
+#include "./utils/color_utils.hpp"
+
+constexpr float PARTICLE_RADIUS = 2.0f;
+
+struct DomainsConfig {
+  domain::Config run;
+  unsigned particles = 100000;
+  unsigned seed = 1;
+  std::string save_snapshot_path;
+};
+
+// jittered rows resting on the floor, like the bench's pile
+static std::vector<domain::Record> build_pile(const DomainsConfig &config) {
+  std::mt19937 rng(config.seed);
+  const float world_size = config.run.world_size;
+  const float spacing = 2 * PARTICLE_RADIUS;
+  const float margin = 2 * spacing;
+  const int per_row = (world_size - 2 * margin) / spacing;
+  std::uniform_real_distribution<float> jitter(-0.1f * PARTICLE_RADIUS,
+                                               0.1f * PARTICLE_RADIUS);
+
+  std::vector<domain::Record> pile(config.particles);
+  for (unsigned i = 0; i < config.particles; i++) {
+    int row = i / per_row;
+    int col = i % per_row;
+    domain::Record &record = pile[i];
+    record.kind = domain::OWNED;
+    record.id = i;
+    record.x = margin + col * spacing + (row % 2) * PARTICLE_RADIUS + jitter(rng);
+    record.y = world_size - margin - row * spacing + jitter(rng);
+    record.last_x = record.x;
+    record.last_y = record.y;
+    record.radius = PARTICLE_RADIUS;
+    record.color = color_utils::get_time_based_rgb(0.01f * row);
+  }
+  return pile;
+}
+
+static void print_usage() {
+  std::cerr << "usage: domains [--domains N] [--frames N] [--particles N] "
+               "[--threads N] [--seed N] [--world PX] "
+               "[--snapshot-interval FRAMES] [--pin on|off] "
+               "[--save-snapshot PATH]\n";
+}
+
+static bool parse_args(int argc, char **argv, DomainsConfig &config) {
+  int threads = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h")
+      return false;
+    if (i + 1 >= argc) {
+      std::cerr << "missing value for " << arg << "\n";
+      return false;
+    }
+    std::string value = argv[++i];
+
+    if (arg == "--domains")
+      config.run.domain_count = std::max(1, std::stoi(value));
+    else if (arg == "--frames")
+      config.run.frames = std::max(1, std::stoi(value));
+    else if (arg == "--particles")
+      config.particles = std::stoul(value);
+    else if (arg == "--threads")
+      threads = std::stoi(value);
+    else if (arg == "--seed")
+      config.seed = std::stoul(value);
+    else if (arg == "--world")
+      config.run.world_size = std::stof(value);
+    else if (arg == "--snapshot-interval")
+      config.run.snapshot_interval = std::max(1, std::stoi(value));
+    else if (arg == "--pin") {
+      if (value != "on" && value != "off") {
+        std::cerr << "unknown pin mode " << value << "\n";
+        return false;
+      }
+      config.run.pin = value == "on";
+    } else if (arg == "--save-snapshot")
+      config.save_snapshot_path = value;
+    else {
+      std::cerr << "unknown option " << arg << "\n";
+      return false;
+    }
+  }
+  config.run.threads_per_domain =
+      threads > 0 ? threads
+                  : std::max<int>(1, std::thread::hardware_concurrency() /
+                                         config.run.domain_count);
+  return true;
+}
+
+static std::string hash_hex(uint64_t hash) {
+  std::ostringstream out;
+  out << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return out.str();
+}
+
+int main(int argc, char **argv) {
+  DomainsConfig config;
+  if (!parse_args(argc, argv, config)) {
+    print_usage();
+    return 1;
+  }
+  config.run.radius = PARTICLE_RADIUS;
+  std::vector<domain::Record> pile = build_pile(config);
+  const int domain_count = config.run.domain_count;
+
+  std::cout << "domains: " << domain_count
+            << "  threads per domain: " << config.run.threads_per_domain
+            << "  particles: " << pile.size()
+            << "  world: " << config.run.world_size
+            << "  frames: " << config.run.frames
+            << "  pin: " << (config.run.pin ? "on" : "off") << "\n"
+            << std::fixed << std::setprecision(3);
+
+  using clock = std::chrono::steady_clock;
+  clock::time_point last_snapshot = clock::now();
+  int last_frame = 0;
+  ParticleStore final_state;
+  auto on_snapshot = [&](int frame, const ParticleStore &store,
+                         const std::vector<domain::DomainTimes> &times) {
+    clock::time_point now = clock::now();
+    double ms_per_frame =
+        std::chrono::duration<double, std::milli>(now - last_snapshot).count() /
+        (frame - last_frame);
+    last_snapshot = now;
+    last_frame = frame;
+
+    std::cout << "frame " << std::setw(6) << frame << "  " << ms_per_frame
+              << " ms/frame  ";
+    for (int d = 0; d < domain_count; d++)
+      std::cout << "  [" << d << "] " << times[d].compute_ms / frame << " + "
+                << times[d].exchange_ms / frame;
+    std::cout << std::endl;
+    if (frame == config.run.frames)
+      final_state = store;
+  };
+
+  std::string error;
+  clock::time_point start = clock::now();
+  if (!domain::run(config.run, pile, on_snapshot, error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  double wall_ms =
+      std::chrono::duration<double, std::milli>(clock::now() - start).count();
+  std::cout << "throughput: " << std::scientific
+            << pile.size() * config.run.frames * config.run.sub_steps /
+                   (wall_ms / 1000.0)
+            << " particle-substeps/s\n"
+            << std::defaultfloat;
+
+  // the same hash and snapshot format as a single simulator's, the domains
+  // are gone, so this process may start threads again
+  ThreadPool thread_pool(1);
+  Simulator simulator(config.run.world_size, PARTICLE_RADIUS, thread_pool);
+  simulator.set_particles(std::move(final_state));
+  std::cout << "state hash: " << hash_hex(simulator.state_hash()) << "\n";
+  if (!config.save_snapshot_path.empty() &&
+      !simulator.save_snapshot(config.save_snapshot_path, error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,347 @@
+// headless parameter sweep: many independent simulations stepped side by side
+// on one thread pool, with every run's results in one report
+//
+// usage: ensemble [--gravity PX_S2[,...]] [--bounce F[,...]]
+//                 [--substeps N[,...]] [--particles N[,...]]
+//                 [--spawn-velocity PX_S[,...]] [--frames N] [--world PX]
+//                 [--threads N] [--wide-particles N] [--json PATH|-]
+//
+// every combination of the listed values is one run of the window's dual
+// spawners for `--frames` frames
+// runs below `--wide-particles` particles run on one thread each, as many at
+// once as there are threads, larger ones also split their phases over the
+// pool, the largest runs start first
+// each run reports its own time, the mean particle speed and the pile height
+// at the end, and the hash of its final state, the same as a bench run with
+// `--threads` set to the run's reported thread count would give: 1 for narrow
+// runs, `--threads` for wide ones, whose Gauss-Seidel slices follow it
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./physics/simulator.hpp"
+#include "./thread_pool.hpp"
+#include "./utils/color_utils.hpp"
+#include "./utils/spawner.hpp"
+
+constexpr float PARTICLE_RADIUS = 2.0f;
+constexpr float STEP_DT = 1.0f / 60;
+
+struct RunParameters {
+  float gravity = DynamicConfig::gravity_strength;
+  float bounce = DynamicConfig::bounce_factor;
+  int sub_steps = 8;
+  unsigned particles = 2000;
+  float spawn_velocity = 500.0f;
+};
+
+struct RunResult {
+  RunParameters parameters;
+  unsigned particles = 0;
+  double wall_ms = 0.0;
+  // px/s, over all particles at the end
+  double mean_speed = 0.0;
+  // px between the floor and the highest particle at the end
+  double pile_height = 0.0;
+  uint64_t state_hash = 0;
+  // threads its phases were split over, which the state hash depends on
+  int threads = 1;
+};
+
+struct EnsembleConfig {
+  // swept, every combination is a run
+  std::vector<float> gravity = {DynamicConfig::gravity_strength};
+  std::vector<float> bounce = {DynamicConfig::bounce_factor};
+  std::vector<int> sub_steps = {8};
+  std::vector<unsigned> particles = {2000};
+  std::vector<float> spawn_velocity = {500.0f};
+
+  int frames = 600;
+  float world_size = 256.0f;
+  int threads = std::thread::hardware_concurrency();
+  unsigned wide_particles = 20000;
+  std::string json_path;
+};
+
+static std::vector<RunParameters> expand(const EnsembleConfig &config) {
+  std::vector<RunParameters> runs;
+  for (float gravity : config.gravity)
+    for (float bounce : config.bounce)
+      for (int sub_steps : config.sub_steps)
+        for (unsigned particles : config.particles)
+          for (float spawn_velocity : config.spawn_velocity)
+            runs.push_back(
+                {gravity, bounce, sub_steps, particles, spawn_velocity});
+  return runs;
+}
+
+// roughly proportional to the run's time, the order runs start in
+static double cost(const RunParameters &run, int frames) {
+  return 1.0 * run.particles * run.sub_steps * frames;
+}
+
+static RunResult run_one(const RunParameters &run,
+                         const EnsembleConfig &config, ThreadPool &pool) {
+  auto start = std::chrono::steady_clock::now();
+  Simulator simulator(config.world_size, PARTICLE_RADIUS, pool);
+#ifndef VERLET_FIXED_CONFIG
+  simulator.set_time_step(STEP_DT, run.sub_steps);
+  simulator.set_bounce_factor(run.bounce);
+#endif
+  simulator.set_gravity_strength(run.gravity);
+  DualSpawner spawner{config.world_size, PARTICLE_RADIUS, run.particles,
+                      run.spawn_velocity};
+
+  for (int frame = 0; frame < config.frames; frame++) {
+    if (!spawner.is_full(simulator))
+      spawner.spawn(simulator,
+                    color_utils::get_time_based_rgb(frame * STEP_DT));
+    simulator.update();
+  }
+
+  RunResult result;
+  result.parameters = run;
+  const ParticleStore &entities = simulator.entities;
+  result.particles = entities.size();
+  float top = config.world_size;
+  for (size_t i = 0; i < entities.size(); i++) {
+    result.mean_speed += std::hypot(entities.x[i] - entities.last_x[i],
+                                    entities.y[i] - entities.last_y[i]);
+    top = std::min(top, entities.y[i]);
+  }
+  if (result.particles > 0) {
+    result.mean_speed *= simulator.get_sub_steps() / STEP_DT / result.particles;
+    result.pile_height = config.world_size - top;
+  }
+  result.state_hash = simulator.state_hash();
+  result.threads = pool.m_thread_count;
+  result.wall_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return result;
+}
+
+// one task per run on `pool`, the largest first
+// narrow runs get a pool without workers of their own, so each stays on the
+// thread that picked it up, wide ones share `pool` and run their phases on it
+// as well, next to the narrow runs
+static std::vector<RunResult> run_all(const std::vector<RunParameters> &runs,
+                                      const EnsembleConfig &config,
+                                      ThreadPool &pool) {
+  std::vector<int> order(runs.size());
+  for (size_t i = 0; i < runs.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return cost(runs[a], config.frames) > cost(runs[b], config.frames);
+  });
+
+  std::vector<RunResult> results(runs.size());
+  // a worker takes its own most recent task first, so each wave is queued
+  // cheapest first, and a wave stays within the deques' capacity
+  const int wave_size = WorkDeque::capacity / 2 * pool.m_thread_count;
+  for (size_t first = 0; first < order.size(); first += wave_size) {
+    const int count = std::min<size_t>(wave_size, order.size() - first);
+    pool.parallel(
+        0, count,
+        [&](int start, int end) {
+          for (int k = start; k < end; k++) {
+            const int index = order[first + count - 1 - k];
+            if (runs[index].particles >= config.wide_particles)
+              results[index] = run_one(runs[index], config, pool);
+            else {
+              ThreadPool narrow;
+              results[index] = run_one(runs[index], config, narrow);
+            }
+          }
+        },
+        count);
+  }
+  return results;
+}
+
+static std::string hash_hex(uint64_t hash) {
+  std::ostringstream out;
+  out << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return out.str();
+}
+
+static void print_text(const std::vector<RunResult> &results,
+                       const EnsembleConfig &config, double wall_ms) {
+  std::cout << "runs: " << results.size() << "  frames: " << config.frames
+            << "  world: " << config.world_size
+            << "  threads: " << config.threads
+            << "  wide from: " << config.wide_particles << " particles\n";
+  std::cout << std::right << std::setw(5) << "run" << std::setw(10)
+            << "gravity" << std::setw(8) << "bounce" << std::setw(10)
+            << "substeps" << std::setw(11) << "particles" << std::setw(10)
+            << "spawn v" << std::setw(10) << "ms" << std::setw(12)
+            << "mean speed" << std::setw(8) << "height" << std::setw(9)
+            << "threads"
+            << "  state hash\n"
+            << std::fixed << std::setprecision(2);
+  double busy_ms = 0.0, particle_substeps = 0.0;
+  for (size_t i = 0; i < results.size(); i++) {
+    const RunResult &result = results[i];
+    const RunParameters &run = result.parameters;
+    std::cout << std::setw(5) << i << std::setw(10) << run.gravity
+              << std::setw(8) << run.bounce << std::setw(10) << run.sub_steps
+              << std::setw(11) << result.particles << std::setw(10)
+              << run.spawn_velocity << std::setw(10) << result.wall_ms
+              << std::setw(12) << result.mean_speed << std::setw(8)
+              << result.pile_height << std::setw(9) << result.threads << "  "
+              << hash_hex(result.state_hash) << "\n";
+    busy_ms += result.wall_ms;
+    particle_substeps += cost(run, config.frames);
+  }
+  // the calling thread helps the workers, up to `threads + 1` at once
+  std::cout << "wall: " << wall_ms << " ms  summed run time: " << busy_ms
+            << " ms  runs in flight: " << busy_ms / wall_ms << "\n"
+            << std::scientific << std::setprecision(3)
+            << "throughput: " << particle_substeps / (wall_ms / 1000.0)
+            << " particle-substeps/s\n"
+            << std::defaultfloat;
+}
+
+static std::string to_json(const std::vector<RunResult> &results,
+                           const EnsembleConfig &config, double wall_ms) {
+  std::ostringstream out;
+  out << "{\n  \"threads\": " << config.threads
+      << ",\n  \"frames\": " << config.frames
+      << ",\n  \"world\": " << config.world_size
+      << ",\n  \"wide_particles\": " << config.wide_particles
+      << ",\n  \"wall_ms\": " << wall_ms << ",\n  \"runs\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const RunResult &result = results[i];
+    const RunParameters &run = result.parameters;
+    out << (i ? ",\n" : "\n") << "    {\n"
+        << "      \"gravity\": " << run.gravity << ",\n"
+        << "      \"bounce\": " << run.bounce << ",\n"
+        << "      \"substeps\": " << run.sub_steps << ",\n"
+        << "      \"spawn_velocity\": " << run.spawn_velocity << ",\n"
+        << "      \"particles\": " << result.particles << ",\n"
+        << "      \"wall_ms\": " << result.wall_ms << ",\n"
+        << "      \"mean_speed\": " << result.mean_speed << ",\n"
+        << "      \"pile_height\": " << result.pile_height << ",\n"
+        << "      \"threads\": " << result.threads << ",\n"
+        << "      \"state_hash\": \"" << hash_hex(result.state_hash) << "\"\n"
+        << "    }";
+  }
+  out << "\n  ]\n}\n";
+  return out.str();
+}
+
+static void print_usage() {
+  std::cerr << "usage: ensemble [--gravity PX_S2[,...]] [--bounce F[,...]] "
+               "[--substeps N[,...]] [--particles N[,...]] "
+               "[--spawn-velocity PX_S[,...]] [--frames N] [--world PX] "
+               "[--threads N] [--wide-particles N] [--json PATH|-]\n";
+}
+
+// comma-separated values, `parse(text)` converts each
+template <typename T, typename Parse>
+static std::vector<T> parse_list(const std::string &value, Parse parse) {
+  std::istringstream items(value);
+  std::string item;
+  std::vector<T> list;
+  while (std::getline(items, item, ','))
+    list.push_back(parse(item));
+  return list;
+}
+
+static bool parse_args(int argc, char **argv, EnsembleConfig &config) {
+  auto to_float = [](const std::string &item) { return std::stof(item); };
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h")
+      return false;
+    if (i + 1 >= argc) {
+      std::cerr << "missing value for " << arg << "\n";
+      return false;
+    }
+    std::string value = argv[++i];
+
+    if (arg == "--gravity")
+      config.gravity = parse_list<float>(value, to_float);
+    else if (arg == "--bounce")
+      config.bounce = parse_list<float>(value, to_float);
+    else if (arg == "--substeps")
+      config.sub_steps = parse_list<int>(value, [](const std::string &item) {
+        return std::max(1, std::stoi(item));
+      });
+    else if (arg == "--particles")
+      config.particles =
+          parse_list<unsigned>(value, [](const std::string &item) {
+            return static_cast<unsigned>(std::stoul(item));
+          });
+    else if (arg == "--spawn-velocity")
+      config.spawn_velocity = parse_list<float>(value, to_float);
+    else if (arg == "--frames")
+      config.frames = std::max(1, std::stoi(value));
+    else if (arg == "--world")
+      config.world_size = std::stof(value);
+    else if (arg == "--threads")
+      config.threads = std::max(1, std::stoi(value));
+    else if (arg == "--wide-particles")
+      config.wide_particles = std::stoul(value);
+    else if (arg == "--json")
+      config.json_path = value;
+    else {
+      std::cerr << "unknown option " << arg << "\n";
+      return false;
+    }
+#ifdef VERLET_FIXED_CONFIG
+    if (arg == "--bounce" || arg == "--substeps") {
+      std::cerr << "this build fixes the substeps and the bounce factor\n";
+      return false;
+    }
+#endif
+  }
+  if (config.gravity.empty() || config.bounce.empty() ||
+      config.sub_steps.empty() || config.particles.empty() ||
+      config.spawn_velocity.empty()) {
+    std::cerr << "every swept parameter needs at least one value\n";
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  EnsembleConfig config;
+  if (!parse_args(argc, argv, config)) {
+    print_usage();
+    return 1;
+  }
+#ifdef VERLET_FIXED_CONFIG
+  config.sub_steps = {FixedConfig::sub_steps};
+#endif
+  std::vector<RunParameters> runs = expand(config);
+
+  ThreadPool pool(config.threads);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<RunResult> results = run_all(runs, config, pool);
+  double wall_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  if (config.json_path == "-")
+    std::cout << to_json(results, config, wall_ms);
+  else {
+    print_text(results, config, wall_ms);
+    if (!config.json_path.empty()) {
+      std::ofstream json_file(config.json_path);
+      if (!json_file) {
+        std::cerr << "could not open " << config.json_path << "\n";
+        return 1;
+      }
+      json_file << to_json(results, config, wall_ms);
+    }
+  }
+  return 0;
+}
@@ -1,14 +1,20 @@
+#include <cstdio>
 #include <iostream>
 #include <math.h>
+#include <memory>
 #include <thread>
 
 #include <SFML/Graphics.hpp>
 
 #include "./physics/simulator.hpp"
+#include "./pipeline.hpp"
+#include "./profiler.hpp"
 #include "./renderer.hpp"
 #include "./thread_pool.hpp"
 #include "./utils/color_utils.hpp"
 #include "./utils/input_handler.hpp"
+#include "./utils/obstacle_course.hpp"
+#include "./utils/spawner.hpp"
 
 static const std::string UI_FONT_PATH = "./assets/dejavu_sans.ttf";
 constexpr unsigned WINDOW_WIDTH = 512;
@@ -20,19 +26,90 @@ constexpr unsigned MAX_ENTITIES = 12000;
 constexpr float SPAWN_VELOCITY = 500.0f;
 constexpr float SPAWNER_SPACING = 4.0f;
 constexpr unsigned SPAWNER_COUNT = 20;
+// frames between two spatial reorders of the particle arrays
+constexpr int REORDER_INTERVAL = 30;
+// settled piles stop being simulated until something disturbs them
+constexpr bool SLEEPING = true;
+// substep count picked every frame from the fastest particle, at least the
+// fixed count of 8, instead of stopping particles too fast for 8
+constexpr bool ADAPTIVE_SUBSTEPS = true;
+// Jacobi collision passes, the same run on any thread count, slightly
+// softer piles
+constexpr bool DETERMINISTIC = false;
+// frames averaged by the per-phase timings on screen
+constexpr int TIMING_WINDOW = 60;
+
+// one line per phase, mean milliseconds of `sum` over `frames`
+static std::string phase_summary(const Simulator::PhaseTimings &sum,
+                                 int frames) {
+  std::pair<const char *, double> phases[] = {
+      {"gravity", sum.gravity_ms},         {"collisions", sum.collisions_ms},
+      {"constraints", sum.constraints_ms}, {"boundary", sum.boundary_ms},
+      {"integration", sum.integration_ms}, {"grid", sum.grid_ms},
+      {"reorder", sum.reorder_ms},         {"sleep", sum.sleep_ms},
+      {"record", sum.record_ms},           {"long range", sum.long_range_ms}};
+  std::string summary;
+  char line[64];
+  for (auto [name, ms] : phases) {
+    std::snprintf(line, sizeof line, "\n%-12s %7.3fms", name, ms / frames);
+    summary += line;
+  }
+  return summary;
+}
 
-int main() {
+// usage: executable [--record PATH | --replay PATH] [--trace PATH]
+//                   [--physics-rate HZ] [--obstacles PEGS]
+// `--record` writes every frame to a trajectory file, `--replay` plays one
+// back instead of simulating
+// `--physics-rate` runs the simulation on its own thread at `HZ` steps per
+// second, the window draws the latest steps interpolated at its own rate
+// `--obstacles` adds `ObstacleCourse` with that many pegs
+// `--trace` writes a Chrome trace JSON at exit, needs a `make PROFILE=1`
+// build
+int main(int argc, char **argv) {
+  PROFILE_THREAD_NAME("main");
   // TODO finish deterministic rendering
   // freopen("colors.txt", "r", stdin);
-  // freopen("positions.txt", "w", stdout);
 
-  const sf::Vector2f spawn_pos_1 = {4.0f, 50.0f};
-  // `- particle_radius + spawner_spacing` to offset the discrepancy from the
-  // spawn logic
-  const sf::Vector2f spawn_pos_2 = {
-      WINDOW_WIDTH - 4.0f, 50.0f - (PARTICLE_RADIUS + SPAWNER_SPACING)};
-  const sf::Vector2f spawn_angle_1 = sf::Vector2f{0.5, 0.5};
-  const sf::Vector2f spawn_angle_2 = sf::Vector2f{-0.5, 0.5};
+  std::string record_path, replay_path, trace_path;
+  // 0 simulates one step per displayed frame, on the main thread
+  double physics_rate = 0.0;
+  // -1 for an empty box
+  int obstacle_pegs = -1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--record")
+      record_path = argv[i + 1];
+    else if (arg == "--replay")
+      replay_path = argv[i + 1];
+    else if (arg == "--trace")
+      trace_path = argv[i + 1];
+    else if (arg == "--physics-rate")
+      physics_rate = std::max(0.0, std::stod(argv[i + 1]));
+    else if (arg == "--obstacles")
+      obstacle_pegs = std::max(0, std::stoi(argv[i + 1]));
+    else {
+      std::cerr << "unknown option " << arg << "\n";
+      return 1;
+    }
+  }
+
+  trajectory::Recorder recorder;
+  trajectory::Reader reader;
+  std::string error;
+  if (!record_path.empty() && !recorder.open(record_path, error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  if (!replay_path.empty() && !reader.open(replay_path, error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  int replay_frame = 0;
+  if (!trace_path.empty() && !profiler::enabled)
+    std::cerr << "profiling is not compiled in, rebuild with PROFILE=1 to "
+                 "write "
+              << trace_path << "\n";
 
   sf::ContextSettings settings;
   settings.antiAliasingLevel = 1;
@@ -52,62 +129,118 @@ int main() {
   std::cout << "employing " << available_thread_count << " threads\n"
             << std::endl;
 
-  ThreadPool thread_pool(available_thread_count);
+  // asynchronous mode: the simulation and the renderer get their own pools,
+  // so neither runs the other's tasks while waiting on its own
+  const bool pipelined = physics_rate > 0.0;
+  ThreadPool thread_pool(pipelined ? available_thread_count - 1
+                                   : available_thread_count);
+  std::unique_ptr<ThreadPool> render_pool;
+  if (pipelined)
+    render_pool = std::make_unique<ThreadPool>(1);
   Simulator simulator(WINDOW_WIDTH, PARTICLE_RADIUS, thread_pool);
-  Renderer renderer(window, thread_pool, simulator);
+  simulator.set_reorder_interval(REORDER_INTERVAL);
+  if (!simulator.set_sleeping(SLEEPING))
+    std::cerr << "sleeping is not available on the sparse grid\n";
+#ifndef VERLET_FIXED_CONFIG
+  // the fixed configuration's stencil decides
+  simulator.set_deterministic(DETERMINISTIC);
+  simulator.set_adaptive_substeps(ADAPTIVE_SUBSTEPS);
+#endif
+  if (recorder.is_open())
+    simulator.set_recorder(&recorder);
+  if (obstacle_pegs >= 0)
+    ObstacleCourse{WINDOW_WIDTH, obstacle_pegs}.build(simulator);
+  Renderer renderer(window, pipelined ? *render_pool : thread_pool,
+                    simulator);
   InputHandler input_handler(simulator, window, WINDOW_WIDTH);
+  DualSpawner spawner{WINDOW_WIDTH, PARTICLE_RADIUS, MAX_ENTITIES,
+                      SPAWN_VELOCITY, SPAWNER_SPACING, SPAWNER_COUNT};
 
   sf::Clock timer, fps_timer;
-  int r, g, b;
   sf::Font ui_font;
   ui_font.openFromFile(UI_FONT_PATH);
+  Simulator::PhaseTimings timing_sum;
+  int timed_frames = 0;
+  std::string timing_text;
+
+  // one simulation step, on whichever thread owns the simulator
+  auto step = [&](Simulator &target) {
+    if (replay_path.empty() && !spawner.is_full(target))
+      spawner.spawn(target, color_utils::get_time_based_rgb(
+                                timer.getElapsedTime().asSeconds()));
+
+    // replayed frames stand in for simulated ones, looping at the end
+    if (replay_path.empty())
+      target.update();
+    else if (!reader.read_frame(replay_frame++, target.entities))
+      replay_frame = 0;
+  };
+
+  std::unique_ptr<SimulationLoop> loop;
+  if (pipelined) {
+    loop = std::make_unique<SimulationLoop>(simulator, thread_pool,
+                                            physics_rate);
+    input_handler.set_loop(loop.get());
+    loop->start(step);
+  }
 
   while (window.isOpen()) {
-    unsigned entity_count = simulator.entities.size();
-    if (entity_count < MAX_ENTITIES) {
-      sf::Color rgb_color =
-          color_utils::get_time_based_rgb(timer.getElapsedTime().asSeconds());
-
-      for (unsigned spawner_idx = 0;
-           spawner_idx < std::min(SPAWNER_COUNT, MAX_ENTITIES - entity_count);
-           spawner_idx++) {
-        sf::Vector2f spawner_offset =
-            sf::Vector2f{0.0f, spawner_idx * SPAWNER_SPACING};
-        sf::Vector2f spawn_pos =
-            (spawner_idx % 2 == 0) ? spawn_pos_1 : spawn_pos_2;
-        sf::Vector2f spawn_angle =
-            (spawner_idx % 2 == 0) ? spawn_angle_1 : spawn_angle_2;
-
-        auto &new_entity =
-            simulator.add_entity(spawn_pos + spawner_offset, PARTICLE_RADIUS);
-
-        // std::cin >> r >> g >> b;
-        // new_entity.color = {static_cast<uint8_t>(r), static_cast<uint8_t>(g),
-        // static_cast<uint8_t>(b)};
-
-        new_entity.color = rgb_color;
-        simulator.set_entity_velocity(new_entity, SPAWN_VELOCITY * spawn_angle);
-      }
-    }
-
     input_handler.handle_input();
 
-    fps_timer.restart();
-    simulator.update();
-    float render_time_ms =
-        1.0 * fps_timer.getElapsedTime().asMicroseconds() / 1000;
-    renderer.new_render();
+    float update_time_ms;
+    size_t particle_count;
+    // timings of a step not counted yet, if any
+    const Simulator::PhaseTimings *timings = nullptr;
+    if (pipelined) {
+      if (loop->take_snapshot())
+        timings = &loop->snapshot().timings;
+      const FrameSnapshot &snapshot = loop->snapshot();
+      renderer.new_render(snapshot, loop->alpha(FrameSnapshot::clock::now()));
+      update_time_ms = snapshot.update_ms;
+      particle_count = snapshot.size();
+    } else {
+      fps_timer.restart();
+      step(simulator);
+      update_time_ms = 1.0 * fps_timer.getElapsedTime().asMicroseconds() / 1000;
+      renderer.new_render();
+      timings = &simulator.last_timings;
+      particle_count = simulator.entities.size();
+    }
+
+    if (replay_path.empty() && timings) {
+      timing_sum += *timings;
+      if (++timed_frames == TIMING_WINDOW) {
+        timing_text = phase_summary(timing_sum, timed_frames);
+        timing_sum = {};
+        timed_frames = 0;
+      }
+    }
 
     // draw performance metrics
     sf::Text metrics{ui_font};
 
-    metrics.setString(std::to_string(render_time_ms) + "ms render, " +
-                      std::to_string(simulator.entities.size()) + " particles");
+    metrics.setString(std::to_string(update_time_ms) + "ms update, " +
+                      std::to_string(particle_count) + " particles" +
+                      timing_text);
     metrics.setCharacterSize(18);
     metrics.setFillColor(sf::Color::White);
     window.draw(metrics);
 
     window.display();
   }
+
+  // the simulator is this thread's again
+  if (loop)
+    loop->stop();
+  simulator.set_recorder(nullptr);
+  if (!recorder.close(error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  if (profiler::enabled && !trace_path.empty() &&
+      !profiler::write_chrome_trace(trace_path)) {
+    std::cerr << "could not write " << trace_path << "\n";
+    return 1;
+  }
   return 0;
 }
@@ -0,0 +1,355 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "../thread_pool.hpp"
+#include "./cell_grid.hpp"
+
+// Barnes-Hut quadtree over point masses, long-range forces between N bodies
+// in O(N log N) instead of the direct sum's O(N^2)
+// https://en.wikipedia.org/wiki/Barnes%E2%80%93Hut_simulation
+//
+// a node whose side is less than `theta` times its distance to the query
+// point acts as its total mass at its center of mass, closer nodes are
+// opened, `theta` 0 opens every node, the exact direct sum, around 0.5 is the
+// usual trade-off, larger is faster and coarser
+// the force law is a softened inverse square, `mass * d / (|d|^2 + eps^2)^1.5`
+// for a body `d` away, so close bodies do not fling each other apart, their
+// contacts are the collision pass's job
+// masses may be negative, e.g. repellers, node centers are then weighted by
+// absolute mass, the approximation holds as long as nearby masses share a
+// sign
+//
+// rebuilt from scratch by `build()`, in parallel:
+// 1. each body gets a 32-bit Morton code of its position in the bounding
+//    square, `CellGrid::morton_code()` on 16-bit coordinates
+// 2. a counting sort on the top 16 bits, `CellGrid`'s parallel build, then
+//    each bucket is sorted on the rest, every node of the tree is then a
+//    contiguous range of the sorted bodies
+// 3. the top levels are split serially until there are a few subtrees per
+//    worker, the subtrees are built in parallel and appended
+struct QuadTree {
+  // bodies a leaf holds at most, except at `max_level`, where coincident
+  // bodies share a leaf anyway
+  static constexpr int leaf_size = 8;
+  static constexpr int max_level = 16;
+  // nodes pending on the traversal stack, at most 3 per level plus 4
+  static constexpr int max_stack = 3 * max_level + 4;
+
+  struct Node {
+    // center of mass and total mass
+    float x = 0.0f, y = 0.0f, mass = 0.0f;
+    // side of the node's square
+    float size = 0.0f;
+    // range of the sorted bodies
+    int first = 0, count = 0;
+    // children are consecutive, `child_count` 0 for a leaf
+    int first_child = 0, child_count = 0;
+  };
+
+  // `nodes[0]` is the root, empty without bodies
+  std::vector<Node> nodes;
+  // the bodies along the Z-order curve, `order[k]` is the input index of body
+  // `k`
+  std::vector<float> body_x, body_y, body_mass;
+  std::vector<int> order;
+
+  // reused across builds to avoid reallocating
+  std::vector<uint32_t> m_codes, m_sorted_codes;
+  std::vector<int> m_buckets_of;
+  CellGrid m_buckets;
+  std::vector<float> m_chunk_bounds;
+  // a node the serial split left to a worker, and the nodes it built
+  struct Pending {
+    int index, level;
+    float x0, y0, size;
+  };
+  std::vector<Pending> m_frontier, m_next_frontier;
+  std::vector<std::vector<Node>> m_subtrees;
+
+  size_t size() const { return order.size(); }
+
+  void build(const float *x, const float *y, const float *mass, int count,
+             ThreadPool &thread_pool) {
+    nodes.clear();
+    order.resize(count);
+    body_x.resize(count);
+    body_y.resize(count);
+    body_mass.resize(count);
+    if (count == 0)
+      return;
+    const int chunk_count = thread_pool.m_thread_count;
+
+    // bounding square, per chunk then reduced
+    m_chunk_bounds.assign(4 * chunk_count, 0.0f);
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int chunk = start; chunk < end; chunk++) {
+        int first, last;
+        CellGrid::chunk_range(chunk, chunk_count, count, first, last);
+        float min_x = INFINITY, min_y = INFINITY;
+        float max_x = -INFINITY, max_y = -INFINITY;
+        for (int i = first; i < last; i++) {
+          min_x = std::min(min_x, x[i]);
+          min_y = std::min(min_y, y[i]);
+          max_x = std::max(max_x, x[i]);
+          max_y = std::max(max_y, y[i]);
+        }
+        float *bounds = m_chunk_bounds.data() + 4 * chunk;
+        bounds[0] = min_x, bounds[1] = min_y, bounds[2] = max_x,
+        bounds[3] = max_y;
+      }
+    });
+    float min_x = INFINITY, min_y = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY;
+    for (int chunk = 0; chunk < chunk_count; chunk++) {
+      const float *bounds = m_chunk_bounds.data() + 4 * chunk;
+      min_x = std::min(min_x, bounds[0]);
+      min_y = std::min(min_y, bounds[1]);
+      max_x = std::max(max_x, bounds[2]);
+      max_y = std::max(max_y, bounds[3]);
+    }
+    // a little wider, so that the largest coordinate still quantizes inside
+    const float extent = std::max({max_x - min_x, max_y - min_y, 1.0f}) * 1.001f;
+    const float scale = 65536.0f / extent;
+
+    m_codes.resize(count);
+    m_buckets_of.resize(count);
+    thread_pool.parallel(count, [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        uint32_t col = std::min(65535.0f, (x[i] - min_x) * scale);
+        uint32_t row = std::min(65535.0f, (y[i] - min_y) * scale);
+        m_codes[i] = CellGrid::morton_code(col, row);
+        m_buckets_of[i] = m_codes[i] >> 16;
+      }
+    });
+
+    // 256 x 256 buckets are 65536, one per value of the top 16 bits
+    m_buckets.resize(256);
+    m_buckets.build(m_buckets_of, thread_pool);
+    order = m_buckets.indices;
+    thread_pool.parallel(m_buckets.cell_count(), [&](int start, int end) {
+      for (int bucket = start; bucket < end; bucket++)
+        std::sort(order.begin() + m_buckets.cell_start[bucket],
+                  order.begin() + m_buckets.cell_start[bucket + 1],
+                  [&](int a, int b) { return m_codes[a] < m_codes[b]; });
+    });
+    m_sorted_codes.resize(count);
+    thread_pool.parallel(count, [&](int start, int end) {
+      for (int k = start; k < end; k++) {
+        const int i = order[k];
+        m_sorted_codes[k] = m_codes[i];
+        body_x[k] = x[i];
+        body_y[k] = y[i];
+        body_mass[k] = mass[i];
+      }
+    });
+
+    build_nodes(min_x, min_y, extent, thread_pool);
+  }
+
+  // adds to (`ax`, `ay`) the acceleration the bodies exert at (`px`, `py`),
+  // `theta_sq` and `softening_sq` are squared
+  // a body at the query point itself adds nothing
+  void accumulate(float px, float py, float theta_sq, float softening_sq,
+                  float &ax, float &ay) const {
+    if (nodes.empty())
+      return;
+    int stack[max_stack];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+      const Node &node = nodes[stack[--depth]];
+      const float dx = node.x - px, dy = node.y - py;
+      const float d_sq = dx * dx + dy * dy;
+      if (node.size * node.size < theta_sq * d_sq) {
+        add_attraction(dx, dy, d_sq, node.mass, softening_sq, ax, ay);
+      } else if (node.child_count == 0) {
+        for (int k = node.first; k < node.first + node.count; k++) {
+          const float bx = body_x[k] - px, by = body_y[k] - py;
+          add_attraction(bx, by, bx * bx + by * by, body_mass[k], softening_sq,
+                         ax, ay);
+        }
+      } else {
+        for (int c = 0; c < node.child_count; c++)
+          stack[depth++] = node.first_child + c;
+      }
+    }
+  }
+
+private:
+  static void add_attraction(float dx, float dy, float d_sq, float mass,
+                             float softening_sq, float &ax, float &ay) {
+    const float r_sq = d_sq + softening_sq;
+    const float inverse = mass / (r_sq * std::sqrt(r_sq));
+    ax += dx * inverse;
+    ay += dy * inverse;
+  }
+
+  // the quadrant of level `level + 1` a code falls in, x in bit 0, y in bit 1
+  static int quadrant(uint32_t code, int level) {
+    return (code >> (2 * (max_level - 1 - level))) & 3;
+  }
+
+  // gives node `index` of `out`, whose range is set, its children, appended
+  // to `out`, or its bodies if it is a leaf, then its center of mass
+  void build_node(std::vector<Node> &out, int index, int level, float x0,
+                  float y0, float size, bool recurse) const {
+    out[index].size = size;
+    if (out[index].count <= leaf_size || level == max_level) {
+      out[index].child_count = 0;
+      finish_leaf(out[index]);
+      return;
+    }
+    split(out, index, level);
+    if (!recurse)
+      return;
+    const float half = 0.5f * size;
+    for (int c = 0; c < out[index].child_count; c++) {
+      const int child = out[index].first_child + c;
+      const int q = quadrant(m_sorted_codes[out[child].first], level);
+      build_node(out, child, level + 1, x0 + (q & 1) * half,
+                 y0 + (q >> 1) * half, half, true);
+    }
+    finish_parent(out, index);
+  }
+
+  // appends one child per non-empty quadrant of node `index`
+  void split(std::vector<Node> &out, int index, int level) const {
+    const int first = out[index].first, end = first + out[index].count;
+    out[index].first_child = out.size();
+    out[index].child_count = 0;
+    int start = first;
+    while (start < end) {
+      const int q = quadrant(m_sorted_codes[start], level);
+      const int stop =
+          std::partition_point(m_sorted_codes.begin() + start,
+                               m_sorted_codes.begin() + end,
+                               [&](uint32_t code) {
+                                 return quadrant(code, level) == q;
+                               }) -
+          m_sorted_codes.begin();
+      Node child;
+      child.first = start;
+      child.count = stop - start;
+      out.push_back(child);
+      out[index].child_count++;
+      start = stop;
+    }
+  }
+
+  void finish_leaf(Node &node) const {
+    float weight = 0.0f, sum_x = 0.0f, sum_y = 0.0f, mass = 0.0f;
+    for (int k = node.first; k < node.first + node.count; k++) {
+      const float w = std::abs(body_mass[k]);
+      weight += w;
+      sum_x += w * body_x[k];
+      sum_y += w * body_y[k];
+      mass += body_mass[k];
+    }
+    set_center(node, weight, sum_x, sum_y, mass);
+  }
+
+  static void finish_parent(std::vector<Node> &out, int index) {
+    float weight = 0.0f, sum_x = 0.0f, sum_y = 0.0f, mass = 0.0f;
+    const Node &node = out[index];
+    for (int c = node.first_child; c < node.first_child + node.child_count;
+         c++) {
+      const float w = std::abs(out[c].mass);
+      weight += w;
+      sum_x += w * out[c].x;
+      sum_y += w * out[c].y;
+      mass += out[c].mass;
+    }
+    set_center(out[index], weight, sum_x, sum_y, mass);
+  }
+
+  // massless nodes sit anywhere, they add nothing
+  static void set_center(Node &node, float weight, float sum_x, float sum_y,
+                         float mass) {
+    node.x = weight > 0.0f ? sum_x / weight : 0.0f;
+    node.y = weight > 0.0f ? sum_y / weight : 0.0f;
+    node.mass = mass;
+  }
+
+  void build_nodes(float x0, float y0, float extent, ThreadPool &thread_pool) {
+    Node root;
+    root.count = order.size();
+    nodes.push_back(root);
+
+    // split level by level until every worker has a few subtrees to build
+    const int target = 4 * thread_pool.m_thread_count;
+    m_frontier.assign(1, {0, 0, x0, y0, extent});
+    while (int(m_frontier.size()) < target) {
+      m_next_frontier.clear();
+      bool split_any = false;
+      for (const Pending &pending : m_frontier) {
+        build_node(nodes, pending.index, pending.level, pending.x0,
+                   pending.y0, pending.size, false);
+        const Node &node = nodes[pending.index];
+        if (node.child_count == 0)
+          continue;
+        split_any = true;
+        const float half = 0.5f * pending.size;
+        for (int c = 0; c < node.child_count; c++) {
+          const int child = node.first_child + c;
+          const int q = quadrant(m_sorted_codes[nodes[child].first],
+                                 pending.level);
+          m_next_frontier.push_back({child, pending.level + 1,
+                                     pending.x0 + (q & 1) * half,
+                                     pending.y0 + (q >> 1) * half, half});
+        }
+      }
+      if (!split_any)
+        break;
+      m_frontier.swap(m_next_frontier);
+    }
+    // nodes above the frontier, parents before their children
+    const int top_count = nodes.size();
+
+    // each subtree has its root at 0, its other nodes are appended to `nodes`
+    // in frontier order
+    const int subtree_count = m_frontier.size();
+    m_subtrees.resize(subtree_count);
+    thread_pool.parallel(
+        0, subtree_count,
+        [&](int start, int end) {
+          for (int s = start; s < end; s++) {
+            const Pending &pending = m_frontier[s];
+            std::vector<Node> &subtree = m_subtrees[s];
+            subtree.assign(1, nodes[pending.index]);
+            subtree[0].first_child = subtree[0].child_count = 0;
+            build_node(subtree, 0, pending.level, pending.x0, pending.y0,
+                       pending.size, true);
+          }
+        },
+        subtree_count);
+
+    std::vector<int> offsets(subtree_count + 1, top_count);
+    for (int s = 0; s < subtree_count; s++)
+      offsets[s + 1] = offsets[s] + m_subtrees[s].size() - 1;
+    nodes.resize(offsets[subtree_count]);
+    thread_pool.parallel(
+        0, subtree_count,
+        [&](int start, int end) {
+          for (int s = start; s < end; s++) {
+            // local `j` lands at `offsets[s] + j - 1`, the root in its slot
+            const std::vector<Node> &subtree = m_subtrees[s];
+            const int shift = offsets[s] - 1;
+            for (size_t j = 0; j < subtree.size(); j++) {
+              Node node = subtree[j];
+              if (node.child_count > 0)
+                node.first_child += shift;
+              nodes[j == 0 ? m_frontier[s].index : shift + j] = node;
+            }
+          }
+        },
+        subtree_count);
+
+    // the serially split nodes, bottom up, skipping the frontier roots
+    for (int index = top_count - 1; index >= 0; index--)
+      if (nodes[index].child_count > 0 && nodes[index].first_child < top_count)
+        finish_parent(nodes, index);
+  }
+};
@@ -0,0 +1,301 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "../thread_pool.hpp"
+
+// flat uniform grid, rebuilt from scratch by counting sort
+// the particle indices of cell `c` are the contiguous range
+// `indices[cell_start[c]] .. indices[cell_start[c + 1]]`
+// cells are laid out column-major, `c = col * width + row`, so a slice of
+// columns is a contiguous range of cells
+struct CellGrid {
+  // cells per side
+  int width = 0;
+  // exclusive prefix sum of the cell sizes, one extra entry for the end
+  std::vector<int> cell_start;
+  std::vector<int> indices;
+  // per-chunk cell histograms of the parallel build, `chunk * cells + cell`,
+  // kept to avoid reallocating every substep
+  std::vector<int> m_histograms;
+  // particles per cell range of the parallel prefix sum
+  std::vector<int> m_range_totals;
+
+  void resize(int width_) {
+    width = width_;
+    cell_start.assign(cell_count() + 1, 0);
+  }
+
+  int cell_count() const { return width * width; }
+
+  // -1 if outside the grid
+  int cell_index(int col, int row) const {
+    if (col < 0 || row < 0 || col >= width || row >= width)
+      return -1;
+    return col * width + row;
+  }
+
+  const int *begin(int cell) const { return indices.data() + cell_start[cell]; }
+
+  const int *end(int cell) const {
+    return indices.data() + cell_start[cell + 1];
+  }
+
+  bool empty(int cell) const { return cell_start[cell] == cell_start[cell + 1]; }
+
+  int size(int cell) const { return cell_start[cell + 1] - cell_start[cell]; }
+
+  // calls `fn(entry)` for every entry of the cells overlapping the box
+  // [min_x, max_x] x [min_y, max_y], on a grid of `cell_size` cells
+  template <typename Fn>
+  void for_each_in_box(float min_x, float min_y, float max_x, float max_y,
+                       float cell_size, Fn &&fn) const {
+    // clamp before converting, far out coordinates overflow an int
+    const float limit = width * cell_size;
+    if (!(max_x >= 0.0f && max_y >= 0.0f && min_x < limit && min_y < limit))
+      return;
+    const int first_col = std::max(0.0f, min_x) / cell_size;
+    const int last_col =
+        std::min(width - 1, static_cast<int>(std::min(max_x, limit) / cell_size));
+    const int first_row = std::max(0.0f, min_y) / cell_size;
+    const int last_row =
+        std::min(width - 1, static_cast<int>(std::min(max_y, limit) / cell_size));
+    if (first_row > last_row)
+      return;
+    // the rows of one column are a single run
+    for (int col = first_col; col <= last_col; col++) {
+      const int *it = begin(col * width + first_row);
+      const int *stop = end(col * width + last_row);
+      for (; it != stop; it++)
+        fn(*it);
+    }
+  }
+
+  // calls `fn(entry)` for every entry of the cells overlapping the square of
+  // half-size `reach` around (x, y), on a grid of `cell_size` cells
+  template <typename Fn>
+  void for_each_near(float x, float y, float reach, float cell_size,
+                     Fn &&fn) const {
+    for_each_in_box(x - reach, y - reach, x + reach, y + reach, cell_size, fn);
+  }
+
+  // calls `fn(entry)` for every entry of the cells on the square ring `ring`
+  // cells away from cell (col, row), ring 0 being the cell itself
+  // false once the ring lies entirely outside the grid
+  template <typename Fn>
+  bool for_each_on_ring(int col, int row, int ring, Fn &&fn) const {
+    const int first_col = col - ring, last_col = col + ring;
+    const int first_row = row - ring, last_row = row + ring;
+    if (first_col < 0 && first_row < 0 && last_col >= width &&
+        last_row >= width)
+      return false;
+
+    auto visit_run = [&](int c, int r_first, int r_last) {
+      if (c < 0 || c >= width)
+        return;
+      r_first = std::max(0, r_first);
+      r_last = std::min(width - 1, r_last);
+      if (r_first > r_last)
+        return;
+      for (const int *it = begin(c * width + r_first),
+                     *stop = end(c * width + r_last);
+           it != stop; it++)
+        fn(*it);
+    };
+    if (ring == 0) {
+      visit_run(col, row, row);
+      return true;
+    }
+    // the two side columns in full, then the top and bottom cells between
+    visit_run(first_col, first_row, last_row);
+    visit_run(last_col, first_row, last_row);
+    for (int c = first_col + 1; c < last_col; c++) {
+      visit_run(c, first_row, first_row);
+      visit_run(c, last_row, last_row);
+    }
+    return true;
+  }
+
+  // particles per column and per row
+  // a column is a contiguous range of cells, its count is a single difference
+  void line_counts(std::vector<int> &columns, std::vector<int> &rows) const {
+    columns.assign(width, 0);
+    rows.assign(width, 0);
+    for (int col = 0; col < width; col++) {
+      const int first = col * width;
+      columns[col] = cell_start[first + width] - cell_start[first];
+      for (int row = 0; row < width; row++)
+        rows[row] += size(first + row);
+    }
+  }
+
+  // interleaves the bits of `col` and `row`
+  // https://en.wikipedia.org/wiki/Z-order_curve
+  static uint32_t morton_code(uint32_t col, uint32_t row) {
+    auto spread = [](uint32_t v) {
+      v &= 0xffff;
+      v = (v | (v << 8)) & 0x00ff00ff;
+      v = (v | (v << 4)) & 0x0f0f0f0f;
+      v = (v | (v << 2)) & 0x33333333;
+      v = (v | (v << 1)) & 0x55555555;
+      return v;
+    };
+    return spread(col) | (spread(row) << 1);
+  }
+
+  // every cell, sorted along the Z-order curve
+  std::vector<int> morton_order() const {
+    std::vector<int> order(cell_count());
+    for (int c = 0; c < cell_count(); c++)
+      order[c] = c;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+      return morton_code(a / width, a % width) <
+             morton_code(b / width, b % width);
+    });
+    return order;
+  }
+
+  // `cells[i]` is the cell of particle `i`, -1 drops it from the grid
+  // particles keep their relative order within a cell
+  void build(const std::vector<int> &cells) {
+    const int count = cell_count();
+    cell_start.assign(count + 1, 0);
+
+    for (int cell : cells)
+      if (cell >= 0)
+        cell_start[cell]++;
+
+    // inclusive prefix sum, `cell_start[c]` is now the end of cell `c`
+    for (int c = 1; c < count; c++)
+      cell_start[c] += cell_start[c - 1];
+    cell_start[count] = count > 0 ? cell_start[count - 1] : 0;
+
+    indices.resize(cell_start[count]);
+
+    // scatter back to front, decrementing each end down to the cell's start
+    for (int i = cells.size() - 1; i >= 0; i--)
+      if (cells[i] >= 0)
+        indices[--cell_start[cells[i]]] = i;
+  }
+
+  // particles [first, last) of `chunk` out of `chunk_count`, every stage of
+  // the parallel build splits the particles the same way
+  static void chunk_range(int chunk, int chunk_count, int entity_count,
+                          int &first, int &last) {
+    const int chunk_size = (entity_count + chunk_count - 1) / chunk_count;
+    first = std::min(entity_count, chunk * chunk_size);
+    last = std::min(entity_count, first + chunk_size);
+  }
+
+  // zeroed cell histogram of `chunk`, after `begin_build()`
+  int *clear_histogram(int chunk) {
+    const int count = cell_count();
+    int *histogram = m_histograms.data() + static_cast<size_t>(chunk) * count;
+    std::fill(histogram, histogram + count, 0);
+    return histogram;
+  }
+
+  // first stage of the parallel build, the caller then fills the histogram of
+  // every chunk and calls `finish_build()`
+  // split out so the pass that computes the cells can count them on the way
+  void begin_build(int chunk_count) {
+    m_histograms.resize(static_cast<size_t>(chunk_count) * cell_count());
+  }
+
+  // same result as `build()`, bit for bit, spread over the pool's workers
+  // 1. each chunk of particles counts its own cell histogram
+  // 2. a prefix sum over (cell, chunk) turns the counts into write cursors,
+  //    parallel over ranges of cells plus a short serial scan of range totals
+  // 3. each chunk scatters its particles, in order, through its cursors
+  // lower chunks write first within a cell, so the particle order matches the
+  // serial build
+  void build(const std::vector<int> &cells, ThreadPool &thread_pool) {
+    const int chunk_count = thread_pool.m_thread_count;
+    if (chunk_count <= 1)
+      return build(cells);
+
+    const int entity_count = cells.size();
+    begin_build(chunk_count);
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int chunk = start; chunk < end; chunk++) {
+        int *histogram = clear_histogram(chunk);
+        int first, last;
+        chunk_range(chunk, chunk_count, entity_count, first, last);
+        for (int i = first; i < last; i++)
+          if (cells[i] >= 0)
+            histogram[cells[i]]++;
+      }
+    });
+
+    finish_build(cells, thread_pool);
+  }
+
+  // stages 2 and 3, the histograms must hold each chunk's counts of `cells`
+  // for `thread_pool.m_thread_count` chunks
+  void finish_build(const std::vector<int> &cells, ThreadPool &thread_pool) {
+    const int chunk_count = thread_pool.m_thread_count;
+    const int count = cell_count();
+    const int entity_count = cells.size();
+    const int range_size = (count + chunk_count - 1) / chunk_count;
+
+    cell_start.resize(count + 1);
+    m_range_totals.resize(chunk_count);
+
+    // cell sizes and per-range totals
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int range = start; range < end; range++) {
+        int first = std::min(count, range * range_size);
+        int last = std::min(count, first + range_size);
+        int total = 0;
+        for (int c = first; c < last; c++) {
+          int size = 0;
+          for (int chunk = 0; chunk < chunk_count; chunk++)
+            size += m_histograms[static_cast<size_t>(chunk) * count + c];
+          cell_start[c] = size;
+          total += size;
+        }
+        m_range_totals[range] = total;
+      }
+    });
+
+    // exclusive scan of the range totals, serial but only `chunk_count` long
+    int running = 0;
+    for (int range = 0; range < chunk_count; range++) {
+      int total = m_range_totals[range];
+      m_range_totals[range] = running;
+      running += total;
+    }
+    cell_start[count] = running;
+    indices.resize(running);
+
+    // cell starts and per-chunk write cursors
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int range = start; range < end; range++) {
+        int first = std::min(count, range * range_size);
+        int last = std::min(count, first + range_size);
+        int offset = m_range_totals[range];
+        for (int c = first; c < last; c++) {
+          cell_start[c] = offset;
+          for (int chunk = 0; chunk < chunk_count; chunk++) {
+            int &slot = m_histograms[static_cast<size_t>(chunk) * count + c];
+            int chunk_cell_size = slot;
+            slot = offset;
+            offset += chunk_cell_size;
+          }
+        }
+      }
+    });
+
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int chunk = start; chunk < end; chunk++) {
+        int *cursor = m_histograms.data() + static_cast<size_t>(chunk) * count;
+        int first, last;
+        chunk_range(chunk, chunk_count, entity_count, first, last);
+        for (int i = first; i < last; i++)
+          if (cells[i] >= 0)
+            indices[cursor[cells[i]]++] = i;
+      }
+    });
+  }
+};
@@ -0,0 +1,353 @@
+#pragma once
+#include <SFML/System/Vector2.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "./cell_grid.hpp"
+
+// static obstacles for funnels, pegs, ramps and containers: line segments
+// with a thickness, circles and convex polygons
+// each shape is rasterized once into a grid of the simulator's level-0 cells,
+// a particle only tests the shapes listed for the cell its center is in, so
+// the cost per particle depends on the shapes around it, not on their number
+// `sdf_spacing` bakes the union of the shapes into a sampled signed distance
+// field instead, one bilinear lookup per particle near a shape however many
+// shapes overlap there, at the price of rounding off sharp corners
+//
+// a contact pushes the particle out along the surface normal and moves its
+// previous position along: the velocity into the surface is dropped, the
+// velocity along it is kept
+// particles move at most about their radius per substep, so even a segment
+// without thickness is never crossed in a single step
+struct ColliderSet {
+  enum class Kind : uint8_t { Segment, Circle, Polygon };
+
+  struct Shape {
+    Kind kind = Kind::Segment;
+    // into `points` and `normals`: a segment's two ends, a circle's center, a
+    // polygon's corners, counterclockwise in the usual y-up sense
+    int first_point = 0;
+    int point_count = 0;
+    // half a segment's thickness, a circle's radius, 0 for a polygon
+    float radius = 0.0f;
+    // bounding box, `radius` included
+    float min_x = 0.0f, min_y = 0.0f, max_x = 0.0f, max_y = 0.0f;
+  };
+
+  std::vector<Shape> shapes;
+  std::vector<sf::Vector2f> points;
+  // per polygon corner, the outward unit normal of the edge from it to the
+  // next corner, parallel to `points`
+  std::vector<sf::Vector2f> normals;
+  // bumped on every change to `shapes`, e.g. for a renderer caching them
+  int version = 0;
+
+  // px, the sampling interval of the distance field, 0 for the exact shapes
+  float sdf_spacing = 0.0f;
+
+  // the rasterization, rebuilt by `build()` whenever `m_dirty`
+  // shapes within `m_margin` of some point of a cell are listed for it, the
+  // grid's entries are shape indices in the order they were added
+  CellGrid m_grid;
+  float m_cell_size = 0.0f;
+  float m_inverse_cell_size = 0.0f;
+  // at least the largest particle radius
+  float m_margin = 0.0f;
+  bool m_dirty = false;
+  // `m_sdf_nodes` x `m_sdf_nodes` distances, column-major like the grid,
+  // clamped to `m_margin`
+  std::vector<float> m_sdf;
+  int m_sdf_nodes = 0;
+
+  size_t size() const { return shapes.size(); }
+
+  bool empty() const { return shapes.empty(); }
+
+  void clear() {
+    shapes.clear();
+    points.clear();
+    normals.clear();
+    m_sdf.clear();
+    version++;
+    m_dirty = true;
+  }
+
+  // `thickness` 0 is a line, touched by particles at their radius
+  void add_segment(sf::Vector2f a, sf::Vector2f b, float thickness) {
+    add_shape(Kind::Segment, {a, b}, 0.5f * thickness);
+  }
+
+  void add_circle(sf::Vector2f center, float radius) {
+    add_shape(Kind::Circle, {center}, radius);
+  }
+
+  // false, and nothing added, unless the corners, in either winding, make a
+  // convex polygon of positive area
+  bool add_polygon(std::vector<sf::Vector2f> corners) {
+    const int count = corners.size();
+    if (count < 3)
+      return false;
+    float area = 0.0f;
+    for (int k = 0; k < count; k++) {
+      const sf::Vector2f a = corners[k], b = corners[(k + 1) % count];
+      area += a.x * b.y - b.x * a.y;
+    }
+    if (!(std::abs(area) > 0.0f))
+      return false;
+    if (area < 0.0f)
+      std::reverse(corners.begin(), corners.end());
+    // every turn the same way
+    for (int k = 0; k < count; k++) {
+      const sf::Vector2f a = corners[k], b = corners[(k + 1) % count],
+                         c = corners[(k + 2) % count];
+      if ((b - a).cross(c - b) < 0.0f)
+        return false;
+    }
+    add_shape(Kind::Polygon, std::move(corners), 0.0f);
+    return true;
+  }
+
+  // particles up to `radius` are caught, a larger one re-rasterizes the shapes
+  // on the next `build()`
+  void reserve_margin(float radius) {
+    if (radius > m_margin) {
+      m_margin = radius;
+      m_dirty = true;
+    }
+  }
+
+  void set_sdf_spacing(float spacing) {
+    sdf_spacing = std::max(0.0f, spacing);
+    m_dirty = true;
+  }
+
+  // signed distance from (`px`, `py`) to `shape`'s surface, negative
+  // inside, `nx`/`ny` receive the direction out of the shape
+  float distance(const Shape &shape, float px, float py, float &nx,
+                 float &ny) const {
+    const sf::Vector2f *corner = points.data() + shape.first_point;
+    if (shape.kind == Kind::Circle)
+      return point_distance(corner[0], corner[0], px, py, nx, ny) -
+             shape.radius;
+    if (shape.kind == Kind::Segment)
+      return point_distance(corner[0], corner[1], px, py, nx, ny) -
+             shape.radius;
+
+    // inside, the nearest edge is the one whose line is nearest
+    const sf::Vector2f *normal = normals.data() + shape.first_point;
+    int nearest = 0;
+    float inside = -INFINITY;
+    for (int k = 0; k < shape.point_count; k++) {
+      float d = normal[k].x * (px - corner[k].x) + normal[k].y * (py - corner[k].y);
+      if (d > inside)
+        inside = d, nearest = k;
+    }
+    if (inside <= 0.0f) {
+      nx = normal[nearest].x;
+      ny = normal[nearest].y;
+      return inside;
+    }
+    // outside, the nearest point is on an edge facing the point
+    float best = INFINITY;
+    for (int k = 0; k < shape.point_count; k++) {
+      if (normal[k].x * (px - corner[k].x) + normal[k].y * (py - corner[k].y) <= 0.0f)
+        continue;
+      const sf::Vector2f next = corner[k + 1 < shape.point_count ? k + 1 : 0];
+      float edge_nx, edge_ny;
+      float d = point_distance(corner[k], next, px, py, edge_nx, edge_ny);
+      if (d < best)
+        best = d, nx = edge_nx, ny = edge_ny;
+    }
+    return best;
+  }
+
+  // rasterizes the shapes onto `cell_count` x `cell_count` cells of
+  // `cell_size` px, then bakes the distance field if one is asked for
+  void build(float cell_size, int cell_count) {
+    m_cell_size = cell_size;
+    m_inverse_cell_size = 1.0f / cell_size;
+    m_dirty = false;
+    // no shapes, no raster, `resolve()` is not called then
+    m_grid.resize(shapes.empty() ? 0 : cell_count);
+    m_sdf.clear();
+    m_sdf_nodes = 0;
+    if (shapes.empty()) {
+      m_grid.build({});
+      return;
+    }
+
+    // a cell whose center is within `reach` of a shape has a point within
+    // `m_margin` of it
+    const float reach = m_margin + cell_size * float(M_SQRT1_2);
+    std::vector<int> cells, owners;
+    for (int s = 0; s < int(shapes.size()); s++) {
+      const Shape &shape = shapes[s];
+      const int first_col = std::max(0.0f, (shape.min_x - m_margin) / cell_size);
+      const int first_row = std::max(0.0f, (shape.min_y - m_margin) / cell_size);
+      const int last_col = std::min<float>(cell_count - 1, (shape.max_x + m_margin) / cell_size);
+      const int last_row = std::min<float>(cell_count - 1, (shape.max_y + m_margin) / cell_size);
+      for (int col = first_col; col <= last_col; col++)
+        for (int row = first_row; row <= last_row; row++) {
+          float nx, ny;
+          if (distance(shape, (col + 0.5f) * cell_size,
+                       (row + 0.5f) * cell_size, nx, ny) > reach)
+            continue;
+          cells.push_back(m_grid.cell_index(col, row));
+          owners.push_back(s);
+        }
+    }
+    m_grid.build(cells);
+    for (int &entry : m_grid.indices)
+      entry = owners[entry];
+
+    if (sdf_spacing > 0.0f)
+      bake_sdf(cell_count * cell_size);
+  }
+
+  // pushes a particle of `radius` at (`px`, `py`) out of every shape it
+  // overlaps, in the order they were added, and moves its previous position
+  // (`last_x`, `last_y`) so that no velocity into the shape is left
+  // `build()` must be current
+  void resolve(float &px, float &py, float &last_x, float &last_y,
+               float radius) const {
+    const int width = m_grid.width;
+    const int col = std::clamp(static_cast<int>(px * m_inverse_cell_size), 0, width - 1);
+    const int row = std::clamp(static_cast<int>(py * m_inverse_cell_size), 0, width - 1);
+    const int cell = col * width + row;
+    if (m_grid.empty(cell))
+      return;
+
+    float nx = 0.0f, ny = 0.0f;
+    if (!m_sdf.empty()) {
+      float d = sample_sdf(px, py, radius, nx, ny);
+      if (d < radius)
+        push_out(px, py, last_x, last_y, nx, ny, radius - d);
+      return;
+    }
+    for (const int *it = m_grid.begin(cell); it != m_grid.end(cell); ++it) {
+      const Shape &shape = shapes[*it];
+      // most listed shapes are out of reach, the box says so without a
+      // square root
+      if (px + radius < shape.min_x || px - radius > shape.max_x ||
+          py + radius < shape.min_y || py - radius > shape.max_y)
+        continue;
+      float d = distance(shape, px, py, nx, ny);
+      if (d < radius)
+        push_out(px, py, last_x, last_y, nx, ny, radius - d);
+    }
+  }
+
+private:
+  // moves the particle `depth` along the unit normal (`nx`, `ny`), the
+  // previous position follows by the velocity's component into the surface
+  static void push_out(float &px, float &py, float &last_x, float &last_y,
+                       float nx, float ny, float depth) {
+    px += nx * depth;
+    py += ny * depth;
+    const float into = (px - last_x) * nx + (py - last_y) * ny;
+    if (into < 0.0f) {
+      last_x += nx * into;
+      last_y += ny * into;
+    }
+  }
+
+  void add_shape(Kind kind, std::vector<sf::Vector2f> corners, float radius) {
+    Shape shape;
+    shape.kind = kind;
+    shape.first_point = points.size();
+    shape.point_count = corners.size();
+    shape.radius = radius;
+    shape.min_x = shape.min_y = INFINITY;
+    shape.max_x = shape.max_y = -INFINITY;
+    for (int k = 0; k < shape.point_count; k++) {
+      points.push_back(corners[k]);
+      shape.min_x = std::min(shape.min_x, corners[k].x - radius);
+      shape.min_y = std::min(shape.min_y, corners[k].y - radius);
+      shape.max_x = std::max(shape.max_x, corners[k].x + radius);
+      shape.max_y = std::max(shape.max_y, corners[k].y + radius);
+      sf::Vector2f edge = corners[(k + 1) % shape.point_count] - corners[k];
+      float length = edge.length();
+      normals.push_back(kind == Kind::Polygon && length > 0.0f
+                            ? sf::Vector2f{edge.y, -edge.x} / length
+                            : sf::Vector2f{});
+    }
+    shapes.push_back(shape);
+    version++;
+    m_dirty = true;
+  }
+
+  // distance from (`px`, `py`) to the segment from `a` to `b`, with the
+  // direction away from it, the segment's normal if the point is on it
+  static float point_distance(sf::Vector2f a, sf::Vector2f b, float px,
+                              float py, float &nx, float &ny) {
+    const float ab_x = b.x - a.x, ab_y = b.y - a.y;
+    const float length_sq = ab_x * ab_x + ab_y * ab_y;
+    float t = length_sq > 0.0f
+                  ? std::clamp(((px - a.x) * ab_x + (py - a.y) * ab_y) / length_sq, 0.0f, 1.0f)
+                  : 0.0f;
+    const float dx = px - (a.x + t * ab_x), dy = py - (a.y + t * ab_y);
+    const float d = std::sqrt(dx * dx + dy * dy);
+    if (d > 0.0f) {
+      nx = dx / d, ny = dy / d;
+    } else if (length_sq > 0.0f) {
+      const float length = std::sqrt(length_sq);
+      nx = ab_y / length, ny = -ab_x / length;
+    } else {
+      // a circle's exact center, straight up
+      nx = 0.0f, ny = -1.0f;
+    }
+    return d;
+  }
+
+  // nodes at multiples of `sdf_spacing` over a `world_size` square, each the
+  // distance to the nearest shape listed for its cell, that covers every
+  // shape within `m_margin` of it, farther ones read as `m_margin`
+  void bake_sdf(float world_size) {
+    const int cells = m_grid.width;
+    m_sdf_nodes = static_cast<int>(std::ceil(world_size / sdf_spacing)) + 1;
+    m_sdf.assign(static_cast<size_t>(m_sdf_nodes) * m_sdf_nodes, m_margin);
+    for (int i = 0; i < m_sdf_nodes; i++)
+      for (int j = 0; j < m_sdf_nodes; j++) {
+        const float px = i * sdf_spacing, py = j * sdf_spacing;
+        const int col = std::min(cells - 1, static_cast<int>(px / m_cell_size));
+        const int row = std::min(cells - 1, static_cast<int>(py / m_cell_size));
+        const int cell = col * cells + row;
+        float &node = m_sdf[static_cast<size_t>(i) * m_sdf_nodes + j];
+        for (const int *it = m_grid.begin(cell); it != m_grid.end(cell); ++it) {
+          float nx, ny;
+          node = std::min(node, distance(shapes[*it], px, py, nx, ny));
+        }
+      }
+  }
+
+  // bilinear in the node square around the point, the normal from the same
+  // interpolation's gradient, only worked out for a distance below `radius`
+  float sample_sdf(float px, float py, float radius, float &nx,
+                   float &ny) const {
+    const float u = std::clamp(px / sdf_spacing, 0.0f, m_sdf_nodes - 1.001f);
+    const float v = std::clamp(py / sdf_spacing, 0.0f, m_sdf_nodes - 1.001f);
+    const int i = u, j = v;
+    const float fx = u - i, fy = v - j;
+    const float *column = m_sdf.data() + static_cast<size_t>(i) * m_sdf_nodes + j;
+    const float d00 = column[0], d01 = column[1];
+    const float d10 = column[m_sdf_nodes], d11 = column[m_sdf_nodes + 1];
+    const float d = (d00 * (1.0f - fy) + d01 * fy) * (1.0f - fx) +
+                    (d10 * (1.0f - fy) + d11 * fy) * fx;
+    if (d >= radius)
+      return d;
+
+    const float gx = (d10 - d00) * (1.0f - fy) + (d11 - d01) * fy;
+    const float gy = (d01 - d00) * (1.0f - fx) + (d11 - d10) * fx;
+    const float length = std::sqrt(gx * gx + gy * gy);
+    if (!(length > 0.0f)) {
+      // flat, no way out to push along
+      nx = ny = 0.0f;
+      return m_margin;
+    }
+    nx = gx / length;
+    ny = gy / length;
+    return d;
+  }
+};
@@ -0,0 +1,481 @@
+#pragma once
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VERLET_X86_KERNELS 1
+#endif
+
+// narrow-phase kernels, they push particle `i` and every overlapping candidate
+// apart by a quarter of their overlap each
+// all but `resolve_pair()`/`resolve_mixed()` assume every particle has the
+// same radius, `min_dist` is its diameter
+// `candidates` may contain `i` itself, it is skipped
+// `candidates` must stay readable, with valid particle indices, up to `count`
+// rounded up to `padding` entries: the SIMD kernels load whole batches and mask
+// off the lanes past `count`
+//
+// the scalar kernel applies each pair's correction before testing the next
+// candidate, the SIMD kernels test a batch of 4 (SSE) or 8 (AVX2) candidates
+// against the same position of `i`, apply the whole batch, `i` included, and
+// test the next batch against `i`'s new position
+// tolerance of the SIMD kernels against the scalar one:
+// - `1 / dist` comes from rsqrt refined by one Newton step, relative error
+//   below 2^-22 (~2.4e-7)
+// - when several candidates of a batch overlap `i`, they all see `i` where it
+//   was before the batch, so a correction may differ by up to the sum of the
+//   other corrections in its batch, each at most `0.25 * min_dist`
+// - coincident particles (dist == 0) are skipped by every kernel, rather
+//   than turned into NaN
+namespace collision_kernels {
+
+enum class Kind { Auto, Scalar, Sse, Avx2 };
+
+// widest batch of any kernel
+constexpr int padding = 8;
+
+using Kernel = void (*)(float *x, float *y, int i, const int *candidates,
+                        int count, float min_dist);
+
+// Jacobi variants, they only read positions and return the sum of the
+// corrections particle `i` receives, in `sum_x` and `sum_y`
+// the sum runs in candidate order, so for a given kernel the result depends
+// on nothing but the candidate list
+using GatherKernel = void (*)(const float *x, const float *y, int i,
+                              const int *candidates, int count, float min_dist,
+                              float &sum_x, float &sum_y);
+
+inline void resolve_scalar(float *x, float *y, int i, const int *candidates,
+                           int count, float min_dist) {
+  for (int k = 0; k < count; k++) {
+    int j = candidates[k];
+    if (i == j)
+      continue;
+
+    float v_x = x[i] - x[j];
+    float v_y = y[i] - y[j];
+    float dist = v_x * v_x + v_y * v_y;
+
+    // coincident particles have no direction to separate along
+    if (dist >= min_dist * min_dist || dist == 0.0f)
+      continue;
+
+    dist = sqrt(dist);
+    float delta = 0.25f * (min_dist - dist);
+    float n_x = v_x / dist * delta;
+    float n_y = v_y / dist * delta;
+
+    x[i] += n_x;
+    y[i] += n_y;
+    x[j] -= n_x;
+    y[j] -= n_y;
+
+    // particles with greater mass move less when colliding
+    // not relevant here since all particles have the same mass, see
+    // `resolve_pair()` for mixed sizes
+  }
+}
+
+inline void gather_scalar(const float *x, const float *y, int i,
+                          const int *candidates, int count, float min_dist,
+                          float &sum_x, float &sum_y) {
+  sum_x = 0.0f;
+  sum_y = 0.0f;
+  for (int k = 0; k < count; k++) {
+    int j = candidates[k];
+    if (i == j)
+      continue;
+
+    float v_x = x[i] - x[j];
+    float v_y = y[i] - y[j];
+    float dist = v_x * v_x + v_y * v_y;
+
+    if (dist >= min_dist * min_dist || dist == 0.0f)
+      continue;
+
+    dist = sqrt(dist);
+    float delta = 0.25f * (min_dist - dist);
+    sum_x += v_x / dist * delta;
+    sum_y += v_y / dist * delta;
+  }
+}
+
+// mixed sizes: the contact distance is the sum of both radii, and the
+// separation is split by mass, proportional to the area, so the larger
+// particle moves less
+// with equal radii each moves a quarter of the overlap, like the kernels
+// above
+inline void resolve_pair(float *x, float *y, const float *radius, int i,
+                         int j) {
+  float v_x = x[i] - x[j];
+  float v_y = y[i] - y[j];
+  float dist = v_x * v_x + v_y * v_y;
+  float min_dist = radius[i] + radius[j];
+
+  // coincident particles have no direction to separate along
+  if (dist >= min_dist * min_dist || dist == 0.0f)
+    return;
+
+  dist = sqrt(dist);
+  float mass_i = radius[i] * radius[i];
+  float mass_j = radius[j] * radius[j];
+  float scale = 0.5f * (min_dist - dist) / (dist * (mass_i + mass_j));
+
+  x[i] += v_x * scale * mass_j;
+  y[i] += v_y * scale * mass_j;
+  x[j] -= v_x * scale * mass_i;
+  y[j] -= v_y * scale * mass_i;
+}
+
+// Jacobi variant of `resolve_mixed()`
+inline void gather_mixed(const float *x, const float *y, const float *radius,
+                         int i, const int *candidates, int count, float &sum_x,
+                         float &sum_y) {
+  sum_x = 0.0f;
+  sum_y = 0.0f;
+  for (int k = 0; k < count; k++) {
+    int j = candidates[k];
+    if (i == j)
+      continue;
+
+    float v_x = x[i] - x[j];
+    float v_y = y[i] - y[j];
+    float dist = v_x * v_x + v_y * v_y;
+    float min_dist = radius[i] + radius[j];
+    if (dist >= min_dist * min_dist || dist == 0.0f)
+      continue;
+
+    dist = sqrt(dist);
+    float mass_i = radius[i] * radius[i];
+    float mass_j = radius[j] * radius[j];
+    float scale = 0.5f * (min_dist - dist) / (dist * (mass_i + mass_j));
+    sum_x += v_x * scale * mass_j;
+    sum_y += v_y * scale * mass_j;
+  }
+}
+
+// `resolve_pair()` against every candidate, scalar only, the uniform kernels
+// stay the fast path
+inline void resolve_mixed(float *x, float *y, const float *radius, int i,
+                          const int *candidates, int count) {
+  for (int k = 0; k < count; k++)
+    if (candidates[k] != i)
+      resolve_pair(x, y, radius, i, candidates[k]);
+}
+
+#ifdef VERLET_X86_KERNELS
+
+inline float horizontal_sum(__m128 v) {
+  __m128 sum = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2"))) inline float horizontal_sum(__m256 v) {
+  return horizontal_sum(
+      _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+// SSE2 is part of x86-64, so this kernel needs no dispatch
+inline void resolve_sse(float *x, float *y, int i, const int *candidates,
+                        int count, float min_dist) {
+  __m128 x_i = _mm_set1_ps(x[i]);
+  __m128 y_i = _mm_set1_ps(y[i]);
+  const __m128 min_dist_v = _mm_set1_ps(min_dist);
+  const __m128 min_dist_sq = _mm_set1_ps(min_dist * min_dist);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128i self = _mm_set1_epi32(i);
+
+  const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+
+  alignas(16) float n_x[4], n_y[4];
+
+  for (int k = 0; k < count; k += 4) {
+    const int *batch = candidates + k;
+    __m128 x_j = _mm_set_ps(x[batch[3]], x[batch[2]], x[batch[1]], x[batch[0]]);
+    __m128 y_j = _mm_set_ps(y[batch[3]], y[batch[2]], y[batch[1]], y[batch[0]]);
+    __m128 v_x = _mm_sub_ps(x_i, x_j);
+    __m128 v_y = _mm_sub_ps(y_i, y_j);
+    __m128 dist_sq = _mm_add_ps(_mm_mul_ps(v_x, v_x), _mm_mul_ps(v_y, v_y));
+
+    __m128 mask = _mm_and_ps(_mm_cmplt_ps(dist_sq, min_dist_sq),
+                             _mm_cmpgt_ps(dist_sq, zero));
+    // drop `i` itself and the padding past `count`
+    __m128i ids = _mm_loadu_si128(reinterpret_cast<const __m128i *>(batch));
+    __m128i valid = _mm_andnot_si128(
+        _mm_cmpeq_epi32(ids, self),
+        _mm_cmplt_epi32(lanes, _mm_set1_epi32(count - k)));
+    mask = _mm_and_ps(_mm_castsi128_ps(valid), mask);
+    int hits = _mm_movemask_ps(mask);
+    if (hits == 0)
+      continue;
+
+    // 1 / dist, one Newton-Raphson step: r' = r * (1.5 - 0.5 * d * r * r)
+    __m128 inv_dist = _mm_rsqrt_ps(dist_sq);
+    inv_dist = _mm_mul_ps(
+        inv_dist,
+        _mm_sub_ps(_mm_set1_ps(1.5f),
+                   _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), dist_sq),
+                              _mm_mul_ps(inv_dist, inv_dist))));
+    __m128 dist = _mm_mul_ps(dist_sq, inv_dist);
+    __m128 delta =
+        _mm_mul_ps(_mm_set1_ps(0.25f), _mm_sub_ps(min_dist_v, dist));
+    // masked lanes may hold inf or NaN, the `and` zeroes them
+    __m128 scale = _mm_and_ps(mask, _mm_mul_ps(inv_dist, delta));
+
+    __m128 batch_x = _mm_mul_ps(v_x, scale);
+    __m128 batch_y = _mm_mul_ps(v_y, scale);
+    _mm_store_ps(n_x, batch_x);
+    _mm_store_ps(n_y, batch_y);
+    for (; hits != 0; hits &= hits - 1) {
+      int lane = __builtin_ctz(hits);
+      x[batch[lane]] -= n_x[lane];
+      y[batch[lane]] -= n_y[lane];
+    }
+
+    // the next batch sees `i` where this one left it
+    x[i] += horizontal_sum(batch_x);
+    y[i] += horizontal_sum(batch_y);
+    x_i = _mm_set1_ps(x[i]);
+    y_i = _mm_set1_ps(y[i]);
+  }
+}
+
+inline void gather_sse(const float *x, const float *y, int i,
+                       const int *candidates, int count, float min_dist,
+                       float &out_x, float &out_y) {
+  const __m128 x_i = _mm_set1_ps(x[i]);
+  const __m128 y_i = _mm_set1_ps(y[i]);
+  const __m128 min_dist_v = _mm_set1_ps(min_dist);
+  const __m128 min_dist_sq = _mm_set1_ps(min_dist * min_dist);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128i self = _mm_set1_epi32(i);
+  const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+
+  __m128 sum_x = zero, sum_y = zero;
+  for (int k = 0; k < count; k += 4) {
+    const int *batch = candidates + k;
+    __m128 x_j = _mm_set_ps(x[batch[3]], x[batch[2]], x[batch[1]], x[batch[0]]);
+    __m128 y_j = _mm_set_ps(y[batch[3]], y[batch[2]], y[batch[1]], y[batch[0]]);
+    __m128 v_x = _mm_sub_ps(x_i, x_j);
+    __m128 v_y = _mm_sub_ps(y_i, y_j);
+    __m128 dist_sq = _mm_add_ps(_mm_mul_ps(v_x, v_x), _mm_mul_ps(v_y, v_y));
+
+    __m128 mask = _mm_and_ps(_mm_cmplt_ps(dist_sq, min_dist_sq),
+                             _mm_cmpgt_ps(dist_sq, zero));
+    __m128i ids = _mm_loadu_si128(reinterpret_cast<const __m128i *>(batch));
+    __m128i valid = _mm_andnot_si128(
+        _mm_cmpeq_epi32(ids, self),
+        _mm_cmplt_epi32(lanes, _mm_set1_epi32(count - k)));
+    mask = _mm_and_ps(_mm_castsi128_ps(valid), mask);
+    if (_mm_movemask_ps(mask) == 0)
+      continue;
+
+    __m128 inv_dist = _mm_rsqrt_ps(dist_sq);
+    inv_dist = _mm_mul_ps(
+        inv_dist,
+        _mm_sub_ps(_mm_set1_ps(1.5f),
+                   _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), dist_sq),
+                              _mm_mul_ps(inv_dist, inv_dist))));
+    __m128 dist = _mm_mul_ps(dist_sq, inv_dist);
+    __m128 delta =
+        _mm_mul_ps(_mm_set1_ps(0.25f), _mm_sub_ps(min_dist_v, dist));
+    __m128 scale = _mm_and_ps(mask, _mm_mul_ps(inv_dist, delta));
+    sum_x = _mm_add_ps(sum_x, _mm_mul_ps(v_x, scale));
+    sum_y = _mm_add_ps(sum_y, _mm_mul_ps(v_y, scale));
+  }
+
+  out_x = horizontal_sum(sum_x);
+  out_y = horizontal_sum(sum_y);
+}
+
+__attribute__((target("avx2"))) inline void
+gather_avx2(const float *x, const float *y, int i, const int *candidates,
+            int count, float min_dist, float &out_x, float &out_y) {
+  const __m256 x_i = _mm256_set1_ps(x[i]);
+  const __m256 y_i = _mm256_set1_ps(y[i]);
+  const __m256 min_dist_v = _mm256_set1_ps(min_dist);
+  const __m256 min_dist_sq = _mm256_set1_ps(min_dist * min_dist);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256i self = _mm256_set1_epi32(i);
+  const __m256i lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+  __m256 sum_x = zero, sum_y = zero;
+  for (int k = 0; k < count; k += 8) {
+    const int *batch = candidates + k;
+    __m256i ids = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(batch));
+    __m256 x_j = _mm256_i32gather_ps(x, ids, 4);
+    __m256 y_j = _mm256_i32gather_ps(y, ids, 4);
+    __m256 v_x = _mm256_sub_ps(x_i, x_j);
+    __m256 v_y = _mm256_sub_ps(y_i, y_j);
+    __m256 dist_sq =
+        _mm256_add_ps(_mm256_mul_ps(v_x, v_x), _mm256_mul_ps(v_y, v_y));
+
+    __m256 mask =
+        _mm256_and_ps(_mm256_cmp_ps(dist_sq, min_dist_sq, _CMP_LT_OQ),
+                      _mm256_cmp_ps(dist_sq, zero, _CMP_GT_OQ));
+    __m256i valid = _mm256_andnot_si256(
+        _mm256_cmpeq_epi32(ids, self),
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(count - k), lanes));
+    mask = _mm256_and_ps(_mm256_castsi256_ps(valid), mask);
+    if (_mm256_movemask_ps(mask) == 0)
+      continue;
+
+    __m256 inv_dist = _mm256_rsqrt_ps(dist_sq);
+    inv_dist = _mm256_mul_ps(
+        inv_dist,
+        _mm256_sub_ps(_mm256_set1_ps(1.5f),
+                      _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), dist_sq),
+                                    _mm256_mul_ps(inv_dist, inv_dist))));
+    __m256 dist = _mm256_mul_ps(dist_sq, inv_dist);
+    __m256 delta =
+        _mm256_mul_ps(_mm256_set1_ps(0.25f), _mm256_sub_ps(min_dist_v, dist));
+    __m256 scale = _mm256_and_ps(mask, _mm256_mul_ps(inv_dist, delta));
+    sum_x = _mm256_add_ps(sum_x, _mm256_mul_ps(v_x, scale));
+    sum_y = _mm256_add_ps(sum_y, _mm256_mul_ps(v_y, scale));
+  }
+
+  out_x = horizontal_sum(sum_x);
+  out_y = horizontal_sum(sum_y);
+}
+
+__attribute__((target("avx2"))) inline void
+resolve_avx2(float *x, float *y, int i, const int *candidates, int count,
+             float min_dist) {
+  __m256 x_i = _mm256_set1_ps(x[i]);
+  __m256 y_i = _mm256_set1_ps(y[i]);
+  const __m256 min_dist_v = _mm256_set1_ps(min_dist);
+  const __m256 min_dist_sq = _mm256_set1_ps(min_dist * min_dist);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256i self = _mm256_set1_epi32(i);
+
+  const __m256i lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+  alignas(32) float n_x[8], n_y[8];
+
+  for (int k = 0; k < count; k += 8) {
+    const int *batch = candidates + k;
+    __m256i ids = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(batch));
+    __m256 x_j = _mm256_i32gather_ps(x, ids, 4);
+    __m256 y_j = _mm256_i32gather_ps(y, ids, 4);
+    __m256 v_x = _mm256_sub_ps(x_i, x_j);
+    __m256 v_y = _mm256_sub_ps(y_i, y_j);
+    __m256 dist_sq =
+        _mm256_add_ps(_mm256_mul_ps(v_x, v_x), _mm256_mul_ps(v_y, v_y));
+
+    __m256 mask =
+        _mm256_and_ps(_mm256_cmp_ps(dist_sq, min_dist_sq, _CMP_LT_OQ),
+                      _mm256_cmp_ps(dist_sq, zero, _CMP_GT_OQ));
+    // drop `i` itself and the padding past `count`
+    __m256i valid = _mm256_andnot_si256(
+        _mm256_cmpeq_epi32(ids, self),
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(count - k), lanes));
+    mask = _mm256_and_ps(_mm256_castsi256_ps(valid), mask);
+    int hits = _mm256_movemask_ps(mask);
+    if (hits == 0)
+      continue;
+
+    // 1 / dist, one Newton-Raphson step: r' = r * (1.5 - 0.5 * d * r * r)
+    __m256 inv_dist = _mm256_rsqrt_ps(dist_sq);
+    inv_dist = _mm256_mul_ps(
+        inv_dist,
+        _mm256_sub_ps(_mm256_set1_ps(1.5f),
+                      _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), dist_sq),
+                                    _mm256_mul_ps(inv_dist, inv_dist))));
+    __m256 dist = _mm256_mul_ps(dist_sq, inv_dist);
+    __m256 delta =
+        _mm256_mul_ps(_mm256_set1_ps(0.25f), _mm256_sub_ps(min_dist_v, dist));
+    // masked lanes may hold inf or NaN, the `and` zeroes them
+    __m256 scale = _mm256_and_ps(mask, _mm256_mul_ps(inv_dist, delta));
+
+    __m256 batch_x = _mm256_mul_ps(v_x, scale);
+    __m256 batch_y = _mm256_mul_ps(v_y, scale);
+    _mm256_store_ps(n_x, batch_x);
+    _mm256_store_ps(n_y, batch_y);
+    for (; hits != 0; hits &= hits - 1) {
+      int lane = __builtin_ctz(hits);
+      x[batch[lane]] -= n_x[lane];
+      y[batch[lane]] -= n_y[lane];
+    }
+
+    // the next batch sees `i` where this one left it
+    x[i] += horizontal_sum(batch_x);
+    y[i] += horizontal_sum(batch_y);
+    x_i = _mm256_set1_ps(x[i]);
+    y_i = _mm256_set1_ps(y[i]);
+  }
+}
+
+#endif
+
+inline bool is_supported(Kind kind) {
+  switch (kind) {
+  case Kind::Auto:
+  case Kind::Scalar:
+    return true;
+#ifdef VERLET_X86_KERNELS
+  case Kind::Sse:
+    return true;
+  case Kind::Avx2:
+    return __builtin_cpu_supports("avx2");
+#else
+  default:
+    return false;
+#endif
+  }
+  return false;
+}
+
+// resolves `Auto` to the widest kernel the running CPU supports, and any
+// unsupported request to the scalar kernel
+inline Kind resolve(Kind kind) {
+  if (kind == Kind::Auto) {
+    if (is_supported(Kind::Avx2))
+      return Kind::Avx2;
+    if (is_supported(Kind::Sse))
+      return Kind::Sse;
+    return Kind::Scalar;
+  }
+  return is_supported(kind) ? kind : Kind::Scalar;
+}
+
+inline Kernel get(Kind kind) {
+  switch (resolve(kind)) {
+#ifdef VERLET_X86_KERNELS
+  case Kind::Sse:
+    return resolve_sse;
+  case Kind::Avx2:
+    return resolve_avx2;
+#endif
+  default:
+    return resolve_scalar;
+  }
+}
+
+inline GatherKernel get_gather(Kind kind) {
+  switch (resolve(kind)) {
+#ifdef VERLET_X86_KERNELS
+  case Kind::Sse:
+    return gather_sse;
+  case Kind::Avx2:
+    return gather_avx2;
+#endif
+  default:
+    return gather_scalar;
+  }
+}
+
+inline const char *name(Kind kind) {
+  switch (kind) {
+  case Kind::Auto:
+    return "auto";
+  case Kind::Sse:
+    return "sse";
+  case Kind::Avx2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+} // namespace collision_kernels
@@ -0,0 +1,184 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "../thread_pool.hpp"
+#include "./particle.hpp"
+
+// distance constraints between particles, or between a particle and a fixed
+// point, for ropes, chains, cloth and soft bodies
+// solved by projection, https://en.wikipedia.org/wiki/Verlet_integration#Constraints
+//
+// constraints are greedily colored as they are added, so that no two
+// constraints of the same color share a particle: a color is a batch whose
+// constraints can all be solved at once, by any number of threads, without
+// locks, and the result does not depend on the thread count
+// colors are solved one after the other, Gauss-Seidel style
+struct ConstraintSet {
+  // at most this many colors run in parallel, constraints whose particles
+  // already use them all go to a last batch solved serially
+  static constexpr int max_colors = 64;
+  // below this many constraints, a batch is solved on the calling thread
+  static constexpr int min_parallel_batch = 2048;
+
+  // one color, structure of arrays
+  struct Batch {
+    // stable particle ids, `b_id` is -1 for an anchor
+    std::vector<int> a_id, b_id;
+    // indices into the store, refreshed by `update_indices()`
+    std::vector<int> a, b;
+    std::vector<float> rest_length;
+    // fraction of the error corrected per solve, 1 is a rigid link
+    std::vector<float> stiffness;
+    // anchor points, unused for links
+    std::vector<float> anchor_x, anchor_y;
+
+    size_t size() const { return a_id.size(); }
+  };
+
+  // `batches[max_colors]` is the serial batch
+  std::vector<Batch> batches = std::vector<Batch>(max_colors + 1);
+  // per particle id, bit `c` is set once a constraint of color `c` uses it
+  std::vector<uint64_t> used_colors;
+  size_t count = 0;
+
+  size_t size() const { return count; }
+
+  bool empty() const { return count == 0; }
+
+  void clear() {
+    for (Batch &batch : batches)
+      batch = {};
+    used_colors.clear();
+    count = 0;
+  }
+
+  // `b_id` -1 adds an anchor at (`anchor_x`, `anchor_y`)
+  void add(const ParticleStore &store, int a_id, int b_id, float rest_length,
+           float stiffness, float anchor_x = 0.0f, float anchor_y = 0.0f) {
+    if (used_colors.size() < store.index_of.size())
+      used_colors.resize(store.index_of.size(), 0);
+
+    uint64_t used = used_colors[a_id] | (b_id >= 0 ? used_colors[b_id] : 0);
+    // lowest free color, or the serial batch
+    int color = used == ~uint64_t(0) ? max_colors : std::countr_one(used);
+    if (color < max_colors) {
+      used_colors[a_id] |= uint64_t(1) << color;
+      if (b_id >= 0)
+        used_colors[b_id] |= uint64_t(1) << color;
+    }
+
+    Batch &batch = batches[color];
+    batch.a_id.push_back(a_id);
+    batch.b_id.push_back(b_id);
+    batch.a.push_back(store.index_of[a_id]);
+    batch.b.push_back(b_id >= 0 ? store.index_of[b_id] : -1);
+    batch.rest_length.push_back(rest_length);
+    batch.stiffness.push_back(stiffness);
+    batch.anchor_x.push_back(anchor_x);
+    batch.anchor_y.push_back(anchor_y);
+    count++;
+  }
+
+  // whether any constraint holds particle `id`
+  bool uses(int id) const {
+    if (size_t(id) < used_colors.size() && used_colors[id] != 0)
+      return true;
+    // the serial batch leaves no color bits
+    const Batch &serial = batches[max_colors];
+    return std::find(serial.a_id.begin(), serial.a_id.end(), id) !=
+               serial.a_id.end() ||
+           std::find(serial.b_id.begin(), serial.b_id.end(), id) !=
+               serial.b_id.end();
+  }
+
+  // moves the constraints of particle `from` to the id `to`, which none
+  // holds, indices are left to `update_indices()`
+  void rename(int from, int to) {
+    if (!uses(from))
+      return;
+    for (Batch &batch : batches) {
+      std::replace(batch.a_id.begin(), batch.a_id.end(), from, to);
+      std::replace(batch.b_id.begin(), batch.b_id.end(), from, to);
+    }
+    if (size_t(from) < used_colors.size()) {
+      used_colors[to] = used_colors[from];
+      used_colors[from] = 0;
+    }
+  }
+
+  // after the store was reordered
+  void update_indices(const ParticleStore &store) {
+    for (Batch &batch : batches) {
+      for (size_t k = 0; k < batch.size(); k++) {
+        batch.a[k] = store.index_of[batch.a_id[k]];
+        batch.b[k] = batch.b_id[k] >= 0 ? store.index_of[batch.b_id[k]] : -1;
+      }
+    }
+  }
+
+  // projects constraints [start, end) of `batch`
+  // particles share the correction by mass, which grows with the radius
+  // squared like in `collision_kernels::resolve_pair()`
+  static void solve_range(const Batch &batch, float *x, float *y,
+                          const float *radius, int start, int end) {
+    for (int k = start; k < end; k++) {
+      const int i = batch.a[k];
+      const int j = batch.b[k];
+      const bool anchor = j < 0;
+      const float other_x = anchor ? batch.anchor_x[k] : x[j];
+      const float other_y = anchor ? batch.anchor_y[k] : y[j];
+
+      float v_x = x[i] - other_x;
+      float v_y = y[i] - other_y;
+      float dist = std::sqrt(v_x * v_x + v_y * v_y);
+      if (dist == 0.0f)
+        continue;
+
+      float error = batch.stiffness[k] * (dist - batch.rest_length[k]) / dist;
+      if (anchor) {
+        x[i] -= v_x * error;
+        y[i] -= v_y * error;
+        continue;
+      }
+      float mass_i = radius[i] * radius[i];
+      float mass_j = radius[j] * radius[j];
+      float share_i = mass_j / (mass_i + mass_j);
+      float share_j = 1.0f - share_i;
+      x[i] -= v_x * error * share_i;
+      y[i] -= v_y * error * share_i;
+      x[j] += v_x * error * share_j;
+      y[j] += v_y * error * share_j;
+    }
+  }
+
+  // one pass over every constraint, one color at a time
+  void solve(ParticleStore &store, ThreadPool &thread_pool) {
+    float *x = store.x.data();
+    float *y = store.y.data();
+    const float *radius = store.radius.data();
+    for (int color = 0; color < max_colors; color++) {
+      const Batch &batch = batches[color];
+      const int size = batch.size();
+      if (size == 0)
+        break;
+      if (size < min_parallel_batch) {
+        solve_range(batch, x, y, radius, 0, size);
+        continue;
+      }
+      const int chunk_count = std::min(thread_pool.m_thread_count * 4,
+                                       size / (min_parallel_batch / 4));
+      thread_pool.parallel(
+          0, size,
+          [&](int start, int end) {
+            solve_range(batch, x, y, radius, start, end);
+          },
+          chunk_count);
+    }
+    solve_range(batches[max_colors], x, y, radius, 0,
+                batches[max_colors].size());
+  }
+};
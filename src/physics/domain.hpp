@@ -0,0 +1,656 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../thread_pool.hpp"
+#include "./particle.hpp"
+#include "./simulator.hpp"
+
+// spatial domain decomposition over local processes
+// the world is cut into `domain_count` vertical strips, each simulated by its
+// own forked process with its own simulator and `ThreadPool`, the parent
+// process is the coordinator
+//
+// every substep, each domain:
+// - hands the particles that left its strip to the neighbour that now owns
+//   them (migrants)
+// - sends copies of its particles within `halo` of a shared edge to that
+//   neighbour (ghosts), which collides its own particles against them and
+//   drops them after the substep
+// - waits for both neighbours' batches, then simulates one substep
+// neighbours exchange through single-producer single-consumer rings in one
+// POSIX shared-memory segment, the coordinator reads every domain's
+// particles through one more ring per domain and assembles global snapshots
+//
+// a domain that crashes only takes itself down: the coordinator notices, flags
+// the segment aborted so the others stop waiting, and reports which one failed
+// Linux only, processes are forked and die with the coordinator
+namespace domain {
+
+enum Kind : int32_t { MIGRANT, GHOST, OWNED, END };
+
+// one substep per `update()`, the exchange runs between them
+struct DomainConfig : DynamicConfig {
+  static constexpr int sub_steps = 1;
+};
+
+using DomainSimulator = BasicSimulator<DomainConfig>;
+
+// one particle, or an `END` marker closing a batch with the substep (or frame)
+// it belongs to in `id`
+struct Record {
+  Kind kind = END;
+  // global id, as in the initial particle list
+  int32_t id = 0;
+  float x = 0.0f, y = 0.0f;
+  float last_x = 0.0f, last_y = 0.0f;
+  float radius = 0.0f;
+  sf::Color color;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "ring counters are shared between processes");
+
+// bounded ring in shared memory, one producer process and one consumer
+// process, neither ever blocks: they move what fits and retry later
+struct Channel {
+  static constexpr uint64_t capacity = 1 << 15;
+
+  // records consumed so far, written by the consumer
+  alignas(64) std::atomic<uint64_t> m_head = 0;
+  // records produced so far, written by the producer
+  alignas(64) std::atomic<uint64_t> m_tail = 0;
+  alignas(64) Record m_records[capacity];
+
+  // returns how many of `records` fit
+  size_t write(const Record *records, size_t count) {
+    const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    const uint64_t head = m_head.load(std::memory_order_acquire);
+    const size_t fits = std::min<uint64_t>(count, capacity - (tail - head));
+    for (size_t k = 0; k < fits; k++)
+      m_records[(tail + k) % capacity] = records[k];
+    m_tail.store(tail + fits, std::memory_order_release);
+    return fits;
+  }
+
+  // passes queued records to `fn` until it returns false or the ring is
+  // empty, returns how many were consumed
+  template <typename Fn> size_t consume(Fn &&fn) {
+    const uint64_t head = m_head.load(std::memory_order_relaxed);
+    const uint64_t tail = m_tail.load(std::memory_order_acquire);
+    uint64_t next = head;
+    while (next < tail) {
+      const Record record = m_records[next % capacity];
+      next++;
+      if (!fn(record))
+        break;
+    }
+    m_head.store(next, std::memory_order_release);
+    return next - head;
+  }
+};
+
+// channels of one domain, `TO_LEFT` and `TO_RIGHT` lead to its neighbours
+enum Route { TO_LEFT, TO_RIGHT, TO_COORDINATOR, ROUTE_COUNT };
+
+struct Config {
+  int domain_count = 2;
+  float world_size = 512.0f;
+  // radius of the simulators' level-0 cells
+  float radius = 2.0f;
+  int threads_per_domain = 1;
+  int frames = 600;
+  float frame_dt = 1.0f / 60;
+  // neighbours exchange once per substep
+  int sub_steps = 8;
+  // frames between two global snapshots, the last frame always gets one
+  int snapshot_interval = 60;
+  // restricts each domain to its share of the coordinator's CPUs, so its
+  // threads and the memory they first touch stay on one node
+  bool pin = false;
+};
+
+// start of the shared-memory segment, `ROUTE_COUNT` channels per domain
+// follow it
+struct SegmentHeader {
+  // set by the coordinator when a domain failed, everyone stops waiting
+  std::atomic<int32_t> abort = 0;
+};
+
+constexpr size_t SEGMENT_HEADER_SIZE = alignof(Channel);
+static_assert(sizeof(SegmentHeader) <= SEGMENT_HEADER_SIZE);
+
+// creates and maps the segment under a unique name, then unlinks the name:
+// forked domains inherit the mapping and nothing is left behind in /dev/shm
+// if a process crashes
+// returns the header, nullptr with a message in `error` on failure
+inline SegmentHeader *map_segment(int domain_count, Channel *&channels,
+                                  size_t &size, std::string &error) {
+  const std::string name = "/verlet_domains_" + std::to_string(::getpid());
+  size = SEGMENT_HEADER_SIZE + sizeof(Channel) * domain_count * ROUTE_COUNT;
+
+  errno = 0;
+  int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    error = "could not create shared memory " + name + ": " +
+            std::strerror(errno);
+    return nullptr;
+  }
+  ::shm_unlink(name.c_str());
+  if (::ftruncate(fd, size) != 0) {
+    error =
+        "could not size shared memory: " + std::string(std::strerror(errno));
+    ::close(fd);
+    return nullptr;
+  }
+  void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    error = "could not map shared memory: " + std::string(std::strerror(errno));
+    return nullptr;
+  }
+
+  // the mapping starts zeroed, which is the initial state of every counter
+  SegmentHeader *header = new (data) SegmentHeader;
+  channels = reinterpret_cast<Channel *>(static_cast<char *>(data) +
+                                         SEGMENT_HEADER_SIZE);
+  for (int c = 0; c < domain_count * ROUTE_COUNT; c++)
+    new (&channels[c]) Channel;
+  return header;
+}
+
+// state of one domain process
+struct Domain {
+  const Config &config;
+  int index;
+  SegmentHeader &header;
+  Channel *channels;
+
+  // strip [left, right) of the world, the outer domains also own whatever
+  // lies past it towards their wall
+  float left, right;
+  // ghosts reach this far into a neighbour's strip
+  float halo;
+
+  // the simulator's store holds the owned particles, local ids
+  // [0, owned_count), then the ghosts of the current substep, and is kept
+  // between substeps
+  // per local id, its global id
+  std::vector<int32_t> global_id;
+  size_t owned_count = 0;
+  // received migrants and ghosts, appended to the store by `admit()`
+  std::vector<Record> arrivals, ghosts;
+  // outgoing batch per neighbour, and how much of it was sent
+  std::vector<Record> outbox[2];
+  size_t sent[2] = {0, 0};
+  // the owned particles as sent to the coordinator
+  std::vector<Record> snapshot;
+
+  double compute_ms = 0.0, exchange_ms = 0.0;
+
+  Domain(const Config &config_, int index_, SegmentHeader &header_,
+         Channel *channels_, float halo_)
+      : config{config_}, index{index_}, header{header_}, channels{channels_},
+        halo{halo_} {
+    const float strip = config.world_size / config.domain_count;
+    left = index * strip;
+    right = (index + 1) * strip;
+  }
+
+  Channel &channel(int domain, Route route) {
+    return channels[domain * ROUTE_COUNT + route];
+  }
+
+  bool has_neighbour(int side) const {
+    return side == TO_LEFT ? index > 0 : index < config.domain_count - 1;
+  }
+
+  bool aborted() const {
+    return header.abort.load(std::memory_order_acquire) != 0;
+  }
+
+  static Record record_of(const ParticleStore &store, size_t i, Kind kind) {
+    Record record;
+    record.kind = kind;
+    record.x = store.x[i];
+    record.y = store.y[i];
+    record.last_x = store.last_x[i];
+    record.last_y = store.last_y[i];
+    record.radius = store.radius[i];
+    record.color = store.color[i];
+    return record;
+  }
+
+  // the particle with the highest local id takes over `local_id`
+  // never refused, domains neither link nor record particles
+  void remove(DomainSimulator &simulator, int local_id) {
+    simulator.remove_entity(Particle{&simulator.entities, local_id});
+    global_id[local_id] = global_id.back();
+    global_id.pop_back();
+  }
+
+  void append(DomainSimulator &simulator, const Record &record) {
+    Particle particle =
+        simulator.add_entity({record.x, record.y}, record.radius);
+    ParticleStore &store = simulator.entities;
+    const int i = particle.index();
+    store.last_x[i] = record.last_x;
+    store.last_y[i] = record.last_y;
+    store.color[i] = record.color;
+    global_id.push_back(record.id);
+  }
+
+  // drops the last substep's ghosts, removes the particles that left the
+  // strip and queues them as migrants, and queues ghosts for the neighbours
+  void classify(DomainSimulator &simulator) {
+    ParticleStore &store = simulator.entities;
+    // ghosts have the highest ids, so nothing is renamed
+    while (global_id.size() > owned_count)
+      remove(simulator, global_id.size() - 1);
+
+    ghosts.clear();
+    outbox[TO_LEFT].clear();
+    outbox[TO_RIGHT].clear();
+    sent[TO_LEFT] = sent[TO_RIGHT] = 0;
+
+    // downwards, the last index fills a removed one and was already visited
+    for (size_t i = store.size(); i-- > 0;) {
+      const float x = store.x[i];
+      // a particle moving further than a strip per substep is handed on by
+      // the next neighbour one substep later
+      const int side = x < left && has_neighbour(TO_LEFT)    ? TO_LEFT
+                       : x >= right && has_neighbour(TO_RIGHT) ? TO_RIGHT
+                                                               : -1;
+      const bool ghost_left = x < left + halo && has_neighbour(TO_LEFT);
+      const bool ghost_right = x >= right - halo && has_neighbour(TO_RIGHT);
+      if (side < 0 && !ghost_left && !ghost_right)
+        continue;
+
+      const int local_id = store.id[i];
+      Record record = record_of(store, i, GHOST);
+      record.id = global_id[local_id];
+      if (side >= 0) {
+        record.kind = MIGRANT;
+        outbox[side].push_back(record);
+        // still close enough to collide with this domain's particles
+        if (x >= left - halo && x < right + halo) {
+          record.kind = GHOST;
+          ghosts.push_back(record);
+        }
+        remove(simulator, local_id);
+        owned_count--;
+        continue;
+      }
+
+      if (ghost_left)
+        outbox[TO_LEFT].push_back(record);
+      if (ghost_right)
+        outbox[TO_RIGHT].push_back(record);
+    }
+  }
+
+  // sends both outboxes and receives both neighbours' batches of `step`,
+  // false once the run was aborted
+  bool exchange(int32_t step) {
+    Record end;
+    end.kind = END;
+    end.id = step;
+    bool received[2] = {!has_neighbour(TO_LEFT), !has_neighbour(TO_RIGHT)};
+    for (int side = 0; side < 2; side++)
+      if (has_neighbour(side))
+        outbox[side].push_back(end);
+
+    bool protocol_error = false;
+    auto receive = [&](const Record &record, int side) {
+      if (record.kind == END) {
+        protocol_error |= record.id != step;
+        received[side] = true;
+        return false;
+      }
+      (record.kind == MIGRANT ? arrivals : ghosts).push_back(record);
+      return true;
+    };
+
+    int idle = 0;
+    while (true) {
+      size_t progress = 0;
+      for (int side = 0; side < 2; side++) {
+        if (!has_neighbour(side))
+          continue;
+        const int neighbour = side == TO_LEFT ? index - 1 : index + 1;
+        // our batch goes into our ring towards the neighbour, theirs comes
+        // from their ring towards us
+        if (sent[side] < outbox[side].size()) {
+          size_t count = channel(index, Route(side))
+                             .write(outbox[side].data() + sent[side],
+                                    outbox[side].size() - sent[side]);
+          sent[side] += count;
+          progress += count;
+        }
+        if (!received[side]) {
+          const Route towards_us = side == TO_LEFT ? TO_RIGHT : TO_LEFT;
+          progress += channel(neighbour, towards_us)
+                          .consume([&](const Record &record) {
+                            return receive(record, side);
+                          });
+        }
+      }
+      if (protocol_error) {
+        std::cerr << "domain " << index << ": batch out of order at substep "
+                  << step << "\n";
+        return false;
+      }
+      if (received[TO_LEFT] && received[TO_RIGHT] &&
+          sent[TO_LEFT] == outbox[TO_LEFT].size() &&
+          sent[TO_RIGHT] == outbox[TO_RIGHT].size())
+        return true;
+      if (aborted())
+        return false;
+      // neighbours run in lockstep, the wait is short unless one is behind
+      if (progress == 0 && ++idle > 64)
+        std::this_thread::yield();
+      else if (progress > 0)
+        idle = 0;
+    }
+  }
+
+  // appends the arrivals as owned particles, then the ghosts
+  void admit(DomainSimulator &simulator) {
+    for (const Record &record : arrivals)
+      append(simulator, record);
+    owned_count = global_id.size();
+    for (const Record &record : ghosts)
+      append(simulator, record);
+    arrivals.clear();
+    ghosts.clear();
+  }
+
+  // streams the owned particles to the coordinator, closed by an `END`
+  // carrying `frame` and this domain's time split so far
+  bool send_snapshot(const DomainSimulator &simulator, int32_t frame) {
+    const ParticleStore &store = simulator.entities;
+    snapshot.clear();
+    for (size_t i = 0; i < store.size(); i++) {
+      const int local_id = store.id[i];
+      if (size_t(local_id) >= owned_count)
+        continue;
+      Record record = record_of(store, i, OWNED);
+      record.id = global_id[local_id];
+      snapshot.push_back(record);
+    }
+    Record end;
+    end.kind = END;
+    end.id = frame;
+    end.x = compute_ms;
+    end.y = exchange_ms;
+    snapshot.push_back(end);
+    size_t done = 0;
+    int idle = 0;
+    while (done < snapshot.size()) {
+      size_t count = channel(index, TO_COORDINATOR)
+                         .write(snapshot.data() + done, snapshot.size() - done);
+      done += count;
+      if (aborted())
+        return false;
+      if (count == 0 && ++idle > 64)
+        std::this_thread::yield();
+    }
+    return true;
+  }
+
+  void pin_to_cpus() {
+    cpu_set_t available;
+    CPU_ZERO(&available);
+    if (::sched_getaffinity(0, sizeof available, &available) != 0)
+      return;
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &available))
+        cpus.push_back(cpu);
+    const int count = cpus.size();
+    const int first = int64_t(count) * index / config.domain_count;
+    const int last = std::max(
+        first + 1, int(int64_t(count) * (index + 1) / config.domain_count));
+    cpu_set_t share;
+    CPU_ZERO(&share);
+    for (int k = first; k < last; k++)
+      CPU_SET(cpus[k % count], &share);
+    ::sched_setaffinity(0, sizeof share, &share);
+  }
+
+  // body of the domain process, returns its exit status
+  int run(const std::vector<Record> &initial) {
+    // a dead coordinator takes its domains with it
+    ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (config.pin)
+      pin_to_cpus();
+
+    for (const Record &record : initial) {
+      const int owner = std::clamp(
+          int(record.x / (config.world_size / config.domain_count)), 0,
+          config.domain_count - 1);
+      if (owner == index)
+        arrivals.push_back(record);
+    }
+
+    ThreadPool thread_pool(config.threads_per_domain);
+    DomainSimulator simulator(config.world_size, config.radius, thread_pool);
+    simulator.set_step_dt(config.frame_dt / config.sub_steps);
+    admit(simulator);
+
+    using clock = std::chrono::steady_clock;
+    int32_t step = 0;
+    for (int frame = 1; frame <= config.frames; frame++) {
+      for (int substep = 0; substep < config.sub_steps; substep++) {
+        clock::time_point start = clock::now();
+        classify(simulator);
+        if (!exchange(step++))
+          return 1;
+        clock::time_point exchanged = clock::now();
+        admit(simulator);
+        simulator.update();
+        using ms = std::chrono::duration<double, std::milli>;
+        compute_ms += ms(clock::now() - exchanged).count();
+        exchange_ms += ms(exchanged - start).count();
+      }
+      if (frame % config.snapshot_interval == 0 || frame == config.frames) {
+        // settle ownership first, so every particle is sent exactly once
+        classify(simulator);
+        if (!exchange(step++))
+          return 1;
+        // the ghosts would be dropped again before the next substep
+        ghosts.clear();
+        admit(simulator);
+        if (!send_snapshot(simulator, frame))
+          return 1;
+      }
+    }
+    return 0;
+  }
+};
+
+// per domain, time spent simulating and exchanging, as of a snapshot
+struct DomainTimes {
+  double compute_ms = 0.0;
+  double exchange_ms = 0.0;
+};
+
+// forks `config.domain_count` domains over `initial`, whose ids must be
+// [0, initial.size()) in order, and runs them to `config.frames`
+// `on_snapshot(frame, store, times)` gets every assembled global state, ids
+// are the initial ones
+// false with a message in `error` if the run could not start or a domain
+// failed, the other domains are then stopped
+template <typename Fn>
+bool run(const Config &config, const std::vector<Record> &initial,
+         Fn &&on_snapshot, std::string &error) {
+  float max_radius = config.radius;
+  for (const Record &record : initial)
+    max_radius = std::max(max_radius, record.radius);
+  // widest contact, plus a cell of motion during the substep
+  const float halo = 4 * max_radius + 2 * config.radius;
+  if (config.domain_count < 1 ||
+      config.world_size / config.domain_count < 2 * halo) {
+    const float strip = config.world_size / config.domain_count;
+    error = "strips of " + std::to_string(strip) +
+            " px are narrower than two halos of " + std::to_string(halo) +
+            " px";
+    return false;
+  }
+
+  Channel *channels = nullptr;
+  size_t segment_size = 0;
+  SegmentHeader *header =
+      map_segment(config.domain_count, channels, segment_size, error);
+  if (!header)
+    return false;
+
+  // unflushed output would be duplicated into every child
+  std::cout.flush();
+  std::cerr.flush();
+  std::vector<pid_t> pids(config.domain_count, -1);
+  auto stop_all = [&]() {
+    header->abort.store(1, std::memory_order_release);
+    for (pid_t pid : pids)
+      if (pid > 0)
+        ::waitpid(pid, nullptr, 0);
+    ::munmap(header, segment_size);
+  };
+  for (int d = 0; d < config.domain_count; d++) {
+    pid_t pid = ::fork();
+    if (pid < 0) {
+      error = "could not fork: " + std::string(std::strerror(errno));
+      stop_all();
+      return false;
+    }
+    if (pid == 0) {
+      int status;
+      {
+        Domain domain(config, d, *header, channels, halo);
+        status = domain.run(initial);
+      }
+      // skips the coordinator's atexit handlers and stream buffers
+      ::_exit(status);
+    }
+    pids[d] = pid;
+  }
+
+  // global state indexed by id, refilled for every snapshot
+  const size_t count = initial.size();
+  ParticleStore store;
+  store.reserve(count);
+  for (const Record &record : initial)
+    store.push({record.x, record.y}, record.radius, -1);
+  std::vector<uint8_t> seen(count, 0);
+  size_t received = 0;
+  std::vector<uint8_t> done(config.domain_count, 0);
+  std::vector<DomainTimes> times(config.domain_count);
+  int finished = 0;
+  int32_t frame = -1;
+  std::string protocol_error;
+
+  auto receive = [&](const Record &record, int d) {
+    if (record.kind == END) {
+      if (frame >= 0 && record.id != frame)
+        protocol_error = "domains disagree on the snapshot frame";
+      frame = record.id;
+      times[d] = {record.x, record.y};
+      done[d] = 1;
+      return false;
+    }
+    if (record.id < 0 || size_t(record.id) >= count || seen[record.id]) {
+      protocol_error = "particle " + std::to_string(record.id) +
+                       " sent twice or out of range";
+      return false;
+    }
+    seen[record.id] = 1;
+    received++;
+    const int i = record.id;
+    store.x[i] = record.x;
+    store.y[i] = record.y;
+    store.last_x[i] = record.last_x;
+    store.last_y[i] = record.last_y;
+    store.color[i] = record.color;
+    return true;
+  };
+
+  int idle = 0;
+  while (true) {
+    size_t progress = 0;
+    for (int d = 0; d < config.domain_count; d++)
+      if (!done[d])
+        progress += channels[d * ROUTE_COUNT + TO_COORDINATOR].consume(
+            [&](const Record &record) { return receive(record, d); });
+    if (!protocol_error.empty()) {
+      error = protocol_error;
+      stop_all();
+      return false;
+    }
+
+    if (std::all_of(done.begin(), done.end(), [](uint8_t d) { return d; })) {
+      if (received != count) {
+        error = "snapshot of frame " + std::to_string(frame) + " has " +
+                std::to_string(received) + " of " + std::to_string(count) +
+                " particles";
+        stop_all();
+        return false;
+      }
+      on_snapshot(frame, store, times);
+      std::fill(done.begin(), done.end(), 0);
+      std::fill(seen.begin(), seen.end(), 0);
+      received = 0;
+      frame = -1;
+      progress++;
+    }
+
+    // a domain may only exit after its last snapshot, anything else is a
+    // failure that would leave its neighbours waiting forever
+    int status;
+    for (pid_t pid; (pid = ::waitpid(-1, &status, WNOHANG)) > 0;) {
+      const int d = std::find(pids.begin(), pids.end(), pid) - pids.begin();
+      pids[d] = -1;
+      finished++;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        continue;
+      error = "domain " + std::to_string(d) +
+              (WIFSIGNALED(status)
+                   ? " killed by signal " + std::to_string(WTERMSIG(status))
+                   : " exited with status " +
+                         std::to_string(WEXITSTATUS(status)));
+      stop_all();
+      return false;
+    }
+    if (finished == config.domain_count && progress == 0)
+      break;
+    if (progress == 0 && ++idle > 64)
+      std::this_thread::yield();
+    else if (progress > 0)
+      idle = 0;
+  }
+
+  ::munmap(header, segment_size);
+  if (frame >= 0 || received > 0) {
+    error = "domains exited before their last snapshot";
+    return false;
+  }
+  return true;
+}
+
+} // namespace domain
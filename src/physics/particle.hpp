@@ -1,46 +1,185 @@
 #pragma once
-#include <SFML/Graphics.hpp>
-#include <iostream>
-#include <math.h>
+#include <SFML/Graphics/Color.hpp>
+#include <SFML/System/Vector2.hpp>
 #include <vector>
 
-// TODO `struct` vs `class` ?
-struct Particle {
-  sf::Vector2f position;
-  sf::Vector2f position_last;
-  sf::Vector2f acceleration;
-  float radius;
-  sf::Color color;
-  int grid_row, grid_col, id;
-
-  // `default` denotes default ctor and initilizes members with their default
-  // values
-  Particle() = default;
-
-  // args suffixed with `_` to avoid shadowing
-  // https://en.wikipedia.org/wiki/Variable_shadowing
-  Particle(sf::Vector2f position_, float radius_, int grid_x_, int grid_y_,
-           int id_)
-      : position{position_}, position_last{position_}, acceleration{0.0f, 0.0f},
-        radius{radius_}, grid_row{grid_x_}, grid_col{grid_y_}, id{id_} {}
+// structure-of-arrays particle storage
+// each attribute lives in its own contiguous array, so a pass only pulls the
+// attributes it touches into cache, e.g. collisions only stream `x` and `y`
+// particles are addressed by index in the hot loops, indices change when the
+// store is reordered, ids do not: `id[index]` and `index_of[id]` map between
+// the two
+struct ParticleStore {
+  // hot, read every substep
+  std::vector<float> x, y;
+  std::vector<float> last_x, last_y;
+  std::vector<float> acc_x, acc_y;
+  // flat index into the simulator's `CellGrid`, -1 when outside of it
+  std::vector<int> cell;
+
+  // cold, read when spawning or rendering
+  std::vector<float> radius;
+  std::vector<sf::Color> color;
+  std::vector<int> id;
+
+  // indexed by id rather than index, so it is not permuted with the rest
+  std::vector<int> index_of;
+
+  size_t size() const { return x.size(); }
+
+  bool empty() const { return x.empty(); }
+
+  // visits every index-ordered array of this store along with the matching
+  // array of `other`, keeps the array list in one place
+  template <typename Store, typename Fn>
+  void for_each_array(Store &other, Fn &&fn) {
+    fn(x, other.x);
+    fn(y, other.y);
+    fn(last_x, other.last_x);
+    fn(last_y, other.last_y);
+    fn(acc_x, other.acc_x);
+    fn(acc_y, other.acc_y);
+    fn(cell, other.cell);
+    fn(radius, other.radius);
+    fn(color, other.color);
+    fn(id, other.id);
+  }
+
+  void reserve(size_t capacity) {
+    for_each_array(*this, [&](auto &array, auto &) { array.reserve(capacity); });
+    index_of.reserve(capacity);
+  }
+
+  // copies the particles of `source` so that index `i` holds `source`'s
+  // particle `order[i]`, for `i` in [start, end)
+  // `this` must already have `source`'s size, disjoint ranges can be gathered
+  // concurrently
+  void gather(const ParticleStore &source, const std::vector<int> &order,
+              int start, int end) {
+    for_each_array(source, [&](auto &array, const auto &source_array) {
+      for (int i = start; i < end; i++)
+        array[i] = source_array[order[i]];
+    });
+  }
+
+  // points `index_of` back at the particles in [start, end) after a reorder
+  void update_index_of(int start, int end) {
+    for (int i = start; i < end; i++)
+      index_of[id[i]] = i;
+  }
+
+  // resizes the index-ordered arrays only
+  void resize_like(const ParticleStore &other) {
+    for_each_array(other, [&](auto &array, const auto &other_array) {
+      array.resize(other_array.size());
+    });
+  }
+
+  // swaps the index-ordered arrays only, `index_of` stays with its store
+  void swap_arrays(ParticleStore &other) {
+    for_each_array(other, [](auto &array, auto &other_array) {
+      array.swap(other_array);
+    });
+  }
+
+  // returns the id of the new particle, which starts at rest
+  // it is appended, so its index is the old size
+  int push(sf::Vector2f position, float radius_, int cell_) {
+    int index = size();
+    int new_id = index_of.size();
+    x.push_back(position.x);
+    y.push_back(position.y);
+    last_x.push_back(position.x);
+    last_y.push_back(position.y);
+    acc_x.push_back(0.0f);
+    acc_y.push_back(0.0f);
+    cell.push_back(cell_);
+    radius.push_back(radius_);
+    color.push_back(sf::Color::White);
+    id.push_back(new_id);
+    index_of.push_back(index);
+    return new_id;
+  }
+
+  // drops the particle `removed_id`, the last index fills its place and the
+  // particle with the highest id takes over its id, so ids stay [0, size)
+  void remove(int removed_id) {
+    const int index = index_of[removed_id];
+    const int last = size() - 1;
+    if (index != last) {
+      for_each_array(*this, [&](auto &array, auto &) {
+        array[index] = array[last];
+      });
+      index_of[id[index]] = index;
+    }
+    for_each_array(*this, [](auto &array, auto &) { array.pop_back(); });
+
+    const int last_id = index_of.size() - 1;
+    if (removed_id != last_id) {
+      const int moved = index_of[last_id];
+      id[moved] = removed_id;
+      index_of[removed_id] = moved;
+    }
+    index_of.pop_back();
+  }
+
+  sf::Vector2f get_position(int i) const { return {x[i], y[i]}; }
+
+  void set_position(int i, sf::Vector2f p) {
+    x[i] = p.x;
+    y[i] = p.y;
+  }
 
   // https://en.wikipedia.org/wiki/Verlet_integration#Velocity_Verlet
-  void update_position(float dt) {
+  void update_position(int i, float dt) {
     // https://en.wikipedia.org/wiki/Displacement
-    sf::Vector2f displacement = position - position_last;
-    position_last = position;
-    position = position + displacement + acceleration * (dt * dt);
+    float displacement_x = x[i] - last_x[i];
+    float displacement_y = y[i] - last_y[i];
+    last_x[i] = x[i];
+    last_y[i] = y[i];
+    x[i] = x[i] + displacement_x + acc_x[i] * (dt * dt);
+    y[i] = y[i] + displacement_y + acc_y[i] * (dt * dt);
     // reset acceleration
-    acceleration = {0.0f, 0.0f};
+    acc_x[i] = 0.0f;
+    acc_y[i] = 0.0f;
+  }
+
+  void apply_force(int i, sf::Vector2f v) {
+    acc_x[i] += v.x;
+    acc_y[i] += v.y;
   }
 
-  void apply_force(sf::Vector2f v) { acceleration += v; }
+  sf::Vector2f get_velocity(int i) const {
+    return {x[i] - last_x[i], y[i] - last_y[i]};
+  }
 
-  sf::Vector2f get_velocity() { return position - position_last; }
+  void set_velocity(int i, sf::Vector2f v, float dt) {
+    last_x[i] = x[i] - v.x * dt;
+    last_y[i] = y[i] - v.y * dt;
+  }
 
-  void set_velocity(sf::Vector2f v, float dt) {
-    position_last = position - (v * dt);
+  void add_velocity(int i, sf::Vector2f v, float dt) {
+    last_x[i] -= v.x * dt;
+    last_y[i] -= v.y * dt;
   }
+};
+
+// lightweight handle to one particle of a `ParticleStore`
+// unlike a reference into a vector, it stays valid when the store grows or is
+// reordered, since it holds the particle's stable id
+struct Particle {
+  ParticleStore *store = nullptr;
+  int id = -1;
+
+  int index() const { return store->index_of[id]; }
+
+  sf::Vector2f get_position() const { return store->get_position(index()); }
+
+  sf::Vector2f get_velocity() const { return store->get_velocity(index()); }
+
+  float get_radius() const { return store->radius[index()]; }
+
+  sf::Color get_color() const { return store->color[index()]; }
 
-  void add_velocity(sf::Vector2f v, float dt) { position_last -= v * dt; }
+  void set_color(sf::Color color) { store->color[index()] = color; }
 };
@@ -1,310 +1,2188 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <string>
 #include <iostream>
 #include <cmath>
-#include <SFML/Graphics.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <SFML/System/Vector2.hpp>
+#include "./barnes_hut.hpp"
+#include "./cell_grid.hpp"
+#include "./colliders.hpp"
+#include "./collision_kernels.hpp"
+#include "./constraints.hpp"
 #include "./particle.hpp"
+#include "./simulator_config.hpp"
+#include "./snapshot.hpp"
+#include "./sparse_cell_grid.hpp"
+#include "./trajectory.hpp"
+#include "../profiler.hpp"
 #include "../thread_pool.hpp"
 
-class Simulator
+// `Config` fixes parameters at compile time, see `simulator_config.hpp`
+template <typename Config = DynamicConfig>
+class BasicSimulator
 {
 private:
-    // TODO test diff values
-    // if too strong, particles will skip cells
-    float GRAVITY_STRENGTH = 200.0f;
-    sf::Vector2f gravity = {0.0f, GRAVITY_STRENGTH};
+    // unused when `Config::fixed_gravity`
+    sf::Vector2f gravity = {0.0f, Config::gravity_strength};
+    // px/s^2, what `set_*_gravity()` point in their direction
+    float gravity_strength = Config::gravity_strength;
+    // unused when `Config::fixed_bounce`
+    float bounce_factor = Config::bounce_factor;
 
     float step_dt = 1.0f / 60;
+    // unused when `Config::sub_steps` is set
     int sub_steps = 8;
+    // picks `sub_steps` every frame, between the two bounds, see
+    // `choose_sub_steps()`
+    // below 8, tall piles get too few solver passes and turn springy
+    bool adaptive_sub_steps = false;
+    int min_sub_steps = 8;
+    int max_sub_steps = 32;
+    // per chunk, the largest squared displacement found by `choose_sub_steps()`
+    std::vector<float> chunk_max_step;
 
     // ctor initializes `window_size` and `grid_cell_size`
     float window_size;
     float grid_cell_size;
-    // 2d vector where a cell is `vector<int>` of entity ids
-    // so it's really a 3d vector
-    std::vector<int> grid[350][350];
     int grid_cell_count = window_size / grid_cell_size;
+    // `grid_cell_count` x `grid_cell_count` cells of entity indices
+    CellGrid grid;
+    // set when entities were added since the last `update_grid()`
+    bool grid_dirty = false;
+    // the occupied cells only, in place of `grid` (then left empty), see
+    // `set_sparse_grid()`
+    bool sparse_broadphase = false;
+    SparseCellGrid sparse_grid;
+    // wider worlds default to the sparse grid, a dense one costs 4 MB per
+    // pass over its cells, and as much per worker for the parallel build,
+    // only worth it in a world mostly filled with particles
+    static constexpr int dense_grid_max_width = 1024;
 
-    const float bounce_factor = 0.66f;
+    // particles wider than a level-0 cell live on coarser levels instead, so a
+    // few large particles neither force large cells on everyone nor reach past
+    // the neighbouring cells
+    // level `k` has cells `grid_cell_size * 2^k` wide, a particle goes to the
+    // first level its diameter fits in
+    struct GridLevel
+    {
+        float cell_size = 0.0f;
+        int width = 0;
+        // one of the two, as for level 0
+        bool sparse = false;
+        CellGrid grid;
+        SparseCellGrid sparse_grid;
+        // stable ids of the level's particles
+        std::vector<int> ids;
+        // their indices and cells as of the last `update_levels()`, parallel
+        // to `ids`, the grid's entries index into both
+        std::vector<int> members;
+        std::vector<int> cells;
+
+        void resize(int width_, bool sparse_)
+        {
+            width = width_;
+            sparse = sparse_;
+            grid.resize(sparse ? 0 : width);
+            sparse_grid.resize(sparse ? width : 0);
+        }
+
+        int cell_index(int col, int row) const
+        {
+            if (col < 0 || row < 0 || col >= width || row >= width)
+                return -1;
+            return col * width + row;
+        }
+
+        void build()
+        {
+            if (sparse)
+                sparse_grid.build(cells);
+            else
+                grid.build(cells);
+        }
+
+        template <typename Fn>
+        void for_each_in_box(float min_x, float min_y, float max_x, float max_y, Fn &&fn) const
+        {
+            if (sparse)
+                sparse_grid.for_each_in_box(min_x, min_y, max_x, max_y, cell_size, fn);
+            else
+                grid.for_each_in_box(min_x, min_y, max_x, max_y, cell_size, fn);
+        }
+    };
+    // `levels[k - 1]` is level `k`, empty as long as every particle fits level 0
+    std::vector<GridLevel> levels;
+    // every particle has radius `grid_cell_size / 2`, the uniform kernels'
+    // fast path
+    bool uniform_radius = true;
+    // bin on the thread pool instead of the main thread
+    bool parallel_grid_build = true;
+    // gravity, boundary, integration and cell binning in one sweep per substep
+    bool fused_substeps = true;
+
+    // frames between two reorders of `entities` along the Z-order curve, 0
+    // disables reordering
+    int reorder_interval = 0;
+    long frame_count = 0;
+    // grid cells in Z-order, computed on the first reorder
+    std::vector<int> morton_cells;
+    // reused across reorders to avoid reallocating
+    std::vector<int> reorder_order;
+    ParticleStore reorder_scratch;
+
+public:
+    // direction `resolve_particle_collisions()` cuts the grid into slices
+    enum class SliceAxis
+    {
+        Auto,
+        Columns,
+        Rows
+    };
+
+private:
+    SliceAxis slice_axis = SliceAxis::Auto;
+    // axis picked by the last `balance_collision_slices()`
+    bool slice_rows = false;
+    // slice `s` covers the columns (or rows) [slice_bounds[s], slice_bounds[s + 1])
+    std::vector<int> slice_bounds;
+    // reused across frames to avoid reallocating
+    std::vector<int> column_costs, row_costs, row_bounds;
+
+    // rest detection over square regions of `region_cells` x `region_cells`
+    // level-0 cells, see `update_sleep()`
+    // work is only skipped deep inside asleep areas, so every particle next to
+    // an awake one is still simulated in full:
+    // - an asleep region surrounded by asleep regions is frozen, its particles
+    //   are not integrated
+    // - a frozen region surrounded by frozen regions is inert, it skips
+    //   collisions too, all of its contacts are between particles at rest
+    bool sleeping = false;
+    int region_cells = 8;
+    // px per substep
+    float sleep_speed = 0.1f;
+    float wake_speed = 1.0f;
+    // px, root mean square of the pushes a frozen region may absorb
+    float wake_push = 1.0f;
+    int sleep_frames = 30;
+    // regions per side
+    int region_count = 0;
+    std::vector<int> region_quiet_frames;
+    // `MOTION_*` bits of the last `update_sleep()`
+    static constexpr uint8_t MOTION_MOVING = 1;
+    static constexpr uint8_t MOTION_FAST = 2;
+    static constexpr uint8_t MOTION_EMPTY = 4;
+    std::vector<uint8_t> region_motion;
+    std::vector<uint8_t> region_asleep;
+    std::vector<uint8_t> region_frozen;
+    // per level-0 cell, the state of its region, empty while sleeping is off
+    static constexpr uint8_t CELL_AWAKE = 0;
+    static constexpr uint8_t CELL_ASLEEP = 1;
+    static constexpr uint8_t CELL_FROZEN = 2;
+    static constexpr uint8_t CELL_INERT = 3;
+    std::vector<uint8_t> cell_sleep;
+
+    // narrow-phase kernel, picked once from the running CPU's features
+    collision_kernels::Kind collision_kernel_kind = collision_kernels::resolve(collision_kernels::Kind::Auto);
+    collision_kernels::Kernel collision_kernel = collision_kernels::get(collision_kernel_kind);
+    collision_kernels::GatherKernel gather_kernel = collision_kernels::get_gather(collision_kernel_kind);
+
+    // links and anchors, solved right after the collisions of each substep
+    ConstraintSet constraints;
+    // constraint passes per substep
+    int constraint_iterations = 1;
+
+    // static obstacles, met after the window edges in each substep
+    ColliderSet colliders;
+
+    // long-range forces, see `barnes_hut.hpp`, worked out once per frame and
+    // added in every substep like gravity
+    // particles attract each other in proportion to `long_range_strength *
+    // radius^2`, negative repels, 0 turns it off
+    float long_range_strength = 0.0f;
+    // px, defaults to one level-0 cell
+    float long_range_softening;
+    // the Barnes-Hut opening angle
+    float opening_angle = 0.5f;
+    QuadTree particle_tree;
+    // fixed points pulling every particle with their own strength
+    std::vector<float> attractor_x, attractor_y, attractor_strength;
+    QuadTree attractor_tree;
+    bool attractors_dirty = false;
+    // per particle, by index, the long-range acceleration of this frame
+    std::vector<float> long_range_x, long_range_y;
+    // scratch of `compute_long_range()`, reused to avoid reallocating
+    std::vector<float> long_range_mass;
+
+    // scratch of `query_nearest()`, reused to avoid reallocating
+    std::vector<std::pair<float, int>> nearest_heap;
+
+    // captures every frame at the end of `update()`, not owned
+    trajectory::Recorder *recorder = nullptr;
+
+    // Jacobi collision passes, see `resolve_particle_collisions()`, read
+    // through `jacobi()`
+    bool deterministic = false;
+    // per particle, the summed corrections of the current pass, by index
+    std::vector<float> correction_x, correction_y;
+    // per slice, the candidate list `collide_cell()` reuses, kept between
+    // substeps so the collision passes do not allocate
+    std::vector<std::vector<int>> slice_candidates;
 
     ThreadPool &thread_pool;
 
+    using clock = std::chrono::steady_clock;
+
+    // milliseconds elapsed since `since`, then restarts `since` for the next phase
+    // the interval also goes to the profiler as event `phase`
+    static double lap_ms(clock::time_point &since, [[maybe_unused]] const char *phase)
+    {
+        clock::time_point now = clock::now();
+        PROFILE_EVENT(phase, since, now);
+        double ms = std::chrono::duration<double, std::milli>(now - since).count();
+        since = now;
+        return ms;
+    }
+
+    // the parameters `Config` may fix, constants then
+    bool jacobi() const
+    {
+        if constexpr (Config::stencil == Stencil::Dynamic)
+            return deterministic;
+        else
+            return Config::stencil == Stencil::Full;
+    }
+
+    bool adaptive() const
+    {
+        if constexpr (Config::sub_steps == 0)
+            return adaptive_sub_steps;
+        else
+            return false;
+    }
+
+    float current_bounce() const
+    {
+        if constexpr (Config::fixed_bounce)
+            return Config::bounce_factor;
+        else
+            return bounce_factor;
+    }
+
+    sf::Vector2f current_gravity() const
+    {
+        if constexpr (Config::fixed_gravity)
+            return {0.0f, Config::gravity_strength};
+        else
+            return gravity;
+    }
+
+    // distance kept from the window edges, one level-0 cell, or the radius of
+    // particles larger than that
+    float boundary_inset(int i) const
+    {
+        return uniform_radius ? grid_cell_size : std::max(grid_cell_size, entities.radius[i]);
+    }
+
     void resolve_boundary_collision(int entity_id)
     {
-        Particle &ent = entities[entity_id];
-        const sf::Vector2f pos = ent.position;
-        sf::Vector2f new_pos = ent.position;
-        sf::Vector2f vel = ent.get_velocity();
+        const sf::Vector2f pos = entities.get_position(entity_id);
+        sf::Vector2f new_pos = pos;
+        sf::Vector2f vel = entities.get_velocity(entity_id);
+        const float inset = boundary_inset(entity_id);
 
         sf::Vector2f dx = {-vel.x, vel.y};
         // bounce off left/right
-        if (pos.x < grid_cell_size || pos.x > window_size - grid_cell_size)
+        if (pos.x < inset || pos.x > window_size - inset)
         {
-            if (pos.x < grid_cell_size)
-                new_pos.x = grid_cell_size;
-            if (pos.x > window_size - grid_cell_size)
-                new_pos.x = window_size - grid_cell_size;
+            if (pos.x < inset)
+                new_pos.x = inset;
+            if (pos.x > window_size - inset)
+                new_pos.x = window_size - inset;
 
-            ent.position = new_pos;
-            ent.set_velocity(dx * bounce_factor, 1.0);
+            entities.set_position(entity_id, new_pos);
+            if constexpr (Config::boundary == Boundary::Bounce)
+                entities.set_velocity(entity_id, dx * current_bounce(), 1.0);
+            else
+                entities.set_velocity(entity_id, {0.0f, vel.y}, 1.0);
         }
 
         sf::Vector2f dy = {vel.x, -vel.y};
         // bounce off top/bottom
-        if (pos.y < grid_cell_size || pos.y > window_size - grid_cell_size)
+        if (pos.y < inset || pos.y > window_size - inset)
         {
-            if (pos.y < grid_cell_size)
-                new_pos.y = grid_cell_size;
-            if (pos.y > window_size - grid_cell_size)
-                new_pos.y = window_size - grid_cell_size;
-            ent.position = new_pos;
-            ent.set_velocity(dy * bounce_factor, 1.0);
+            if (pos.y < inset)
+                new_pos.y = inset;
+            if (pos.y > window_size - inset)
+                new_pos.y = window_size - inset;
+            entities.set_position(entity_id, new_pos);
+            if constexpr (Config::boundary == Boundary::Bounce)
+                entities.set_velocity(entity_id, dy * current_bounce(), 1.0);
+            else
+                entities.set_velocity(entity_id, {entities.get_velocity(entity_id).x, 0.0f}, 1.0);
         }
+
+        if (!colliders.empty())
+            colliders.resolve(entities.x[entity_id], entities.y[entity_id], entities.last_x[entity_id], entities.last_y[entity_id], entities.radius[entity_id]);
     }
 
-    void resolve_cell_collisions(int row_1, int col_1, int row_2, int col_2)
+    // https://en.wikipedia.org/wiki/Five-point_stencil
+    // (col, row) offsets (1, 0), (1, 1), (0, 0), (0, 1), (-1, 1)
+    // cells are column-major, so the stencil cells of one column are a
+    // single run of rows, i.e. one contiguous range of particle indices
+    // each pair is seen once and both particles move in place
+    static constexpr int stencil_runs = 3;
+    static constexpr int stencil_col_deltas[] = {1, 0, -1};
+    static constexpr int half_first_row_deltas[] = {0, 0, 1};
+    static constexpr int stencil_last_row_deltas[] = {1, 1, 1};
+    // https://en.wikipedia.org/wiki/Nine-point_stencil
+    // deterministic mode sees each pair from both sides, a particle only
+    // writes its own correction, so the full stencil needs no second pass
+    // with in-place updates it would race on the corner cells
+    static constexpr int full_first_row_deltas[] = {-1, -1, -1};
+
+    const int *stencil_first_row_deltas() const
+    {
+        return jacobi() ? full_first_row_deltas : half_first_row_deltas;
+    }
+
+    // resolves the particles [cell_begin, cell_end) of one cell against the
+    // particles of the stencil's runs
+    // `candidates` only grows, so it stops allocating after the first dense cell
+    void collide_cell(const int *cell_begin, const int *cell_end, const int *const *run_begin, const int *const *run_end, std::vector<int> &candidates)
     {
-        for (int id_1 : grid[row_1][col_1])
+        // only positions are touched, so the pass streams `x` and `y` alone,
+        // plus `radius` once sizes are mixed
+        float *x = entities.x.data();
+        float *y = entities.y.data();
+        const float *radius = uniform_radius ? nullptr : entities.radius.data();
+
+        // particles of all stencil cells, so the kernel sees one batch per
+        // particle rather than one short batch per neighbouring cell
+        int candidate_count = 0;
+        for (int run = 0; run < stencil_runs; run++)
+            candidate_count += run_end[run] - run_begin[run];
+        // the SIMD kernels read whole batches, pad with a valid index
+        if (candidates.size() < size_t(candidate_count + collision_kernels::padding))
+            candidates.resize(candidate_count + collision_kernels::padding);
+        int *out = candidates.data();
+        for (int run = 0; run < stencil_runs; run++)
+            out = std::copy(run_begin[run], run_end[run], out);
+        std::fill(out, out + collision_kernels::padding, candidates[0]);
+
+        if (jacobi())
         {
-            Particle &ent_1 = entities[id_1];
-            for (int id_2 : grid[row_2][col_2])
+            for (const int *it = cell_begin; it != cell_end; it++)
             {
-                if (id_1 == id_2)
-                    continue;
-
-                Particle &ent_2 = entities[id_2];
-                sf::Vector2f v = ent_1.position - ent_2.position;
-                float dist = v.x * v.x + v.y * v.y;
+                if (radius)
+                    collision_kernels::gather_mixed(x, y, radius, *it, candidates.data(), candidate_count, correction_x[*it], correction_y[*it]);
+                else
+                    gather_kernel(x, y, *it, candidates.data(), candidate_count, grid_cell_size, correction_x[*it], correction_y[*it]);
+            }
+            return;
+        }
+        if (radius)
+        {
+            // level-0 radii sum to at most `grid_cell_size`, the stencil still covers every contact
+            for (const int *it = cell_begin; it != cell_end; it++)
+                collision_kernels::resolve_mixed(x, y, radius, *it, candidates.data(), candidate_count);
+            return;
+        }
+        for (const int *it = cell_begin; it != cell_end; it++)
+            collision_kernel(x, y, *it, candidates.data(), candidate_count, grid_cell_size);
+    }
 
-                float min_dist = grid_cell_size;
+    // resolves collisions of the particles in columns [left_col, right_col)
+    // and rows [top_row, bottom_row)
+    // in deterministic mode, only sums each particle's corrections into
+    // `correction_x` and `correction_y`, `apply_corrections()` moves them
+    // `candidates` is the slice's scratch, see `slice_candidates`
+    void process_grid_slice(int left_col, int right_col, int top_row, int bottom_row, std::vector<int> &candidates)
+    {
+        const int *first_row_deltas = stencil_first_row_deltas();
+        const uint8_t *sleep = cell_sleep.empty() ? nullptr : cell_sleep.data();
 
-                if (dist >= min_dist * min_dist)
+        for (int col_1 = left_col; col_1 < right_col; col_1++)
+        {
+            for (int row_1 = top_row; row_1 < bottom_row; row_1++)
+            {
+                int cell_1 = grid.cell_index(col_1, row_1);
+                // frozen cells only border asleep cells, their contacts are at rest
+                if (grid.empty(cell_1) || (sleep && sleep[cell_1] == CELL_INERT))
                     continue;
 
-                dist = sqrt(dist);
-                float delta = 0.25f * (min_dist - dist);
-                sf::Vector2f n = v / dist * delta;
-
-                ent_1.position += n;
-                ent_2.position -= n;
+                const int *run_begin[stencil_runs];
+                const int *run_end[stencil_runs];
+                for (int run = 0; run < stencil_runs; run++)
+                {
+                    int col_2 = col_1 + stencil_col_deltas[run];
+                    int first_row = std::max(0, row_1 + first_row_deltas[run]);
+                    int last_row = std::min(grid_cell_count - 1, row_1 + stencil_last_row_deltas[run]);
+                    if (col_2 < 0 || col_2 >= grid_cell_count || first_row > last_row)
+                    {
+                        run_begin[run] = run_end[run] = nullptr;
+                        continue;
+                    }
 
-                // particles with greater mass move less when colliding
-                // not relevant for our case since all particles have the same mass
-                // but allows for future extension
-                // ent_1.position += n * (1 - mass_ratio) * delta;
-                // ent_2.position += -(n * mass_ratio * delta);
+                    run_begin[run] = grid.begin(grid.cell_index(col_2, first_row));
+                    run_end[run] = grid.end(grid.cell_index(col_2, last_row));
+                }
+                collide_cell(grid.begin(cell_1), grid.end(cell_1), run_begin, run_end, candidates);
             }
         }
     }
 
-    void process_grid_slice(int left_col, int right_col)
+    // `process_grid_slice()` on the sparse grid, columns [left_col,
+    // right_col) in full, slices are never rows there
+    // visits the occupied cells only, the stencil's runs in each neighbouring
+    // column are found by two cursors per run, its first and its end cell,
+    // that only move down the column, as the cells of `col_1` are visited in
+    // row order
+    // the same candidates in the same order as the dense grid gives, so the
+    // same positions
+    void process_sparse_slice(int left_col, int right_col, std::vector<int> &candidates)
     {
-        // https://en.wikipedia.org/wiki/Five-point_stencil
-        int col_deltas[] = {1, 1, 0, 0, -1};
-        int row_deltas[] = {0, 1, 0, 1, 1};
-        int stencil_count = 5;
-
-        // causes issues, likely due to race conditions on overlapping corner cells ?
-        // https://en.wikipedia.org/wiki/Nine-point_stencil
-        // int col_deltas[] = {-1, 0, 1, -1, 1, -1, 0, 1};
-        // int row_deltas[] = {-1, -1, -1, 0, 0, 1, 1, 1};
-        // int stencil_count = 9;
+        const SparseCellGrid &cells = sparse_grid;
+        const int *first_row_deltas = stencil_first_row_deltas();
+        const int *indices = cells.indices.data();
 
         for (int col_1 = left_col; col_1 < right_col; col_1++)
         {
-            for (int row_1 = 0; row_1 < grid_cell_count; row_1++)
+            // an empty range for the columns outside the grid
+            int first[stencil_runs], stop[stencil_runs], column_end[stencil_runs], base[stencil_runs];
+            for (int run = 0; run < stencil_runs; run++)
             {
-                if (grid[col_1][row_1].empty())
-                    continue;
+                const int col_2 = col_1 + stencil_col_deltas[run];
+                const bool inside = col_2 >= 0 && col_2 < grid_cell_count;
+                first[run] = stop[run] = column_end[run] = inside ? cells.column_start[col_2] : 0;
+                if (inside)
+                    column_end[run] = cells.column_start[col_2 + 1];
+                base[run] = col_2 * grid_cell_count;
+            }
 
-                for (int delta_idx = 0; delta_idx < stencil_count; delta_idx++)
+            for (int s = cells.column_start[col_1]; s < cells.column_start[col_1 + 1]; s++)
+            {
+                const int row_1 = cells.keys[s] - col_1 * grid_cell_count;
+                const int *run_begin[stencil_runs];
+                const int *run_end[stencil_runs];
+                for (int run = 0; run < stencil_runs; run++)
                 {
-                    int col_2 = col_1 + col_deltas[delta_idx];
-                    int row_2 = row_1 + row_deltas[delta_idx];
-
-                    if (col_2 < 0 || row_2 < 0 || col_2 >= grid_cell_count || row_2 >= grid_cell_count)
-                        continue;
+                    // rows past the grid's edge hold no keys of this column
+                    const int first_key = base[run] + row_1 + first_row_deltas[run];
+                    const int last_key = base[run] + row_1 + stencil_last_row_deltas[run];
+                    while (first[run] < column_end[run] && cells.keys[first[run]] < first_key)
+                        first[run]++;
+                    stop[run] = std::max(stop[run], first[run]);
+                    while (stop[run] < column_end[run] && cells.keys[stop[run]] <= last_key)
+                        stop[run]++;
+                    run_begin[run] = indices + cells.cell_start[first[run]];
+                    run_end[run] = indices + cells.cell_start[stop[run]];
+                }
+                collide_cell(indices + cells.cell_start[s], indices + cells.cell_start[s + 1], run_begin, run_end, candidates);
+            }
+        }
+    }
 
-                    resolve_cell_collisions(col_1, row_1, col_2, row_2);
+    // moves the particles of columns [left_col, right_col) and rows
+    // [top_row, bottom_row) by the corrections of the last Jacobi pass
+    void apply_corrections(int left_col, int right_col, int top_row, int bottom_row)
+    {
+        float *x = entities.x.data();
+        float *y = entities.y.data();
+        const uint8_t *sleep = cell_sleep.empty() ? nullptr : cell_sleep.data();
+        for (int col = left_col; col < right_col; col++)
+        {
+            for (int row = top_row; row < bottom_row; row++)
+            {
+                int cell = grid.cell_index(col, row);
+                // inert cells were skipped, their corrections are stale
+                if (sleep && sleep[cell] == CELL_INERT)
+                    continue;
+                for (const int *it = grid.begin(cell); it != grid.end(cell); it++)
+                {
+                    x[*it] += correction_x[*it];
+                    y[*it] += correction_y[*it];
                 }
             }
         }
     }
 
+    // `apply_corrections()` on the sparse grid, the particles of a range of
+    // columns are contiguous there
+    void apply_sparse_corrections(int left_col, int right_col)
+    {
+        float *x = entities.x.data();
+        float *y = entities.y.data();
+        for (const int *it = sparse_grid.column_begin(left_col); it != sparse_grid.column_begin(right_col); it++)
+        {
+            x[*it] += correction_x[*it];
+            y[*it] += correction_y[*it];
+        }
+    }
+
+    // splits lines [0, costs.size()) into at most `slice_count` slices of at
+    // least `min_width` lines, each as close as possible to an equal share of
+    // the summed cost
+    static void partition_lines(const std::vector<int> &costs, int slice_count, int min_width, std::vector<int> &bounds)
+    {
+        const int line_count = costs.size();
+        slice_count = std::max(1, std::min(slice_count, line_count / min_width));
+        long total = 0;
+        for (int cost : costs)
+            total += cost;
+
+        bounds.assign(1, 0);
+        long prefix = 0;
+        int line = 0;
+        for (int s = 1; s < slice_count; s++)
+        {
+            const long target = total * s / slice_count;
+            const int min_line = bounds.back() + min_width;
+            // leave enough lines for the remaining slices
+            const int max_line = line_count - (slice_count - s) * min_width;
+            while (line < min_line || (line < max_line && prefix + costs[line] / 2 < target))
+                prefix += costs[line++];
+            bounds.push_back(line);
+        }
+        bounds.push_back(line_count);
+    }
+
+    // estimated duration of the two passes over `bounds`, the costliest slice
+    // of each pass
+    static long pass_cost(const std::vector<int> &costs, const std::vector<int> &bounds)
+    {
+        long slowest[2] = {0, 0};
+        for (size_t s = 0; s + 1 < bounds.size(); s++)
+        {
+            long cost = 0;
+            for (int line = bounds[s]; line < bounds[s + 1]; line++)
+                cost += costs[line];
+            slowest[s % 2] = std::max(slowest[s % 2], cost);
+        }
+        return slowest[0] + slowest[1];
+    }
+
+    // moves the slice bounds so every slice holds about the same work, once a
+    // frame from the current grid
+    // a line costs its particles, plus one so empty stretches are not free
+    // with `SliceAxis::Auto`, slices run along whichever axis balances better,
+    // e.g. rows once gravity piles the particles against a side wall
+    // columns win ties, their cells are contiguous in memory
+    void balance_collision_slices()
+    {
+        // two slices per thread, one for each pass
+        const int slice_count = thread_pool.m_thread_count * 2;
+        // the sparse grid slices by columns only, its rows are not contiguous
+        if (sparse_broadphase)
+        {
+            column_costs.resize(grid_cell_count);
+            for (int col = 0; col < grid_cell_count; col++)
+                column_costs[col] = sparse_grid.column_end(col) - sparse_grid.column_begin(col) + 1;
+            partition_lines(column_costs, slice_count, 2, slice_bounds);
+            slice_rows = false;
+            return;
+        }
+        grid.line_counts(column_costs, row_costs);
+        // inert cells cost nothing
+        if (!cell_sleep.empty())
+        {
+            for (int c = 0; c < grid.cell_count(); c++)
+            {
+                if (cell_sleep[c] != CELL_INERT)
+                    continue;
+                column_costs[c / grid_cell_count] -= grid.size(c);
+                row_costs[c % grid_cell_count] -= grid.size(c);
+            }
+        }
+        for (int &cost : column_costs)
+            cost++;
+        for (int &cost : row_costs)
+            cost++;
+
+        if (slice_axis != SliceAxis::Rows)
+            partition_lines(column_costs, slice_count, 2, slice_bounds);
+        if (slice_axis != SliceAxis::Columns)
+            partition_lines(row_costs, slice_count, 2, row_bounds);
+
+        slice_rows = slice_axis == SliceAxis::Rows ||
+                     (slice_axis == SliceAxis::Auto &&
+                      pass_cost(row_costs, row_bounds) * 8 < pass_cost(column_costs, slice_bounds) * 7);
+        if (slice_rows)
+            slice_bounds.swap(row_bounds);
+    }
+
     void resolve_particle_collisions()
     {
-        int slice_count = thread_pool.m_thread_count * 2;
-        int slice_size = grid_cell_count / slice_count;
+        const int slice_count = slice_bounds.size() - 1;
+        if (slice_candidates.size() < size_t(slice_count))
+            slice_candidates.resize(slice_count);
+        if (jacobi())
+        {
+            resolve_particle_collisions_jacobi(slice_count);
+            return;
+        }
 
         // perform two passes to avoid race conditions on overlapping cells-to-be-processed between threads
-        // each slice is processed by a separate thread
-        // then a slice is halved, we process the left half first, then the right half
+        // the even slices first, then the odd ones, each slice by a separate task
+        // the stencil reaches one line past either side of a slice, and slices
+        // are at least two lines wide, so slices of the same pass never touch
+        // the same cell
+        for (int parity = 0; parity < 2; parity++)
+        {
+            const int task_count = (slice_count - parity + 1) / 2;
+            thread_pool.parallel(0, task_count, [&](int start, int end)
+                                 {
+                for (int i = start; i < end; i++)
+                {
+                    int s = 2 * i + parity;
+                    std::vector<int> &candidates = slice_candidates[s];
+                    if (sparse_broadphase)
+                        process_sparse_slice(slice_bounds[s], slice_bounds[s + 1], candidates);
+                    else if (slice_rows)
+                        process_grid_slice(0, grid_cell_count, slice_bounds[s], slice_bounds[s + 1], candidates);
+                    else
+                        process_grid_slice(slice_bounds[s], slice_bounds[s + 1], 0, grid_cell_count, candidates);
+                } }, task_count);
+        }
+
+        if (!levels.empty())
+            resolve_level_collisions();
+    }
+
+    // deterministic mode, one Jacobi iteration
+    // every particle sums its corrections against the positions at the start
+    // of the pass, in the grid's order, then all particles move at once
+    // nothing depends on which thread handles which slice, so the positions
+    // are bit-identical for any thread count (for a given collision kernel)
+    // converges a little slower than the in-place passes, a pair closes the
+    // same half of its overlap but sees none of the other contacts' moves
+    void resolve_particle_collisions_jacobi(int slice_count)
+    {
+        if (correction_x.size() < entities.size())
+        {
+            correction_x.resize(entities.size());
+            correction_y.resize(entities.size());
+        }
+
+        auto for_each_slice = [&](auto &&fn)
+        {
+            thread_pool.parallel(0, slice_count, [&](int start, int end)
+                                 {
+                for (int s = start; s < end; s++)
+                {
+                    if (slice_rows)
+                        fn(s, 0, grid_cell_count, slice_bounds[s], slice_bounds[s + 1]);
+                    else
+                        fn(s, slice_bounds[s], slice_bounds[s + 1], 0, grid_cell_count);
+                } }, slice_count);
+        };
+        if (sparse_broadphase)
+        {
+            for_each_slice([&](int s, int left_col, int right_col, int, int)
+                           { process_sparse_slice(left_col, right_col, slice_candidates[s]); });
+            for_each_slice([&](int, int left_col, int right_col, int, int)
+                           { apply_sparse_corrections(left_col, right_col); });
+        }
+        else
+        {
+            for_each_slice([&](int s, int left_col, int right_col, int top_row, int bottom_row)
+                           { process_grid_slice(left_col, right_col, top_row, bottom_row, slice_candidates[s]); });
+            for_each_slice([&](int, int left_col, int right_col, int top_row, int bottom_row)
+                           { apply_corrections(left_col, right_col, top_row, bottom_row); });
+        }
+
+        // serial, in a fixed order
+        if (!levels.empty())
+            resolve_level_collisions();
+    }
+
+    // first level whose cells fit a particle of `radius`
+    int level_of(float radius) const
+    {
+        int level = 0;
+        for (float cell_size = grid_cell_size; cell_size < 2 * radius; cell_size *= 2)
+            level++;
+        return level;
+    }
 
-        // left pass
-        for (int i = 0; i < thread_pool.m_thread_count; i++)
+    // large particles are few, they are resolved serially after the level-0
+    // passes
+    // each particle of level `k` checks level 0 and levels 1 to `k`, pairs
+    // within level `k` once, so every pair involving a large particle is seen
+    // exactly once
+    // the cells searched on level `m` reach `radius + cell_size_m / 2` from the
+    // particle, as far as any contact with a particle of that level goes
+    void resolve_level_collisions()
+    {
+        float *x = entities.x.data();
+        float *y = entities.y.data();
+        const float *radius = entities.radius.data();
+
+        for (size_t k = 0; k < levels.size(); k++)
         {
-            thread_pool.m_task_queue.enqueue_task([this, i, slice_size]
-                                                  {
-                int slice_start = 2 * i * slice_size;
-                int slice_end = slice_start + slice_size;
-                process_grid_slice(slice_start, slice_end); });
+            const GridLevel &level = levels[k];
+            for (size_t a = 0; a < level.members.size(); a++)
+            {
+                const int i = level.members[a];
+                if (level.cells[a] < 0)
+                    continue;
+
+                auto resolve = [&](int j)
+                { collision_kernels::resolve_pair(x, y, radius, i, j); };
+                const float reach = radius[i] + 0.5f * grid_cell_size;
+                if (sparse_broadphase)
+                    sparse_grid.for_each_near(x[i], y[i], reach, grid_cell_size, resolve);
+                else
+                    grid.for_each_near(x[i], y[i], reach, grid_cell_size, resolve);
+
+                for (size_t m = 0; m <= k; m++)
+                {
+                    const GridLevel &other = levels[m];
+                    const float other_reach = radius[i] + 0.5f * other.cell_size;
+                    other.for_each_in_box(x[i] - other_reach, y[i] - other_reach, x[i] + other_reach, y[i] + other_reach, [&](int b)
+                                          {
+                        if (m < k || b > int(a))
+                            collision_kernels::resolve_pair(x, y, radius, i, other.members[b]); });
+                }
+            }
         }
+    }
 
-        // if grid_cell_count is not divisible by slice_count
-        // create task for processing remaining cells
-        if (slice_count * slice_size < grid_cell_count)
+    // creates levels up to `level` as needed
+    void add_to_level(int level, int id)
+    {
+        while (int(levels.size()) < level)
         {
-            thread_pool.m_task_queue.enqueue_task([this, slice_count, slice_size]
-                                                  { process_grid_slice(slice_count * slice_size, grid_cell_count); });
+            GridLevel &new_level = levels.emplace_back();
+            new_level.cell_size = grid_cell_size * (1 << levels.size());
+            new_level.resize(std::ceil(window_size / new_level.cell_size), sparse_broadphase);
         }
+        levels[level - 1].ids.push_back(id);
+    }
+
+    // bins the large particles into their levels
+    void update_levels()
+    {
+        for (GridLevel &level : levels)
+        {
+            level.members.resize(level.ids.size());
+            level.cells.resize(level.ids.size());
+            for (size_t a = 0; a < level.ids.size(); a++)
+            {
+                const int i = entities.index_of[level.ids[a]];
+                level.members[a] = i;
+                level.cells[a] = level.cell_index(entities.x[i] / level.cell_size, entities.y[i] / level.cell_size);
+            }
+            level.build();
+        }
+    }
 
-        thread_pool.m_task_queue.await_completion();
+    // level-0 cell at (`x`, `y`), -1 outside the grid, on either grid
+    int cell_at(float x, float y) const
+    {
+        const int col = x / grid_cell_size;
+        const int row = y / grid_cell_size;
+        if (col < 0 || row < 0 || col >= grid_cell_count || row >= grid_cell_count)
+            return -1;
+        return col * grid_cell_count + row;
+    }
+
+    // level-0 cell of particle `i`, -1 for large particles, they are binned
+    // by `update_levels()`
+    int level_0_cell(int i) const
+    {
+        if (!uniform_radius && entities.radius[i] > 0.5f * grid_cell_size)
+            return -1;
+        return cell_at(entities.x[i], entities.y[i]);
+    }
+
+    // the farthest a particle may move in one substep without missing a
+    // contact: two particles passing each other close in by at most twice
+    // that, one diameter, the distance they would have to overlap by
+    float max_substep_travel() const
+    {
+        return 0.5f * grid_cell_size;
+    }
 
-        // right pass
-        for (int i = 0; i < thread_pool.m_thread_count; i++)
+    void integrate_entity(int i, float dt)
+    {
+        entities.update_position(i, dt);
+        sf::Vector2f vel = entities.get_velocity(i);
+
+        const float step_sq = vel.x * vel.x + vel.y * vel.y;
+        if (adaptive())
         {
-            thread_pool.m_task_queue.enqueue_task([this, i, slice_size]
-                                                  {
-                int slice_start = (2 * i + 1) * slice_size;
-                int slice_end = slice_start + slice_size;
-                process_grid_slice(slice_start, slice_end); });
+            // only past `max_sub_steps`, the substeps keep everything else
+            // below the limit
+            const float travel = max_substep_travel();
+            if (step_sq > travel * travel)
+            {
+                const float scale = travel / std::sqrt(step_sq);
+                entities.x[i] = entities.last_x[i] + vel.x * scale;
+                entities.y[i] = entities.last_y[i] + vel.y * scale;
+            }
         }
+        // prevent particles from skipping cells when moving fast
+        // avoids missed collisions with other particles or window boundaries
+        else if (step_sq > grid_cell_size)
+            entities.set_velocity(i, {0.0f, 0.0f}, 1.0);
+        entities.cell[i] = level_0_cell(i);
+    }
 
-        thread_pool.m_task_queue.await_completion();
+    // adaptive substepping: this frame's substep count, from the fastest awake
+    // particle, so that it moves at most `max_substep_travel()` per substep,
+    // between `min_sub_steps` and `max_sub_steps`
+    // the count rises at once and falls by one per frame, a calming scene
+    // does not flicker between counts
+    // velocities are stored as the last substep's displacement, so they are
+    // rescaled to the new substep length
+    void choose_sub_steps()
+    {
+        const int chunk_count = thread_pool.m_thread_count;
+        const int entity_count = entities.size();
+        chunk_max_step.assign(chunk_count, 0.0f);
+        thread_pool.parallel(chunk_count, [&](int start, int end)
+                             {
+            for (int chunk = start; chunk < end; chunk++)
+            {
+                int first, last;
+                CellGrid::chunk_range(chunk, chunk_count, entity_count, first, last);
+                float max_step = 0.0f;
+                for (int i = first; i < last; i++)
+                {
+                    if (is_asleep(i))
+                        continue;
+                    const float step_x = entities.x[i] - entities.last_x[i];
+                    const float step_y = entities.y[i] - entities.last_y[i];
+                    max_step = std::max(max_step, step_x * step_x + step_y * step_y);
+                }
+                chunk_max_step[chunk] = max_step;
+            } });
+        const float max_step = std::sqrt(*std::max_element(chunk_max_step.begin(), chunk_max_step.end()));
+
+        // the same speed over the whole frame, split finely enough
+        const int needed = std::ceil(max_step * sub_steps / max_substep_travel());
+        int next = needed >= sub_steps ? needed : std::max(needed, sub_steps - 1);
+        next = std::clamp(next, min_sub_steps, max_sub_steps);
+        if (next == sub_steps)
+            return;
+
+        const float scale = float(sub_steps) / next;
+        thread_pool.parallel(entity_count, [&](int start, int end)
+                             {
+            for (int i = start; i < end; i++)
+            {
+                entities.last_x[i] = entities.x[i] - (entities.x[i] - entities.last_x[i]) * scale;
+                entities.last_y[i] = entities.y[i] - (entities.y[i] - entities.last_y[i]) * scale;
+            } });
+        sub_steps = next;
     }
 
     // logic to be parallelized
     void update_entities_thread(int start_id, int end_id, float dt)
     {
         for (int i = start_id; i < end_id; i++)
+            if (!is_asleep(i))
+                integrate_entity(i, dt);
+    }
+
+    // gravity, boundary, colliders and integration of one particle after the
+    // other, in registers, instead of one pass over all particles for each
+    // same arithmetic as `apply_force()`, `resolve_boundary_collision()` and
+    // `integrate_entity()`, so the positions match the phased substep bit for
+    // bit, collisions never read `acc_x`/`acc_y` so gravity may come after them
+    // the new cells are counted into `histogram` when given, the first stage
+    // of the parallel grid build
+    void fused_entities_thread(int start_id, int end_id, float dt, int *histogram)
+    {
+        float *x = entities.x.data();
+        float *y = entities.y.data();
+        float *last_x = entities.last_x.data();
+        float *last_y = entities.last_y.data();
+        float *acc_x = entities.acc_x.data();
+        float *acc_y = entities.acc_y.data();
+        int *cell = entities.cell.data();
+        const float *radius = uniform_radius ? nullptr : entities.radius.data();
+        const uint8_t *sleep = cell_sleep.empty() ? nullptr : cell_sleep.data();
+        const float half_cell = 0.5f * grid_cell_size;
+        const float dt_sq = dt * dt;
+        const sf::Vector2f gravity_acc = current_gravity();
+        const float bounce = current_bounce();
+        const bool has_colliders = !colliders.empty();
+        const bool adaptive_travel = adaptive();
+        const float travel = max_substep_travel();
+        const float *long_range_ax = has_long_range() ? long_range_x.data() : nullptr;
+        const float *long_range_ay = has_long_range() ? long_range_y.data() : nullptr;
+
+        for (int i = start_id; i < end_id; i++)
+        {
+            // asleep particles stay put, in the same cell
+            if (sleep && cell[i] >= 0 && sleep[cell[i]] >= CELL_FROZEN)
+            {
+                if (histogram)
+                    histogram[cell[i]]++;
+                continue;
+            }
+
+            const float low = radius ? std::max(grid_cell_size, radius[i]) : grid_cell_size;
+            const float high = window_size - low;
+            float pos_x = x[i], pos_y = y[i];
+            float prev_x = last_x[i], prev_y = last_y[i];
+            float vel_x = pos_x - prev_x, vel_y = pos_y - prev_y;
+
+            // bounce off (or slide along) left/right, then top/bottom
+            if (pos_x < low || pos_x > high)
+            {
+                pos_x = pos_x < low ? low : high;
+                if constexpr (Config::boundary == Boundary::Bounce)
+                {
+                    prev_x = pos_x + vel_x * bounce;
+                    prev_y = pos_y - vel_y * bounce;
+                }
+                else
+                {
+                    prev_x = pos_x;
+                    prev_y = pos_y - vel_y;
+                }
+            }
+            if (pos_y < low || pos_y > high)
+            {
+                pos_y = pos_y < low ? low : high;
+                if constexpr (Config::boundary == Boundary::Bounce)
+                {
+                    prev_x = pos_x - vel_x * bounce;
+                    prev_y = pos_y + vel_y * bounce;
+                }
+                else
+                {
+                    prev_x = pos_x - (pos_x - prev_x);
+                    prev_y = pos_y;
+                }
+            }
+            if (has_colliders)
+                colliders.resolve(pos_x, pos_y, prev_x, prev_y, radius ? radius[i] : half_cell);
+
+            // verlet step, then the cap on a substep's travel, or the
+            // cell-skipping velocity clamp
+            float force_x = acc_x[i] + gravity_acc.x;
+            float force_y = acc_y[i] + gravity_acc.y;
+            if (long_range_ax)
+            {
+                force_x += long_range_ax[i];
+                force_y += long_range_ay[i];
+            }
+            float next_x = pos_x + (pos_x - prev_x) + force_x * dt_sq;
+            float next_y = pos_y + (pos_y - prev_y) + force_y * dt_sq;
+            float step_x = next_x - pos_x, step_y = next_y - pos_y;
+            const float step_sq = step_x * step_x + step_y * step_y;
+            if (adaptive_travel)
+            {
+                if (step_sq > travel * travel)
+                {
+                    const float scale = travel / std::sqrt(step_sq);
+                    next_x = pos_x + step_x * scale;
+                    next_y = pos_y + step_y * scale;
+                }
+            }
+            else if (step_sq > grid_cell_size)
+                pos_x = next_x, pos_y = next_y;
+
+            x[i] = next_x;
+            y[i] = next_y;
+            last_x[i] = pos_x;
+            last_y[i] = pos_y;
+            acc_x[i] = 0.0f;
+            acc_y[i] = 0.0f;
+
+            int c = radius && radius[i] > half_cell
+                        ? -1
+                        : cell_at(next_x, next_y);
+            cell[i] = c;
+            if (histogram && c >= 0)
+                histogram[c]++;
+        }
+    }
+
+    bool has_long_range() const
+    {
+        return long_range_strength != 0.0f || !attractor_x.empty();
+    }
+
+    // the long-range acceleration of every awake particle, from the particle
+    // tree, rebuilt every frame, and the attractor tree, rebuilt when the
+    // attractors change
+    // particles are visited in the particle tree's order, so neighbouring
+    // traversals share most of their nodes in cache
+    void compute_long_range()
+    {
+        const int count = entities.size();
+        long_range_x.resize(count);
+        long_range_y.resize(count);
+        if (long_range_strength != 0.0f)
+        {
+            long_range_mass.resize(count);
+            thread_pool.parallel(count, [&](int start, int end)
+                                 {
+                for (int i = start; i < end; i++)
+                    long_range_mass[i] = entities.radius[i] * entities.radius[i]; });
+            particle_tree.build(entities.x.data(), entities.y.data(), long_range_mass.data(), count, thread_pool);
+        }
+        if (attractors_dirty)
         {
-            Particle &ent = entities[i];
-            ent.update_position(dt);
-            ent.grid_row = ent.position.x / grid_cell_size;
-            ent.grid_col = ent.position.y / grid_cell_size;
-            sf::Vector2f vel = ent.get_velocity();
+            attractor_tree.build(attractor_x.data(), attractor_y.data(), attractor_strength.data(), attractor_x.size(), thread_pool);
+            attractors_dirty = false;
+        }
+
+        const bool particles = long_range_strength != 0.0f;
+        const float theta_sq = opening_angle * opening_angle;
+        const float softening_sq = long_range_softening * long_range_softening;
+        // traversals differ a lot in length, small chunks keep the workers
+        // stealing
+        thread_pool.parallel(0, count, [&](int start, int end)
+                             {
+            for (int k = start; k < end; k++)
+            {
+                const int i = particles ? particle_tree.order[k] : k;
+                float ax = 0.0f, ay = 0.0f;
+                if (!is_asleep(i))
+                {
+                    if (particles)
+                    {
+                        particle_tree.accumulate(entities.x[i], entities.y[i], theta_sq, softening_sq, ax, ay);
+                        ax *= long_range_strength;
+                        ay *= long_range_strength;
+                    }
+                    attractor_tree.accumulate(entities.x[i], entities.y[i], theta_sq, softening_sq, ax, ay);
+                }
+                long_range_x[i] = ax;
+                long_range_y[i] = ay;
+            } }, 8 * thread_pool.m_thread_count);
+    }
+
+    // one fork/join for gravity, boundary and integration, then the rest of
+    // the grid build straight from the cells it computed
+    // the chunks follow the grid's own split, so each chunk's histogram
+    // matches the particles it scatters
+    void fused_substep(float dt, clock::time_point &phase_start)
+    {
+        const int chunk_count = thread_pool.m_thread_count;
+        const int entity_count = entities.size();
+        // the sparse grid's histograms are per column, it bins afterwards
+        const bool count_cells = parallel_grid_build && chunk_count > 1 && !sparse_broadphase;
+
+        if (count_cells)
+            grid.begin_build(chunk_count);
+        thread_pool.parallel(chunk_count, [&](int start, int end)
+                             {
+            for (int chunk = start; chunk < end; chunk++)
+            {
+                int first, last;
+                CellGrid::chunk_range(chunk, chunk_count, entity_count, first, last);
+                int *histogram = count_cells ? grid.clear_histogram(chunk) : nullptr;
+                fused_entities_thread(first, last, dt, histogram);
+            } });
+        last_timings.integration_ms += lap_ms(phase_start, "integration");
+
+        if (count_cells)
+            grid.finish_build(entities.cell, thread_pool);
+        else
+            build_grid();
+        update_levels();
+        grid_dirty = false;
+        last_timings.grid_ms += lap_ms(phase_start, "grid");
+    }
 
-            // prevent particles from skipping cells when moving fast
-            // avoids missed collisions with other particles or window boundaries
-            if (vel.x * vel.x + vel.y * vel.y > grid_cell_size)
-                ent.set_velocity({0.0f, 0.0f}, 1.0);
+    // counting sort on the cells computed during integration
+    // entities outside the grid have cell -1 and are dropped
+    void build_grid()
+    {
+        if (sparse_broadphase)
+        {
+            // six fork/joins, not worth it for a single thread
+            if (parallel_grid_build && thread_pool.m_thread_count > 1)
+                sparse_grid.build(entities.cell, thread_pool);
+            else
+                sparse_grid.build(entities.cell);
         }
+        else if (parallel_grid_build)
+            grid.build(entities.cell, thread_pool);
+        else
+            grid.build(entities.cell);
     }
 
     void update_grid()
     {
-        for (int i = 0; i < grid_cell_count; i++)
-            for (int j = 0; j < grid_cell_count; j++)
-                grid[i][j].clear();
+        build_grid();
+        update_levels();
+        grid_dirty = false;
+    }
 
-        for (Particle &ent : entities)
+    // sorts `entities` by the Z-order of their grid cell, so particles that are
+    // close in space are close in memory, and each cell's particles end up
+    // contiguous
+    // the grid already lists each cell's particles in index order, so walking
+    // its cells along the curve yields the permutation without sorting
+    void reorder_entities()
+    {
+        if (grid_dirty)
+            update_grid();
+
+        reorder_order.clear();
+        // the sparse grid's own order, column-major, a curve over the
+        // occupied cells alone would need sorting them every time
+        if (sparse_broadphase)
+            reorder_order = sparse_grid.indices;
+        else
         {
-            if (ent.grid_row < 0 || ent.grid_col < 0 || ent.grid_row >= grid_cell_count || ent.grid_col >= grid_cell_count)
-                continue;
-            grid[ent.grid_row][ent.grid_col].push_back(ent.id);
+            if (morton_cells.empty())
+                morton_cells = grid.morton_order();
+            for (int cell : morton_cells)
+                reorder_order.insert(reorder_order.end(), grid.begin(cell), grid.end(cell));
         }
+        // entities outside the grid keep their relative order at the end
+        for (size_t i = 0; i < entities.size(); i++)
+            if (entities.cell[i] < 0)
+                reorder_order.push_back(i);
+
+        reorder_scratch.resize_like(entities);
+        thread_pool.parallel(entities.size(), [&](int start, int end)
+                             { reorder_scratch.gather(entities, reorder_order, start, end); });
+        entities.swap_arrays(reorder_scratch);
+        thread_pool.parallel(entities.size(), [&](int start, int end)
+                             { entities.update_index_of(start, end); });
+
+        // indices changed under the grid and the constraints
+        update_grid();
+        constraints.update_indices(entities);
     }
 
-public:
-    std::vector<Particle> entities;
+    // the colliders' raster follows the level-0 cells, on the sparse grid at
+    // cells twice as wide until it is no wider than a dense grid may be, a
+    // raster is dense and mostly empty there
+    void build_colliders()
+    {
+        int scale = 1;
+        if (sparse_broadphase)
+            while ((grid_cell_count + scale - 1) / scale > dense_grid_max_width)
+                scale *= 2;
+        colliders.build(grid_cell_size * scale, (grid_cell_count + scale - 1) / scale);
+    }
 
-    Simulator(float window_size_, float radius, ThreadPool &thread_pool_)
-        : window_size{window_size_}, grid_cell_size{2 * radius}, thread_pool{thread_pool_}
+    // bins particles added since the last `update()`, so queries see them
+    void refresh_grid()
     {
+        if (grid_dirty)
+            update_grid();
     }
 
-    virtual ~Simulator()
+    // between the collisions and the integration of each substep, so links
+    // get the last word over contacts before positions are committed
+    void solve_constraints()
     {
-        for (Worker &worker : thread_pool.m_workers)
+        if (constraints.empty())
+            return;
+        for (int iteration = 0; iteration < constraint_iterations; iteration++)
+            constraints.solve(entities, thread_pool);
+    }
+
+    bool is_asleep(int i) const
+    {
+        return !cell_sleep.empty() && entities.cell[i] >= 0 && cell_sleep[entities.cell[i]] >= CELL_FROZEN;
+    }
+
+    // calls `fn(first_cell, last_cell)`, both inclusive, for the cells of each
+    // column of region `r`
+    template <typename Fn>
+    void for_each_region_column(int r, Fn &&fn) const
+    {
+        int first_col = (r / region_count) * region_cells;
+        int first_row = (r % region_count) * region_cells;
+        int last_col = std::min(grid_cell_count, first_col + region_cells) - 1;
+        int last_row = std::min(grid_cell_count, first_row + region_cells) - 1;
+        for (int col = first_col; col <= last_col; col++)
+            fn(grid.cell_index(col, first_row), grid.cell_index(col, last_row));
+    }
+
+    // whether `pred(region)` holds for `r` or any of its 8 neighbours
+    template <typename Pred>
+    bool any_region_around(int r, Pred &&pred) const
+    {
+        int region_col = r / region_count;
+        int region_row = r % region_count;
+        for (int col = std::max(0, region_col - 1); col <= std::min(region_count - 1, region_col + 1); col++)
+            for (int row = std::max(0, region_row - 1); row <= std::min(region_count - 1, region_row + 1); row++)
+                if (pred(col * region_count + row))
+                    return true;
+        return false;
+    }
+
+    // calls `fn(region)` for region columns [first_col, last_col] and rows
+    // [first_row, last_row], clamped to the grid
+    template <typename Fn>
+    void for_each_region(int first_col, int last_col, int first_row, int last_row, Fn &&fn) const
+    {
+        for (int col = std::max(0, first_col); col <= std::min(region_count - 1, last_col); col++)
+            for (int row = std::max(0, first_row); row <= std::min(region_count - 1, last_row); row++)
+                fn(col * region_count + row);
+    }
+
+    // refreshes `cell_sleep` after the regions in columns [first_col,
+    // last_col] and rows [first_row, last_row] fell asleep or woke up
+    // frozen regions depend on their neighbours, inert ones on their
+    // neighbours' neighbours
+    void update_cell_sleep(int first_col, int last_col, int first_row, int last_row)
+    {
+        for_each_region(first_col - 1, last_col + 1, first_row - 1, last_row + 1, [&](int r)
+                        {
+            bool frozen = region_asleep[r] && !any_region_around(r, [&](int n)
+                                                                 { return !region_asleep[n]; });
+            // frozen particles pick up collision pushes as velocity, it must
+            // not carry over once they are integrated again
+            if (frozen != bool(region_frozen[r]))
+                stop_region(r);
+            region_frozen[r] = frozen; });
+
+        for_each_region(first_col - 2, last_col + 2, first_row - 2, last_row + 2, [&](int r)
+                        {
+            uint8_t state = CELL_AWAKE;
+            if (region_frozen[r])
+                state = any_region_around(r, [&](int n)
+                                          { return !region_frozen[n]; })
+                            ? CELL_FROZEN
+                            : CELL_INERT;
+            else if (region_asleep[r])
+                state = CELL_ASLEEP;
+            for_each_region_column(r, [&](int first, int last)
+                                   { std::fill(cell_sleep.begin() + first, cell_sleep.begin() + last + 1, state); }); });
+    }
+
+    // puts region `r` to sleep or wakes it, either way its particles come to
+    // a stop
+    void set_region_asleep(int r, bool asleep)
+    {
+        region_asleep[r] = asleep;
+        region_quiet_frames[r] = 0;
+        stop_region(r);
+    }
+
+    // zeroes the velocity of region `r`'s particles
+    void stop_region(int r)
+    {
+        for_each_region_column(r, [&](int first, int last)
+                               {
+            for (const int *it = grid.begin(first); it != grid.end(last); it++)
+                entities.set_velocity(*it, {0.0f, 0.0f}, 1.0); });
+    }
+
+    // wakes every region overlapping the square of half-size `reach` around
+    // `position`
+    void wake_near(sf::Vector2f position, float reach)
+    {
+        if (!sleeping)
+            return;
+        const float region_size = grid_cell_size * region_cells;
+        int first_col = std::max(0, int((position.x - reach) / region_size));
+        int last_col = std::min(region_count - 1, int((position.x + reach) / region_size));
+        int first_row = std::max(0, int((position.y - reach) / region_size));
+        int last_row = std::min(region_count - 1, int((position.y + reach) / region_size));
+
+        bool changed = false;
+        for (int col = first_col; col <= last_col; col++)
+        {
+            for (int row = first_row; row <= last_row; row++)
+            {
+                int r = col * region_count + row;
+                region_quiet_frames[r] = 0;
+                if (!region_asleep[r])
+                    continue;
+                set_region_asleep(r, false);
+                changed = true;
+            }
+        }
+        if (changed)
+            update_cell_sleep(first_col, last_col, first_row, last_row);
+    }
+
+    void wake_all()
+    {
+        if (!sleeping)
+            return;
+        wake_near({0.5f * window_size, 0.5f * window_size}, window_size);
+    }
+
+    // once a frame, after the last substep
+    // - a region is quiet while the root mean square speed of its particles
+    //   stays below `sleep_speed`, it falls asleep after `sleep_frames` quiet
+    //   frames
+    // - an asleep region wakes when it moves faster than that again, once the
+    //   pushes its frozen particles received add up past `wake_push`, or when
+    //   any neighbouring particle is faster than `wake_speed`, which may carry
+    //   it into the region
+    // the mean rather than the fastest particle, a settled pile never fully
+    // stops jittering
+    // regions next to an empty one never freeze, so a particle hopping off a
+    // pile's surface falls back rather than freezing in mid-air
+    void update_sleep()
+    {
+        const float speed_sq = sleep_speed * sleep_speed;
+        const float wake_speed_sq = wake_speed * wake_speed;
+        const float push_sq = wake_push * wake_push;
+        thread_pool.parallel(region_count * region_count, [&](int start, int end)
+                             {
+            for (int r = start; r < end; r++)
+            {
+                float energy = 0.0f;
+                float fastest = 0.0f;
+                int count = 0;
+                for_each_region_column(r, [&](int first, int last)
+                                       {
+                    for (const int *it = grid.begin(first); it != grid.end(last); it++)
+                    {
+                        sf::Vector2f vel = entities.get_velocity(*it);
+                        float speed = vel.x * vel.x + vel.y * vel.y;
+                        energy += speed;
+                        fastest = std::max(fastest, speed);
+                    }
+                    count += grid.end(last) - grid.begin(first); });
+                // frozen particles stand still, `x - last_x` adds up the
+                // collision pushes they received since freezing
+                const float limit_sq = region_frozen[r] ? push_sq : speed_sq;
+                region_motion[r] = (energy > limit_sq * count ? MOTION_MOVING : 0) |
+                                   (!region_frozen[r] && fastest > wake_speed_sq ? MOTION_FAST : 0) |
+                                   (count == 0 ? MOTION_EMPTY : 0);
+            } });
+
+        for (int r = 0; r < region_count * region_count; r++)
         {
-            worker.stop();
+            bool moving = region_motion[r] & MOTION_MOVING;
+            bool fast_neighbour = any_region_around(r, [&](int n)
+                                                    { return (region_motion[n] & MOTION_FAST) != 0; });
+            if (region_asleep[r])
+            {
+                if (moving || fast_neighbour)
+                    set_region_asleep(r, false);
+                continue;
+            }
+
+            // empty regions have nothing to save, staying awake keeps their
+            // neighbours from freezing
+            bool quiet = !moving && !fast_neighbour && !(region_motion[r] & MOTION_EMPTY);
+            region_quiet_frames[r] = quiet ? region_quiet_frames[r] + 1 : 0;
+            if (region_quiet_frames[r] >= sleep_frames)
+                set_region_asleep(r, true);
         }
+        update_cell_sleep(0, region_count - 1, 0, region_count - 1);
     }
 
-    Particle &add_entity(sf::Vector2f position, float radius)
+public:
+    ParticleStore entities;
+
+    // wall-clock time spent in each phase of the last `update()`, summed over its substeps
+    struct PhaseTimings
     {
-        int grid_row = position.x / grid_cell_size;
-        int grid_col = position.x / grid_cell_size;
+        double gravity_ms = 0.0;
+        double collisions_ms = 0.0;
+        double boundary_ms = 0.0;
+        double integration_ms = 0.0;
+        double grid_ms = 0.0;
+        double reorder_ms = 0.0;
+        double sleep_ms = 0.0;
+        double record_ms = 0.0;
+        double constraints_ms = 0.0;
+        double long_range_ms = 0.0;
+
+        double total_ms() const
+        {
+            return gravity_ms + collisions_ms + constraints_ms + boundary_ms + integration_ms + grid_ms + reorder_ms + sleep_ms + record_ms + long_range_ms;
+        }
 
-        Particle new_particle = Particle(position, radius, grid_row, grid_col, entities.size());
-        // `push_back` copies the object
-        grid[grid_row][grid_col].push_back(new_particle.id);
+        PhaseTimings &operator+=(const PhaseTimings &other)
+        {
+            gravity_ms += other.gravity_ms;
+            collisions_ms += other.collisions_ms;
+            constraints_ms += other.constraints_ms;
+            boundary_ms += other.boundary_ms;
+            integration_ms += other.integration_ms;
+            grid_ms += other.grid_ms;
+            reorder_ms += other.reorder_ms;
+            sleep_ms += other.sleep_ms;
+            record_ms += other.record_ms;
+            long_range_ms += other.long_range_ms;
+            return *this;
+        }
+    };
 
-        // `emplace_back` constructs the object in-place, redundant since new_particle already exists
-        // but also returns a reference to the constructed object, so usefull here
-        // q: not sure if returning a reference to the local variable `new_particle` is safe, Rust would not allow it (without valid lifetime definition)
-        // a: local variables are destroyed when function returns, so a reference to a local variable would become a dangling pointer
-        return entities.emplace_back(new_particle);
+    PhaseTimings last_timings;
+
+    BasicSimulator(float window_size_, float radius, ThreadPool &thread_pool_)
+        : window_size{window_size_}, grid_cell_size{2 * radius}, long_range_softening{2 * radius}, thread_pool{thread_pool_}
+    {
+        set_sparse_grid(grid_cell_count > dense_grid_max_width);
+        colliders.reserve_margin(radius);
+    }
+
+    // the pool is the caller's, other simulators may still be using it
+    virtual ~BasicSimulator() = default;
+
+    // particles up to the ctor's radius share the level-0 grid, larger ones
+    // go to a coarser level
+    Particle add_entity(sf::Vector2f position, float radius)
+    {
+        if (radius != 0.5f * grid_cell_size)
+            uniform_radius = false;
+        colliders.reserve_margin(radius);
+
+        int level = level_of(radius);
+        int cell = level == 0 ? cell_at(position.x, position.y) : -1;
+        int id = entities.push(position, radius, cell);
+        wake_near(position, radius);
+        if (level > 0)
+            add_to_level(level, id);
+        // binned at the start of the next `update()`
+        grid_dirty = true;
+
+        // a handle rather than a reference, references into the store's vectors
+        // would dangle as soon as they reallocate
+        return Particle{&entities, id};
+    }
+
+    // swap-removes `particle`, the particle with the highest id takes over
+    // its id, handles to that one are stale afterwards
+    // false, and nothing removed, for a linked particle, or while a recorder
+    // is attached, recordings only ever append particles
+    bool remove_entity(Particle particle)
+    {
+        const int id = particle.id;
+        if (recorder || constraints.uses(id))
+            return false;
+        const int last_id = entities.size() - 1;
+        const int index = entities.index_of[id];
+        wake_near(entities.get_position(index), entities.radius[index]);
+        const int level = level_of(entities.radius[index]);
+        if (level > 0)
+        {
+            std::vector<int> &ids = levels[level - 1].ids;
+            ids.erase(std::find(ids.begin(), ids.end(), id));
+        }
+        if (id != last_id)
+        {
+            const int moved_level = level_of(entities.radius[entities.index_of[last_id]]);
+            if (moved_level > 0)
+            {
+                std::vector<int> &ids = levels[moved_level - 1].ids;
+                *std::find(ids.begin(), ids.end(), last_id) = id;
+            }
+        }
+        constraints.rename(last_id, id);
+        entities.remove(id);
+        if (!constraints.empty())
+            constraints.update_indices(entities);
+        grid_dirty = true;
+        return true;
     }
 
     void update()
     {
-        float substep_dt = step_dt / sub_steps;
-        for (int i = 0; i < sub_steps; i++)
+        PROFILE_SCOPE("update");
+        clock::time_point substeps_start = clock::now();
+        if (adaptive())
+            choose_sub_steps();
+        const int substeps = get_sub_steps();
+        float substep_dt = step_dt / substeps;
+        last_timings = {};
+        if (adaptive())
+            last_timings.integration_ms = lap_ms(substeps_start, "substeps");
+
+        if (reorder_interval > 0 && frame_count % reorder_interval == 0)
+        {
+            clock::time_point reorder_start = clock::now();
+            reorder_entities();
+            last_timings.reorder_ms = lap_ms(reorder_start, "reorder");
+        }
+        frame_count++;
+
+        if (grid_dirty)
+            update_grid();
+        if (colliders.m_dirty)
+            build_colliders();
+        if (has_long_range())
+        {
+            clock::time_point long_range_start = clock::now();
+            compute_long_range();
+            last_timings.long_range_ms = lap_ms(long_range_start, "long_range");
+        }
+
+        // particles barely move between frames, so one balance per frame is
+        // enough
+        clock::time_point balance_start = clock::now();
+        balance_collision_slices();
+        last_timings.collisions_ms += lap_ms(balance_start, "collisions");
+
+        for (int i = 0; i < substeps; i++)
         {
-            for (auto &ent : entities)
+            clock::time_point phase_start = clock::now();
+
+            if (fused_substeps)
             {
-                ent.apply_force(gravity);
+                resolve_particle_collisions();
+                last_timings.collisions_ms += lap_ms(phase_start, "collisions");
+                solve_constraints();
+                last_timings.constraints_ms += lap_ms(phase_start, "constraints");
+                fused_substep(substep_dt, phase_start);
+                continue;
             }
 
+            const sf::Vector2f gravity_acc = current_gravity();
+            thread_pool.parallel(entities.size(), [&](int start, int end)
+                                 {
+            for (int p = start; p < end; p++)
+            {
+                if (is_asleep(p))
+                    continue;
+                entities.apply_force(p, gravity_acc);
+                if (has_long_range())
+                    entities.apply_force(p, {long_range_x[p], long_range_y[p]});
+            } });
+            last_timings.gravity_ms += lap_ms(phase_start, "gravity");
+
             resolve_particle_collisions();
+            last_timings.collisions_ms += lap_ms(phase_start, "collisions");
+
+            solve_constraints();
+            last_timings.constraints_ms += lap_ms(phase_start, "constraints");
 
             // enforce window boundaries
             thread_pool.parallel(entities.size(), [&](int start, int end)
                                  {
-            for (int i = start; i < end; i++) resolve_boundary_collision(i); });
+            for (int i = start; i < end; i++)
+                if (!is_asleep(i))
+                    resolve_boundary_collision(i); });
+            last_timings.boundary_ms += lap_ms(phase_start, "boundary");
 
             // update entity positions with verlet integration
             thread_pool.parallel(entities.size(), [&](int start, int end)
                                  { update_entities_thread(start, end, substep_dt); });
+            last_timings.integration_ms += lap_ms(phase_start, "integration");
 
             update_grid();
+            last_timings.grid_ms += lap_ms(phase_start, "grid");
+        }
+
+        if (sleeping)
+        {
+            clock::time_point sleep_start = clock::now();
+            update_sleep();
+            last_timings.sleep_ms = lap_ms(sleep_start, "sleep");
+        }
+
+        if (recorder)
+        {
+            clock::time_point record_start = clock::now();
+            recorder->capture(entities);
+            last_timings.record_ms = lap_ms(record_start, "record");
         }
     }
 
+    // only particles within `radius` feel the pull, so only their cells are
+    // visited
     void mouse_pull(sf::Vector2f mouse_pos, float radius)
     {
-        for (Particle &ent : entities)
-        {
-            sf::Vector2f dir = mouse_pos - ent.position;
+        wake_near(mouse_pos, radius);
+        for_each_in_radius(mouse_pos, radius, [&](int i)
+                           {
+            sf::Vector2f dir = mouse_pos - entities.get_position(i);
             float dist = sqrt(dir.x * dir.x + dir.y * dir.y);
-            ent.apply_force(dir * std::max(0.0f, 5 * (radius - dist)));
-        }
+            entities.apply_force(i, dir * std::max(0.0f, 5 * (radius - dist))); });
     }
 
     void mouse_push(sf::Vector2f mouse_pos, float radius)
     {
-        for (Particle &ent : entities)
-        {
-            sf::Vector2f dir = mouse_pos - ent.position;
+        wake_near(mouse_pos, radius);
+        for_each_in_radius(mouse_pos, radius, [&](int i)
+                           {
+            sf::Vector2f dir = mouse_pos - entities.get_position(i);
             float dist = sqrt(dir.x * dir.x + dir.y * dir.y);
-            ent.apply_force(dir * std::min(0.0f, -5 * (radius - dist)));
+            entities.apply_force(i, dir * std::min(0.0f, -5 * (radius - dist))); });
+    }
+
+    // spatial queries on the broadphase grid, they visit only the cells that
+    // can hold a match
+    // a particle matches by its center, particles outside the window are not
+    // found
+    // results are indices into `entities`, valid until the next `update()`,
+    // `entities.id[i]` gives a handle that lasts
+    // the buffer variants clear `out` and reuse its capacity, so they stop
+    // allocating once it has grown
+
+    // calls `fn(i)` for every particle closer than `radius` to `center`
+    template <typename Fn>
+    void for_each_in_radius(sf::Vector2f center, float radius, Fn &&fn)
+    {
+        const float radius_sq = radius * radius;
+        for_each_in_box({center.x - radius, center.y - radius}, {center.x + radius, center.y + radius}, [&](int i)
+                        {
+            float d_x = entities.x[i] - center.x;
+            float d_y = entities.y[i] - center.y;
+            if (d_x * d_x + d_y * d_y < radius_sq)
+                fn(i); });
+    }
+
+    // calls `fn(i)` for every particle in [min.x, max.x] x [min.y, max.y]
+    template <typename Fn>
+    void for_each_in_box(sf::Vector2f min, sf::Vector2f max, Fn &&fn)
+    {
+        refresh_grid();
+        auto visit = [&](int i)
+        {
+            if (entities.x[i] >= min.x && entities.x[i] <= max.x && entities.y[i] >= min.y && entities.y[i] <= max.y)
+                fn(i);
+        };
+        if (sparse_broadphase)
+            sparse_grid.for_each_in_box(min.x, min.y, max.x, max.y, grid_cell_size, visit);
+        else
+            grid.for_each_in_box(min.x, min.y, max.x, max.y, grid_cell_size, visit);
+        for (const GridLevel &level : levels)
+            level.for_each_in_box(min.x, min.y, max.x, max.y, [&](int a)
+                                  { visit(level.members[a]); });
+    }
+
+    size_t query_radius(sf::Vector2f center, float radius, std::vector<int> &out)
+    {
+        out.clear();
+        for_each_in_radius(center, radius, [&](int i)
+                           { out.push_back(i); });
+        return out.size();
+    }
+
+    size_t query_box(sf::Vector2f min, sf::Vector2f max, std::vector<int> &out)
+    {
+        out.clear();
+        for_each_in_box(min, max, [&](int i)
+                        { out.push_back(i); });
+        return out.size();
+    }
+
+    // the `k` particles nearest to `point`, nearest first, fewer if there
+    // are not as many within `max_distance`
+    // searches rings of cells outwards from the point's cell, and stops once
+    // the ring is farther than the k-th best match
+    size_t query_nearest(sf::Vector2f point, int k, std::vector<int> &out, float max_distance = INFINITY)
+    {
+        refresh_grid();
+        out.clear();
+        if (k <= 0)
+            return 0;
+
+        // max-heap of (squared distance, index), the worst match on top
+        nearest_heap.clear();
+        const float max_distance_sq = max_distance * max_distance;
+        auto consider = [&](int i)
+        {
+            float d_x = entities.x[i] - point.x;
+            float d_y = entities.y[i] - point.y;
+            float dist_sq = d_x * d_x + d_y * d_y;
+            if (dist_sq > max_distance_sq)
+                return;
+            if (int(nearest_heap.size()) == k)
+            {
+                if (dist_sq >= nearest_heap.front().first)
+                    return;
+                std::pop_heap(nearest_heap.begin(), nearest_heap.end());
+                nearest_heap.pop_back();
+            }
+            nearest_heap.push_back({dist_sq, i});
+            std::push_heap(nearest_heap.begin(), nearest_heap.end());
+        };
+
+        // large particles are few, all of them are checked
+        for (const GridLevel &level : levels)
+            for (size_t a = 0; a < level.members.size(); a++)
+                if (level.cells[a] >= 0)
+                    consider(level.members[a]);
+
+        const int col = std::clamp(static_cast<int>(point.x / grid_cell_size), 0, grid_cell_count - 1);
+        const int row = std::clamp(static_cast<int>(point.y / grid_cell_size), 0, grid_cell_count - 1);
+        // distance from the point to the nearest edge of its cell, every
+        // particle within `edge + ring * grid_cell_size` lies on rings 0 to
+        // `ring`, as long as the point is inside the grid
+        const float edge = std::max(0.0f, std::min({point.x - col * grid_cell_size, (col + 1) * grid_cell_size - point.x,
+                                                    point.y - row * grid_cell_size, (row + 1) * grid_cell_size - point.y}));
+        // a wide sparse world has far more rings than particles, the search
+        // also stops once every binned particle was seen
+        const size_t binned = sparse_broadphase ? sparse_grid.indices.size() : grid.indices.size();
+        size_t seen = 0;
+        auto count_and_consider = [&](int i)
+        {
+            seen++;
+            consider(i);
+        };
+        auto on_ring = [&](int ring)
+        {
+            if (sparse_broadphase)
+                return sparse_grid.for_each_on_ring(col, row, ring, count_and_consider);
+            return grid.for_each_on_ring(col, row, ring, count_and_consider);
+        };
+        for (int ring = 0; on_ring(ring); ring++)
+        {
+            const float covered = edge + ring * grid_cell_size;
+            if (seen == binned || covered * covered >= max_distance_sq ||
+                (int(nearest_heap.size()) == k && covered * covered >= nearest_heap.front().first))
+                break;
         }
+
+        std::sort_heap(nearest_heap.begin(), nearest_heap.end());
+        for (const auto &[dist_sq, i] : nearest_heap)
+            out.push_back(i);
+        return out.size();
+    }
+
+    int get_sub_steps() const
+    {
+        if constexpr (Config::sub_steps > 0)
+            return Config::sub_steps;
+        else
+            return sub_steps;
+    }
+
+    // each `update()` advances `step_dt_` seconds
+    void set_step_dt(float step_dt_)
+    {
+        step_dt = step_dt_;
+    }
+
+    // ... in `sub_steps_` substeps
+    void set_time_step(float step_dt_, int sub_steps_)
+        requires(Config::sub_steps == 0)
+    {
+        step_dt = step_dt_;
+        sub_steps = std::max(1, sub_steps_);
     }
 
-    void set_entity_velocity(Particle &entity, sf::Vector2f vel)
+    // instead of a fixed count and the velocity clamp, picks every frame's
+    // substep count between `min_sub_steps_` and `max_sub_steps_` from the
+    // fastest particle, see `choose_sub_steps()`, violent scenes run more
+    // substeps, calm ones go back down to `min_sub_steps_`
+    // a lower minimum saves time in shallow or sparse scenes, piles more than
+    // a few dozen particles deep need about 8 substeps to stay stiff
+    // only particles faster than `max_sub_steps_` allow are slowed down, to
+    // the limit rather than to a stop
+    void set_adaptive_substeps(bool enabled, int min_sub_steps_ = 8, int max_sub_steps_ = 32)
+        requires(Config::sub_steps == 0)
     {
-        entity.set_velocity(vel, step_dt / sub_steps);
+        adaptive_sub_steps = enabled;
+        min_sub_steps = std::max(1, min_sub_steps_);
+        max_sub_steps = std::max(min_sub_steps, max_sub_steps_);
+    }
+
+    bool is_adaptive_substeps() const
+    {
+        return adaptive();
+    }
+
+    // both builds produce the same grid, the serial one is kept for comparison
+    void set_parallel_grid_build(bool enabled)
+    {
+        parallel_grid_build = enabled;
+    }
+
+    // `SliceAxis::Auto` picks the axis every frame
+    void set_slice_axis(SliceAxis axis)
+    {
+        slice_axis = axis;
+    }
+
+    // the phased substep runs each phase as its own pass over all particles,
+    // kept for comparison, both give the same positions
+    void set_fused_substeps(bool enabled)
+    {
+        fused_substeps = enabled;
+    }
+
+    // unsupported kernels fall back to the scalar one, see `collision_kernels`
+    // for how far the SIMD kernels may deviate from it
+    void set_collision_kernel(collision_kernels::Kind kind)
+    {
+        collision_kernel_kind = collision_kernels::resolve(kind);
+        collision_kernel = collision_kernels::get(collision_kernel_kind);
+        gather_kernel = collision_kernels::get_gather(collision_kernel_kind);
+    }
+
+    collision_kernels::Kind get_collision_kernel() const
+    {
+        return collision_kernel_kind;
+    }
+
+    // reorders `entities` every `frames` frames, 0 disables it
+    // `Particle` handles and ids stay valid, indices do not
+    void set_reorder_interval(int frames)
+    {
+        reorder_interval = frames;
+    }
+
+    // writes the particles, gravity, timestep and grid parameters to `path`,
+    // see `snapshot.hpp` for the format
+    // false with a message in `error` if the file cannot be written
+    bool save_snapshot(const std::string &path, std::string &error) const
+    {
+        snapshot::Header header;
+        header.frame_count = frame_count;
+        header.window_size = window_size;
+        header.cell_size = grid_cell_size;
+        const sf::Vector2f gravity_acc = current_gravity();
+        header.gravity_x = gravity_acc.x;
+        header.gravity_y = gravity_acc.y;
+        header.step_dt = step_dt;
+        header.sub_steps = get_sub_steps();
+        return snapshot::save(path, header, entities, error);
+    }
+
+    // replaces every particle with the ones saved in `path`, a loaded run
+    // continues exactly like the saved one would have (sleep state aside,
+    // regions start awake), constraints are dropped
+    // the snapshot must come from a simulator of the same window and cell
+    // size, false with a message in `error` otherwise, the state is then
+    // unchanged
+    bool load_snapshot(const std::string &path, std::string &error)
+    {
+        snapshot::MappedSnapshot file;
+        if (!file.open(path, error))
+            return false;
+        const snapshot::Header &header = *file.header;
+        if (header.window_size != window_size || header.cell_size != grid_cell_size)
+        {
+            error = path + " has a " + std::to_string(header.window_size) + " px world of " + std::to_string(header.cell_size) + " px cells, expected " + std::to_string(window_size) + " px of " + std::to_string(grid_cell_size) + " px";
+            return false;
+        }
+        if ((Config::sub_steps > 0 && header.sub_steps != Config::sub_steps) ||
+            (Config::fixed_gravity && sf::Vector2f{header.gravity_x, header.gravity_y} != current_gravity()))
+        {
+            error = path + " was saved with another substep count or gravity than this build fixes";
+            return false;
+        }
+        // `update()` divides the step by the substeps, `!(x > 0)` also rejects NaN
+        if (header.sub_steps < 1 || !(header.step_dt > 0.0f) || !std::isfinite(header.step_dt))
+        {
+            error = "corrupt time step in " + path + ": " + std::to_string(header.step_dt) + " s in " + std::to_string(header.sub_steps) + " substeps";
+            return false;
+        }
+
+        ParticleStore loaded;
+        if (!file.read(loaded))
+        {
+            error = "corrupt particle ids in " + path;
+            return false;
+        }
+        set_particles(std::move(loaded));
+        frame_count = header.frame_count;
+        gravity = {header.gravity_x, header.gravity_y};
+        step_dt = header.step_dt;
+        sub_steps = header.sub_steps;
+        return true;
+    }
+
+    // replaces every particle with the ones of `store`, whose ids must be a
+    // permutation of [0, size), constraints are dropped
+    void set_particles(ParticleStore &&store)
+    {
+        entities = std::move(store);
+
+        // derived state, rebuilt as `add_entity()` would have
+        uniform_radius = true;
+        levels.clear();
+        for (size_t i = 0; i < entities.size(); i++)
+        {
+            const float radius = entities.radius[i];
+            if (radius != 0.5f * grid_cell_size)
+                uniform_radius = false;
+            colliders.reserve_margin(radius);
+            int level = level_of(radius);
+            if (level > 0)
+                add_to_level(level, entities.id[i]);
+        }
+        // level members in id order, as `add_entity()` appends them
+        for (GridLevel &level : levels)
+            std::sort(level.ids.begin(), level.ids.end());
+        for (size_t i = 0; i < entities.size(); i++)
+            entities.cell[i] = level_0_cell(i);
+        set_sleeping(sleeping);
+        // they refer to the old ids
+        constraints.clear();
+        grid_dirty = true;
+    }
+
+    // keeps `a` and `b` at their current distance, `stiffness` is the
+    // fraction of the error corrected per pass, 1 for a rigid link, less for
+    // springy cloth and soft bodies
+    void add_link(Particle a, Particle b, float stiffness = 1.0f)
+    {
+        sf::Vector2f delta = a.get_position() - b.get_position();
+        add_link(a, b, std::sqrt(delta.x * delta.x + delta.y * delta.y), stiffness);
+    }
+
+    void add_link(Particle a, Particle b, float rest_length, float stiffness)
+    {
+        wake_near(a.get_position(), rest_length);
+        constraints.add(entities, a.id, b.id, rest_length, stiffness);
+    }
+
+    // holds `entity` within `rest_length` of its current position, 0 pins it
+    void add_anchor(Particle entity, float rest_length = 0.0f, float stiffness = 1.0f)
+    {
+        sf::Vector2f position = entity.get_position();
+        wake_near(position, rest_length);
+        constraints.add(entities, entity.id, -1, rest_length, stiffness, position.x, position.y);
+    }
+
+    size_t constraint_count() const
+    {
+        return constraints.size();
+    }
+
+    // static obstacles, see `colliders.hpp`, rasterized at the start of the
+    // next `update()`
+    // snapshots and trajectories do not store them
+    void add_segment(sf::Vector2f a, sf::Vector2f b, float thickness = 0.0f)
+    {
+        colliders.add_segment(a, b, thickness);
+        wake_all();
+    }
+
+    void add_circle_collider(sf::Vector2f center, float radius)
+    {
+        colliders.add_circle(center, radius);
+        wake_all();
+    }
+
+    // false unless `corners` make a convex polygon
+    bool add_polygon(const std::vector<sf::Vector2f> &corners)
+    {
+        if (!colliders.add_polygon(corners))
+            return false;
+        wake_all();
+        return true;
+    }
+
+    void clear_colliders()
+    {
+        colliders.clear();
+        wake_all();
+    }
+
+    // samples the colliders into a distance field every `spacing` px, O(1) per
+    // particle near a shape however complex, 0 goes back to the exact shapes
+    void set_collider_sdf(float spacing)
+    {
+        colliders.set_sdf_spacing(spacing);
+    }
+
+    const ColliderSet &get_colliders() const
+    {
+        return colliders;
+    }
+
+    // long-range forces between all particles, Barnes-Hut approximated, see
+    // `barnes_hut.hpp`: particle `j` accelerates particle `i` by `strength *
+    // radius_j^2 * d / (|d|^2 + softening^2)^1.5`, `d` from `i` to `j`
+    // negative `strength` repels, 0 turns it off
+    void set_long_range_force(float strength, float softening)
+    {
+        long_range_strength = strength;
+        long_range_softening = std::max(softening, 1e-3f);
+        wake_all();
+    }
+
+    // 0 sums every pair exactly, larger is faster and coarser
+    void set_opening_angle(float theta)
+    {
+        opening_angle = std::max(0.0f, theta);
+    }
+
+    // a fixed point accelerating every particle by `strength * d / (|d|^2 +
+    // softening^2)^1.5`, negative repels
+    void add_attractor(sf::Vector2f position, float strength)
+    {
+        attractor_x.push_back(position.x);
+        attractor_y.push_back(position.y);
+        attractor_strength.push_back(strength);
+        attractors_dirty = true;
+        wake_all();
+    }
+
+    void clear_attractors()
+    {
+        attractor_x.clear();
+        attractor_y.clear();
+        attractor_strength.clear();
+        attractors_dirty = true;
+        wake_all();
+    }
+
+    // more passes stiffen long chains, at a proportional cost
+    void set_constraint_iterations(int iterations)
+    {
+        constraint_iterations = std::max(1, iterations);
+    }
+
+    // captures every frame into `recorder_` from now on, nullptr stops
+    // recording, the recorder must outlive the simulator or be detached
+    void set_recorder(trajectory::Recorder *recorder_)
+    {
+        recorder = recorder_;
+    }
+
+    // Jacobi collision passes, positions after N steps are bit-identical for
+    // any thread count, see `resolve_particle_collisions_jacobi()`
+    // still depends on the collision kernel, the SIMD kernels' reciprocal
+    // square roots differ between CPU vendors, so only `Kind::Scalar` gives
+    // the same positions on any machine
+    void set_deterministic(bool enabled)
+        requires(Config::stencil == Stencil::Dynamic)
+    {
+        deterministic = enabled;
+    }
+
+    // FNV-1a over the bits of every particle's position and previous
+    // position, in id order, so reordering does not change it
+    // equal hashes after the same steps mean bit-identical runs
+    uint64_t state_hash() const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&](float value)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof bits);
+            for (int byte = 0; byte < 4; byte++)
+            {
+                hash ^= (bits >> (8 * byte)) & 0xff;
+                hash *= 1099511628211ull;
+            }
+        };
+        for (int index : entities.index_of)
+        {
+            mix(entities.x[index]);
+            mix(entities.y[index]);
+            mix(entities.last_x[index]);
+            mix(entities.last_y[index]);
+        }
+        return hash;
+    }
+
+    void set_entity_velocity(Particle entity, sf::Vector2f vel)
+    {
+        wake_near(entity.get_position(), 0.0f);
+        entities.set_velocity(entity.index(), vel, step_dt / get_sub_steps());
+    }
+
+    // lets settled regions fall asleep, see `update_sleep()`
+    // asleep particles are frozen, only motion next to them, a gravity change
+    // or the mouse wakes them
+    // not available on the sparse grid, the sleep state is kept per dense
+    // cell, false if `enabled` was refused for that reason
+    bool set_sleeping(bool enabled)
+    {
+        const bool requested = enabled;
+        sleeping = enabled && !sparse_broadphase;
+        enabled = sleeping;
+        region_count = enabled ? (grid_cell_count + region_cells - 1) / region_cells : 0;
+        const int total = region_count * region_count;
+        region_quiet_frames.assign(total, 0);
+        region_motion.assign(total, 0);
+        region_asleep.assign(total, 0);
+        region_frozen.assign(total, 0);
+        cell_sleep.assign(enabled ? grid.cell_count() : 0, CELL_AWAKE);
+        return sleeping == requested;
+    }
+
+    // bins level 0, and the levels of larger particles, into a grid of the
+    // occupied cells only, memory and time grow with the particles rather
+    // than with the world's area, for a wide world with clustered particles
+    // chosen by the ctor for worlds wider than `dense_grid_max_width` cells,
+    // a dense world does better on the dense grid, its slices can follow rows
+    // and its reorders the Z-order curve
+    // the same contacts, in the same order, as the dense grid with
+    // `SliceAxis::Columns`
+    // cells keep the dense grid's int keys, so a world may be 46340 cells wide
+    // turns sleeping off, it is kept per dense cell
+    void set_sparse_grid(bool enabled)
+    {
+        sparse_broadphase = enabled;
+        grid.resize(enabled ? 0 : grid_cell_count);
+        sparse_grid.resize(enabled ? grid_cell_count : 0);
+        for (GridLevel &level : levels)
+            level.resize(level.width, enabled);
+        morton_cells.clear();
+        set_sleeping(sleeping);
+        grid_dirty = true;
+        colliders.m_dirty = true;
+    }
+
+    bool is_sparse_grid() const
+    {
+        return sparse_broadphase;
+    }
+
+    // px/s^2, keeps the current direction, or none after `set_zero_gravity()`
+    void set_gravity_strength(float strength)
+        requires(!Config::fixed_gravity)
+    {
+        if (gravity.x != 0.0f || gravity.y != 0.0f)
+            gravity *= strength / gravity.length();
+        gravity_strength = strength;
+        wake_all();
+    }
+
+    // share of the velocity kept by a particle bouncing off a window edge
+    void set_bounce_factor(float factor)
+        requires(!Config::fixed_bounce)
+    {
+        bounce_factor = factor;
     }
 
     void set_up_gravity()
+        requires(!Config::fixed_gravity)
     {
-        gravity = {0.0f, -GRAVITY_STRENGTH};
+        gravity = {0.0f, -gravity_strength};
+        wake_all();
+    }
+
+    // leaves the long-range forces, if any, alone
+    void set_zero_gravity()
+        requires(!Config::fixed_gravity)
+    {
+        gravity = {0.0f, 0.0f};
+        wake_all();
     }
 
     void set_down_gravity()
+        requires(!Config::fixed_gravity)
     {
-        gravity = {0.0f, GRAVITY_STRENGTH};
+        gravity = {0.0f, gravity_strength};
+        wake_all();
     }
 
     void set_left_gravity()
+        requires(!Config::fixed_gravity)
     {
-        gravity = {-GRAVITY_STRENGTH, 0.0f};
+        gravity = {-gravity_strength, 0.0f};
+        wake_all();
     }
 
     void set_right_gravity()
+        requires(!Config::fixed_gravity)
     {
-        gravity = {GRAVITY_STRENGTH, 0.0f};
+        gravity = {gravity_strength, 0.0f};
+        wake_all();
     }
-};
\ No newline at end of file
+};
+
+// the simulator the window and the tools build against, `make
+// FIXED_CONFIG=1` swaps in the constant configuration
+#ifdef VERLET_FIXED_CONFIG
+using Simulator = BasicSimulator<FixedConfig>;
+#else
+using Simulator = BasicSimulator<DynamicConfig>;
+#endif
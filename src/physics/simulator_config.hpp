@@ -0,0 +1,51 @@
+#pragma once
+
+// compile-time configuration of `BasicSimulator`
+// a parameter set to a constant is folded into the hot loops: the substep
+// loop has a fixed trip count, the stencil and boundary branches of the
+// collision and integration passes are resolved at compile time
+// a parameter left dynamic stays a runtime member with its setter, setters of
+// constant parameters do not exist in that configuration
+// derive from `DynamicConfig` and override what is fixed
+
+// cells a collision pass visits around each cell, see
+// `BasicSimulator::process_grid_slice()`
+enum class Stencil {
+  // picked at runtime by `set_deterministic()`
+  Dynamic,
+  // five cells, each pair once, updated in place (Gauss-Seidel)
+  Half,
+  // nine cells, each pair from both sides, Jacobi passes that give the same
+  // positions on any thread count
+  Full
+};
+
+// what the window edges do to a particle that crossed them
+enum class Boundary {
+  // reflected, both velocity components scaled by `bounce_factor`
+  Bounce,
+  // stopped along the edge's normal, the velocity along the edge is kept
+  Slide
+};
+
+struct DynamicConfig {
+  // substeps per `update()`, 0 for the runtime `set_time_step()`
+  static constexpr int sub_steps = 0;
+  static constexpr Stencil stencil = Stencil::Dynamic;
+  static constexpr Boundary boundary = Boundary::Bounce;
+  static constexpr float bounce_factor = 0.66f;
+  // `bounce_factor` stays, `set_bounce_factor()` does not exist
+  static constexpr bool fixed_bounce = false;
+  // px/s^2, points down initially, `set_*_gravity()` turn it
+  // if too strong, particles will skip cells
+  static constexpr float gravity_strength = 200.0f;
+  // gravity stays down, `set_*_gravity()` do not exist
+  static constexpr bool fixed_gravity = false;
+};
+
+// the window's settings as constants, gravity still follows the arrow keys
+struct FixedConfig : DynamicConfig {
+  static constexpr int sub_steps = 8;
+  static constexpr Stencil stencil = Stencil::Half;
+  static constexpr bool fixed_bounce = true;
+};
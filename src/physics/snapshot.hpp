@@ -0,0 +1,265 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "./particle.hpp"
+
+// versioned binary snapshot of a simulator's state
+// layout, native byte order (every supported target is little-endian):
+// - `Header`, padded to `ALIGNMENT`
+// - one array per `Array`, `particle_count` 4-byte entries each, every array
+//   starting on an `ALIGNMENT` boundary at `offsets[array]`
+// arrays are written straight from the store's vectors and read straight
+// from a read-only mapping of the file, nothing is staged in between
+namespace snapshot {
+
+constexpr char MAGIC[8] = {'V', 'E', 'R', 'L', 'S', 'N', 'A', 'P'};
+constexpr uint32_t VERSION = 1;
+constexpr uint64_t ALIGNMENT = 64;
+
+// index-ordered arrays of `ParticleStore`, `cell` and `index_of` are derived
+// on load
+enum Array {
+  X,
+  Y,
+  LAST_X,
+  LAST_Y,
+  ACC_X,
+  ACC_Y,
+  RADIUS,
+  COLOR,
+  ID,
+  ARRAY_COUNT
+};
+
+static_assert(sizeof(sf::Color) == 4, "colors are stored as 4 bytes");
+
+struct Header {
+  char magic[8];
+  uint32_t version = VERSION;
+  uint32_t header_size = sizeof(Header);
+  uint64_t particle_count = 0;
+  // `Simulator::update()` calls so far, keeps the reorder schedule
+  uint64_t frame_count = 0;
+  // grid parameters, a snapshot only loads into a simulator of the same grid
+  float window_size = 0.0f;
+  float cell_size = 0.0f;
+  float gravity_x = 0.0f;
+  float gravity_y = 0.0f;
+  float step_dt = 0.0f;
+  int32_t sub_steps = 0;
+  uint64_t offsets[ARRAY_COUNT] = {};
+};
+
+inline uint64_t align_up(uint64_t offset) {
+  return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+inline const void *array_data(const ParticleStore &store, int array) {
+  switch (array) {
+  case X:
+    return store.x.data();
+  case Y:
+    return store.y.data();
+  case LAST_X:
+    return store.last_x.data();
+  case LAST_Y:
+    return store.last_y.data();
+  case ACC_X:
+    return store.acc_x.data();
+  case ACC_Y:
+    return store.acc_y.data();
+  case RADIUS:
+    return store.radius.data();
+  case COLOR:
+    return store.color.data();
+  default:
+    return store.id.data();
+  }
+}
+
+inline bool fail(std::string &error, const std::string &what,
+                 const std::string &path) {
+  error = what + " " + path;
+  if (errno != 0)
+    error += ": " + std::string(std::strerror(errno));
+  return false;
+}
+
+// writes `header` and `store` to `path`, fills in the header's magic, count
+// and offsets
+// one `writev()` per batch of arrays, the vectors are the write buffers
+inline bool save(const std::string &path, Header header,
+                 const ParticleStore &store, std::string &error) {
+  std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+  header.particle_count = store.size();
+  const uint64_t array_size = store.size() * 4;
+  uint64_t offset = align_up(sizeof(Header));
+  for (int array = 0; array < ARRAY_COUNT; array++) {
+    header.offsets[array] = offset;
+    offset = align_up(offset + array_size);
+  }
+
+  // header, then each array followed by its padding
+  static const char padding[ALIGNMENT] = {};
+  std::vector<iovec> parts;
+  parts.push_back({&header, sizeof(Header)});
+  uint64_t written = sizeof(Header);
+  for (int array = 0; array < ARRAY_COUNT; array++) {
+    parts.push_back({const_cast<char *>(padding), header.offsets[array] - written});
+    parts.push_back({const_cast<void *>(array_data(store, array)), array_size});
+    written = header.offsets[array] + array_size;
+  }
+
+  errno = 0;
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return fail(error, "could not create", path);
+
+  // `writev()` may stop early, resume from the first unfinished part
+  size_t part = 0;
+  while (part < parts.size()) {
+    ssize_t count = ::writev(fd, parts.data() + part,
+                             std::min<size_t>(parts.size() - part, IOV_MAX));
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      ::close(fd);
+      return fail(error, "could not write", path);
+    }
+    for (; part < parts.size() && size_t(count) >= parts[part].iov_len; part++)
+      count -= parts[part].iov_len;
+    if (part < parts.size()) {
+      parts[part].iov_base = static_cast<char *>(parts[part].iov_base) + count;
+      parts[part].iov_len -= count;
+    }
+  }
+
+  if (::close(fd) != 0)
+    return fail(error, "could not write", path);
+  return true;
+}
+
+// read-only mapping of a snapshot file, checked on `open()`
+// the arrays point into the mapping and stay valid as long as it does
+struct MappedSnapshot {
+  const Header *header = nullptr;
+  void *m_data = MAP_FAILED;
+  size_t m_size = 0;
+
+  MappedSnapshot() = default;
+  MappedSnapshot(const MappedSnapshot &) = delete;
+  MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+
+  ~MappedSnapshot() { close(); }
+
+  void close() {
+    if (m_data != MAP_FAILED)
+      ::munmap(m_data, m_size);
+    m_data = MAP_FAILED;
+    header = nullptr;
+  }
+
+  template <typename T> const T *array(int index) const {
+    return reinterpret_cast<const T *>(static_cast<const char *>(m_data) +
+                                       header->offsets[index]);
+  }
+
+  bool open(const std::string &path, std::string &error) {
+    close();
+    errno = 0;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return fail(error, "could not open", path);
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      return fail(error, "could not stat", path);
+    }
+    m_size = info.st_size;
+    if (m_size < sizeof(Header)) {
+      ::close(fd);
+      errno = 0;
+      return fail(error, "truncated snapshot", path);
+    }
+
+    m_data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m_data == MAP_FAILED)
+      return fail(error, "could not map", path);
+    // every page is read once, front to back
+    ::madvise(m_data, m_size, MADV_SEQUENTIAL);
+    ::madvise(m_data, m_size, MADV_WILLNEED);
+
+    header = static_cast<const Header *>(m_data);
+    errno = 0;
+    if (std::memcmp(header->magic, MAGIC, sizeof MAGIC) != 0) {
+      close();
+      return fail(error, "not a snapshot:", path);
+    }
+    if (header->version != VERSION || header->header_size != sizeof(Header)) {
+      close();
+      return fail(error, "unsupported snapshot version in", path);
+    }
+    if (header->particle_count > m_size) {
+      close();
+      return fail(error, "truncated snapshot", path);
+    }
+    const uint64_t array_size = header->particle_count * 4;
+    for (int array = 0; array < ARRAY_COUNT; array++) {
+      uint64_t offset = header->offsets[array];
+      if (offset % ALIGNMENT != 0 || offset < sizeof(Header) ||
+          offset > m_size || array_size > m_size - offset) {
+        close();
+        return fail(error, "truncated snapshot", path);
+      }
+    }
+    return true;
+  }
+
+  // copies the particles into `store`, false if the ids are not a
+  // permutation of [0, particle_count)
+  bool read(ParticleStore &store) const {
+    const size_t count = header->particle_count;
+    const int32_t *ids = array<int32_t>(ID);
+    std::vector<int> index_of(count, -1);
+    for (size_t i = 0; i < count; i++) {
+      if (ids[i] < 0 || size_t(ids[i]) >= count || index_of[ids[i]] >= 0)
+        return false;
+      index_of[ids[i]] = i;
+    }
+
+    auto copy = [&](auto &vector, int index) {
+      using T = typename std::remove_reference_t<decltype(vector)>::value_type;
+      const T *data = array<T>(index);
+      vector.assign(data, data + count);
+    };
+    copy(store.x, X);
+    copy(store.y, Y);
+    copy(store.last_x, LAST_X);
+    copy(store.last_y, LAST_Y);
+    copy(store.acc_x, ACC_X);
+    copy(store.acc_y, ACC_Y);
+    copy(store.radius, RADIUS);
+    copy(store.color, COLOR);
+    copy(store.id, ID);
+    store.cell.assign(count, -1);
+    store.index_of = std::move(index_of);
+    return true;
+  }
+};
+
+} // namespace snapshot
@@ -0,0 +1,337 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "../thread_pool.hpp"
+#include "./cell_grid.hpp"
+
+// the occupied cells of a `width` x `width` grid only, for worlds where a
+// dense `CellGrid` would be mostly empty cells
+// cells keep the dense grid's keys, `col * width + row`, and its column-major
+// order: occupied cell `s` has key `keys[s]` and the particle indices
+// `indices[cell_start[s]] .. indices[cell_start[s + 1]]`, the occupied cells
+// of column `col` are `column_start[col] .. column_start[col + 1]`
+// so the particles of a run of rows, or of a range of columns, are still one
+// contiguous range of `indices`
+// memory grows with the particles and the occupied cells, plus a few ints
+// per column
+// keys are ints, `width` must stay below 46341
+struct SparseCellGrid {
+  // cells per side
+  int width = 0;
+  std::vector<int> keys;
+  // one extra entry for the end
+  std::vector<int> cell_start;
+  std::vector<int> column_start;
+  std::vector<int> indices;
+
+  double m_inverse_width = 0.0;
+  // per-chunk column histograms of the build, `chunk * width + col`, then
+  // the chunks' write cursors
+  std::vector<int> m_histograms;
+  // particles per column range of the build's prefix sum
+  std::vector<int> m_range_totals;
+  // columns [m_task_bounds[t], m_task_bounds[t + 1]) of the build's sorting
+  // task `t`
+  std::vector<int> m_task_bounds;
+  // particle indices by column, in index order within a column, and their
+  // cells, so the sorts read keys without gathering from `cells`
+  std::vector<int> m_by_column;
+  std::vector<int> m_column_keys;
+  // the cells of `indices`
+  std::vector<int> m_sorted_keys;
+  // first entry of each column in `m_by_column` and `indices`, one extra
+  // entry for the end
+  std::vector<int> m_column_offset;
+  // per column task, the row histogram of its counting sort
+  std::vector<std::vector<int>> m_row_counts;
+
+  void resize(int width_) {
+    width = width_;
+    m_inverse_width = width > 0 ? (1.0 + 0x1p-40) / width : 0.0;
+    keys.clear();
+    cell_start.assign(1, 0);
+    column_start.assign(width + 1, 0);
+    indices.clear();
+  }
+
+  // `key / width`, by a multiplication, a division would cost more than
+  // the rest of the build's work on a particle
+  // exact, the rounding error of the product stays far below 1 / width
+  int column_of(int key) const { return key * m_inverse_width; }
+
+  // -1 if outside the grid
+  int cell_index(int col, int row) const {
+    if (col < 0 || row < 0 || col >= width || row >= width)
+      return -1;
+    return col * width + row;
+  }
+
+  int cell_count() const { return keys.size(); }
+
+  const int *column_begin(int col) const {
+    return indices.data() + cell_start[column_start[col]];
+  }
+
+  const int *column_end(int col) const {
+    return indices.data() + cell_start[column_start[col + 1]];
+  }
+
+  // first occupied cell of column `col` at `row` or below it
+  int find(int col, int row) const {
+    const int *first = keys.data() + column_start[col];
+    const int *last = keys.data() + column_start[col + 1];
+    return std::lower_bound(first, last, col * width + row) - keys.data();
+  }
+
+  // calls `fn(entry)` for every entry of rows [first_row, last_row] of
+  // column `col`, all inside the grid
+  template <typename Fn>
+  void for_each_in_column(int col, int first_row, int last_row, Fn &&fn) const {
+    const int *it = indices.data() + cell_start[find(col, first_row)];
+    const int *stop = indices.data() + cell_start[find(col, last_row + 1)];
+    for (; it != stop; it++)
+      fn(*it);
+  }
+
+  // the same queries as `CellGrid`'s, over the occupied cells
+
+  template <typename Fn>
+  void for_each_in_box(float min_x, float min_y, float max_x, float max_y,
+                       float cell_size, Fn &&fn) const {
+    const float limit = width * cell_size;
+    if (!(max_x >= 0.0f && max_y >= 0.0f && min_x < limit && min_y < limit))
+      return;
+    const int first_col = std::max(0.0f, min_x) / cell_size;
+    const int last_col =
+        std::min(width - 1, static_cast<int>(std::min(max_x, limit) / cell_size));
+    const int first_row = std::max(0.0f, min_y) / cell_size;
+    const int last_row =
+        std::min(width - 1, static_cast<int>(std::min(max_y, limit) / cell_size));
+    if (first_row > last_row)
+      return;
+    for (int col = first_col; col <= last_col; col++)
+      if (column_start[col] != column_start[col + 1])
+        for_each_in_column(col, first_row, last_row, fn);
+  }
+
+  template <typename Fn>
+  void for_each_near(float x, float y, float reach, float cell_size,
+                     Fn &&fn) const {
+    for_each_in_box(x - reach, y - reach, x + reach, y + reach, cell_size, fn);
+  }
+
+  template <typename Fn>
+  bool for_each_on_ring(int col, int row, int ring, Fn &&fn) const {
+    const int first_col = col - ring, last_col = col + ring;
+    const int first_row = row - ring, last_row = row + ring;
+    if (first_col < 0 && first_row < 0 && last_col >= width &&
+        last_row >= width)
+      return false;
+
+    auto visit_run = [&](int c, int r_first, int r_last) {
+      if (c < 0 || c >= width)
+        return;
+      r_first = std::max(0, r_first);
+      r_last = std::min(width - 1, r_last);
+      if (r_first <= r_last)
+        for_each_in_column(c, r_first, r_last, fn);
+    };
+    if (ring == 0) {
+      visit_run(col, row, row);
+      return true;
+    }
+    visit_run(first_col, first_row, last_row);
+    visit_run(last_col, first_row, last_row);
+    for (int c = first_col + 1; c < last_col; c++) {
+      visit_run(c, first_row, first_row);
+      visit_run(c, last_row, last_row);
+    }
+    return true;
+  }
+
+  // serial, see below
+  void build(const std::vector<int> &cells) {
+    ThreadPool serial;
+    build(cells, serial);
+  }
+
+  // `cells[i]` is the cell of particle `i`, -1 drops it from the grid
+  // particles keep their relative order within a cell, as in `CellGrid`
+  // 1. a counting sort by column, as `CellGrid::build()` sorts by cell, so
+  //    its histograms are per column rather than per cell
+  // 2. each column sorted by row, counting over the column's span of rows,
+  //    or a comparison sort when a few particles span many rows
+  // 3. the occupied cells numbered in column order
+  void build(const std::vector<int> &cells, ThreadPool &thread_pool) {
+    const int chunk_count = thread_pool.m_thread_count;
+    const int entity_count = cells.size();
+    m_histograms.resize(static_cast<size_t>(chunk_count) * width);
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int chunk = start; chunk < end; chunk++) {
+        int *histogram = m_histograms.data() + static_cast<size_t>(chunk) * width;
+        std::fill(histogram, histogram + width, 0);
+        int first, last;
+        CellGrid::chunk_range(chunk, chunk_count, entity_count, first, last);
+        for (int i = first; i < last; i++)
+          if (cells[i] >= 0)
+            histogram[column_of(cells[i])]++;
+      }
+    });
+
+    // column offsets and per-chunk cursors, over ranges of columns plus a
+    // short serial scan of the range totals
+    const int range_size = (width + chunk_count - 1) / chunk_count;
+    m_column_offset.resize(width + 1);
+    m_range_totals.resize(chunk_count);
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int range = start; range < end; range++) {
+        const int first = std::min(width, range * range_size);
+        const int last = std::min(width, first + range_size);
+        int total = 0;
+        for (int col = first; col < last; col++)
+          for (int chunk = 0; chunk < chunk_count; chunk++)
+            total += m_histograms[static_cast<size_t>(chunk) * width + col];
+        m_range_totals[range] = total;
+      }
+    });
+    int running = 0;
+    for (int range = 0; range < chunk_count; range++) {
+      const int total = m_range_totals[range];
+      m_range_totals[range] = running;
+      running += total;
+    }
+    m_column_offset[width] = running;
+    m_by_column.resize(running);
+    m_column_keys.resize(running);
+    m_sorted_keys.resize(running);
+    indices.resize(running);
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int range = start; range < end; range++) {
+        const int first = std::min(width, range * range_size);
+        const int last = std::min(width, first + range_size);
+        int offset = m_range_totals[range];
+        for (int col = first; col < last; col++) {
+          m_column_offset[col] = offset;
+          for (int chunk = 0; chunk < chunk_count; chunk++) {
+            int &slot = m_histograms[static_cast<size_t>(chunk) * width + col];
+            const int size = slot;
+            slot = offset;
+            offset += size;
+          }
+        }
+      }
+    });
+    thread_pool.parallel(chunk_count, [&](int start, int end) {
+      for (int chunk = start; chunk < end; chunk++) {
+        int *cursor = m_histograms.data() + static_cast<size_t>(chunk) * width;
+        int first, last;
+        CellGrid::chunk_range(chunk, chunk_count, entity_count, first, last);
+        for (int i = first; i < last; i++)
+          if (cells[i] >= 0) {
+            const int slot = cursor[column_of(cells[i])]++;
+            m_by_column[slot] = i;
+            m_column_keys[slot] = cells[i];
+          }
+      }
+    });
+
+    // columns split into tasks of about the same number of particles, each
+    // sorts its columns and counts their occupied cells into `column_start`
+    const int task_count = 4 * chunk_count;
+    m_row_counts.resize(task_count);
+    m_task_bounds.resize(task_count + 1);
+    for (int task = 0; task < task_count; task++)
+      m_task_bounds[task] =
+          std::lower_bound(m_column_offset.begin(), m_column_offset.end() - 1,
+                           static_cast<int64_t>(running) * task / task_count) -
+          m_column_offset.begin();
+    m_task_bounds[task_count] = width;
+    thread_pool.parallel(
+        0, task_count,
+        [&](int start, int end) {
+          for (int task = start; task < end; task++)
+            for (int col = m_task_bounds[task]; col < m_task_bounds[task + 1]; col++)
+              column_start[col] = sort_column(col, m_row_counts[task]);
+        },
+        task_count);
+
+    // exclusive scan, one entry per column
+    int occupied = 0;
+    for (int col = 0; col < width; col++) {
+      const int count = column_start[col];
+      column_start[col] = occupied;
+      occupied += count;
+    }
+    column_start[width] = occupied;
+    keys.resize(occupied);
+    cell_start.resize(occupied + 1);
+    cell_start[occupied] = running;
+    thread_pool.parallel(
+        0, task_count,
+        [&](int start, int end) {
+          for (int task = start; task < end; task++)
+            for (int col = m_task_bounds[task]; col < m_task_bounds[task + 1]; col++) {
+              int s = column_start[col];
+              for (int e = m_column_offset[col]; e < m_column_offset[col + 1]; e++) {
+                const int key = m_sorted_keys[e];
+                if (e == m_column_offset[col] || key != keys[s - 1]) {
+                  keys[s] = key;
+                  cell_start[s++] = e;
+                }
+              }
+            }
+        },
+        task_count);
+  }
+
+  // sorts column `col` of `m_by_column` by row into `indices` and
+  // `m_sorted_keys`, stable, and returns how many cells of it are occupied
+  int sort_column(int col, std::vector<int> &row_counts) {
+    const int first = m_column_offset[col], last = m_column_offset[col + 1];
+    if (first == last)
+      return 0;
+    const int *column_keys = m_column_keys.data();
+    int min_key = column_keys[first], max_key = min_key;
+    for (int e = first + 1; e < last; e++) {
+      min_key = std::min(min_key, column_keys[e]);
+      max_key = std::max(max_key, column_keys[e]);
+    }
+    const int span = max_key - min_key + 1;
+    const int count = last - first;
+
+    if (span > 4 * count + 64) {
+      // positions within the column, sorted by key, ties by position
+      int *order = indices.data() + first;
+      for (int e = 0; e < count; e++)
+        order[e] = e;
+      std::stable_sort(order, order + count, [&](int a, int b) {
+        return column_keys[first + a] < column_keys[first + b];
+      });
+      int occupied = 0;
+      for (int e = first; e < last; e++) {
+        const int from = first + indices[e];
+        m_sorted_keys[e] = column_keys[from];
+        indices[e] = m_by_column[from];
+        occupied += e == first || m_sorted_keys[e] != m_sorted_keys[e - 1];
+      }
+      return occupied;
+    }
+
+    row_counts.assign(span + 1, 0);
+    for (int e = first; e < last; e++)
+      row_counts[column_keys[e] - min_key + 1]++;
+    int occupied = 0;
+    for (int r = 1; r <= span; r++) {
+      occupied += row_counts[r] > 0;
+      row_counts[r] += row_counts[r - 1];
+    }
+    for (int e = first; e < last; e++) {
+      const int slot = first + row_counts[column_keys[e] - min_key]++;
+      indices[slot] = m_by_column[e];
+      m_sorted_keys[slot] = column_keys[e];
+    }
+    return occupied;
+  }
+};
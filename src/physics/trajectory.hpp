@@ -0,0 +1,593 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./particle.hpp"
+
+// per-frame particle trajectories, recorded while simulating and streamed
+// back for replay or offline analysis
+//
+// layout, native byte order:
+// - `FileHeader`
+// - blocks of up to `frames_per_block` frames, each a `BlockHeader` and its
+//   payload, the first frame of a block is a keyframe, so any block decodes
+//   on its own
+// - on `close()`, an index of every block and a `Trailer` pointing at it
+//   a file without the trailer (e.g. after a crash) is still readable, the
+//   reader then rebuilds the index by walking the block headers
+//
+// a frame's payload is a stream of LEB128 varints:
+// - the particle count `n` and the first id `m` described in this frame,
+//   then the raw radius and color of ids [m, n), all of them in a keyframe,
+//   as they are in that frame, only new particles otherwise, so a recolored
+//   particle shows its new color from the next keyframe on
+// - positions in id order, quantized to `quantum` px, as deltas against the
+//   previous frame (against 0 in a keyframe), all x then all y, zigzagged
+// - a zero delta is followed by the length of the run of zeros after it, a
+//   settled pile costs a few bytes a frame
+namespace trajectory {
+
+constexpr char FILE_MAGIC[8] = {'V', 'E', 'R', 'L', 'T', 'R', 'A', 'J'};
+constexpr char INDEX_MAGIC[8] = {'V', 'E', 'R', 'L', 'T', 'I', 'D', 'X'};
+constexpr uint32_t BLOCK_MAGIC = 0x4b4c4254; // "TBLK"
+constexpr uint32_t VERSION = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version = VERSION;
+  uint32_t frames_per_block = 0;
+  // px per quantization step
+  float quantum = 0.0f;
+  uint32_t reserved = 0;
+};
+
+struct BlockHeader {
+  uint32_t magic = BLOCK_MAGIC;
+  uint32_t first_frame = 0;
+  uint32_t frame_count = 0;
+  uint32_t payload_size = 0;
+};
+
+struct IndexEntry {
+  uint64_t offset = 0;
+  uint32_t first_frame = 0;
+  uint32_t frame_count = 0;
+};
+
+struct Trailer {
+  uint64_t index_offset = 0;
+  uint32_t block_count = 0;
+  uint32_t frame_count = 0;
+  char magic[8];
+};
+
+inline void put_varint(std::vector<uint8_t> &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(uint8_t(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(uint8_t(value));
+}
+
+// false past `end`
+inline bool get_varint(const uint8_t *&it, const uint8_t *end,
+                       uint64_t &value) {
+  value = 0;
+  for (int shift = 0; it != end && shift < 64; shift += 7) {
+    uint8_t byte = *it++;
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+inline uint64_t zigzag(int64_t value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+template <typename T> void put_raw(std::vector<uint8_t> &out, const T &value) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+inline bool fail(std::string &error, const std::string &what,
+                 const std::string &path) {
+  error = what + " " + path;
+  if (errno != 0)
+    error += ": " + std::string(std::strerror(errno));
+  return false;
+}
+
+// records frames on a background thread
+// `capture()` only copies the store's positions and ids into one of two
+// staging frames and hands it over, quantizing, delta coding and writing
+// happen on the writer thread while the simulation carries on
+// it blocks only if the writer falls a whole frame behind
+struct Recorder {
+  // one captured frame, index-ordered like the store it came from
+  struct Staging {
+    std::vector<float> x, y;
+    std::vector<int> id;
+    // radius and color of ids [first_new_id, size), every id on a keyframe
+    int first_new_id = 0;
+    std::vector<float> new_radius;
+    std::vector<sf::Color> new_color;
+  };
+
+  std::FILE *m_file = nullptr;
+  std::string m_path;
+  FileHeader m_header;
+
+  // the simulation thread fills `m_staging[m_fill]` while the writer may be
+  // busy with the other one
+  Staging m_staging[2];
+  int m_fill = 0;
+  // staging frame waiting for the writer, -1 if none
+  int m_pending = -1;
+  bool m_stopping = false;
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::thread m_writer;
+  // particles described so far, by id
+  int m_known_count = 0;
+  // frames captured so far, the writer starts a block every
+  // `frames_per_block` of them
+  uint32_t m_captured = 0;
+
+  // writer thread state
+  std::vector<int64_t> m_last_x, m_last_y;
+  std::vector<int64_t> m_qx, m_qy;
+  std::vector<float> m_radius;
+  std::vector<sf::Color> m_color;
+  std::vector<uint8_t> m_block;
+  uint32_t m_block_first_frame = 0;
+  uint32_t m_block_frames = 0;
+  uint32_t m_frame_count = 0;
+  uint64_t m_offset = 0;
+  std::vector<IndexEntry> m_index;
+  // set by the writer on an I/O error, reported by `close()`
+  std::string m_error;
+
+  Recorder() = default;
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  ~Recorder() {
+    std::string error;
+    close(error);
+  }
+
+  bool is_open() const { return m_file != nullptr; }
+
+  // 1/64 px steps keep recorded positions within 0.008 px
+  bool open(const std::string &path, std::string &error,
+            float quantum = 1.0f / 64, int frames_per_block = 64) {
+    close(error);
+    errno = 0;
+    m_file = std::fopen(path.c_str(), "wb");
+    if (!m_file)
+      return fail(error, "could not create", path);
+    m_path = path;
+
+    std::memcpy(m_header.magic, FILE_MAGIC, sizeof FILE_MAGIC);
+    m_header.quantum = quantum;
+    m_header.frames_per_block = std::max(1, frames_per_block);
+    if (std::fwrite(&m_header, sizeof m_header, 1, m_file) != 1) {
+      std::fclose(m_file);
+      m_file = nullptr;
+      return fail(error, "could not write", path);
+    }
+    m_offset = sizeof m_header;
+
+    m_fill = 0;
+    m_pending = -1;
+    m_stopping = false;
+    m_known_count = 0;
+    m_captured = 0;
+    m_last_x.clear();
+    m_last_y.clear();
+    m_radius.clear();
+    m_color.clear();
+    m_block.clear();
+    m_block_first_frame = 0;
+    m_block_frames = 0;
+    m_frame_count = 0;
+    m_index.clear();
+    m_error.clear();
+    m_writer = std::thread([this]() { run(); });
+    return true;
+  }
+
+  // called at the end of `Simulator::update()`
+  void capture(const ParticleStore &store) {
+    Staging &staging = m_staging[m_fill];
+    const size_t count = store.size();
+    staging.x.assign(store.x.begin(), store.x.end());
+    staging.y.assign(store.y.begin(), store.y.end());
+    staging.id.assign(store.id.begin(), store.id.end());
+    // particles only ever get appended, new ones have the highest ids
+    // a keyframe describes all of them again, colors and radii may have
+    // changed since
+    const bool keyframe = m_captured++ % m_header.frames_per_block == 0;
+    if (keyframe)
+      m_known_count = 0;
+    staging.first_new_id = m_known_count;
+    staging.new_radius.clear();
+    staging.new_color.clear();
+    for (size_t id = m_known_count; id < count; id++) {
+      staging.new_radius.push_back(store.radius[store.index_of[id]]);
+      staging.new_color.push_back(store.color[store.index_of[id]]);
+    }
+    m_known_count = count;
+
+    {
+      std::unique_lock<std::mutex> lock{m_mutex};
+      // the writer still holds the other staging frame, wait for it
+      m_ready.wait(lock, [&]() { return m_pending < 0; });
+      m_pending = m_fill;
+    }
+    m_ready.notify_all();
+    m_fill ^= 1;
+  }
+
+  // flushes the last block, writes the index and joins the writer
+  // false with a message in `error` if anything failed to write
+  bool close(std::string &error) {
+    if (!m_file)
+      return true;
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      m_stopping = true;
+    }
+    m_ready.notify_all();
+    m_writer.join();
+
+    flush_block();
+    Trailer trailer;
+    trailer.index_offset = m_offset;
+    trailer.block_count = m_index.size();
+    trailer.frame_count = m_frame_count;
+    std::memcpy(trailer.magic, INDEX_MAGIC, sizeof INDEX_MAGIC);
+    write(m_index.data(), m_index.size() * sizeof(IndexEntry));
+    write(&trailer, sizeof trailer);
+
+    errno = 0;
+    if (std::fclose(m_file) != 0 && m_error.empty())
+      fail(m_error, "could not write", m_path);
+    m_file = nullptr;
+    error = m_error;
+    return m_error.empty();
+  }
+
+  void run() {
+    while (true) {
+      int slot;
+      {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_ready.wait(lock, [&]() { return m_pending >= 0 || m_stopping; });
+        if (m_pending < 0)
+          return;
+        slot = m_pending;
+      }
+      encode(m_staging[slot]);
+      {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_pending = -1;
+      }
+      m_ready.notify_all();
+    }
+  }
+
+  void write(const void *data, size_t size) {
+    if (!m_error.empty() || size == 0)
+      return;
+    errno = 0;
+    if (std::fwrite(data, size, 1, m_file) != 1)
+      fail(m_error, "could not write", m_path);
+    m_offset += size;
+  }
+
+  void flush_block() {
+    if (m_block_frames == 0)
+      return;
+    BlockHeader header;
+    header.first_frame = m_block_first_frame;
+    header.frame_count = m_block_frames;
+    header.payload_size = m_block.size();
+    m_index.push_back({m_offset, m_block_first_frame, m_block_frames});
+    write(&header, sizeof header);
+    write(m_block.data(), m_block.size());
+    m_block.clear();
+    m_block_first_frame = m_frame_count;
+    m_block_frames = 0;
+  }
+
+  // zigzagged deltas of `values` against `last`, zero runs collapsed
+  void put_deltas(const std::vector<int64_t> &values,
+                  std::vector<int64_t> &last, size_t count) {
+    for (size_t i = 0; i < count;) {
+      int64_t delta = values[i] - last[i];
+      last[i] = values[i];
+      put_varint(m_block, zigzag(delta));
+      i++;
+      if (delta != 0)
+        continue;
+      size_t run = 0;
+      while (i < count && values[i] == last[i]) {
+        run++;
+        i++;
+      }
+      put_varint(m_block, run);
+    }
+  }
+
+  void encode(const Staging &staging) {
+    const size_t count = staging.x.size();
+    const bool keyframe = m_block_frames == 0;
+
+    // a keyframe's descriptions replace all the earlier ones
+    m_radius.resize(staging.first_new_id);
+    m_color.resize(staging.first_new_id);
+    m_radius.insert(m_radius.end(), staging.new_radius.begin(),
+                    staging.new_radius.end());
+    m_color.insert(m_color.end(), staging.new_color.begin(),
+                   staging.new_color.end());
+    // particles are new to the delta coding at position 0
+    m_last_x.resize(count, 0);
+    m_last_y.resize(count, 0);
+    if (keyframe) {
+      std::fill(m_last_x.begin(), m_last_x.end(), 0);
+      std::fill(m_last_y.begin(), m_last_y.end(), 0);
+    }
+
+    // back to id order, so each particle is compared with itself
+    const float scale = 1.0f / m_header.quantum;
+    m_qx.resize(count);
+    m_qy.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      m_qx[staging.id[i]] = std::lround(staging.x[i] * scale);
+      m_qy[staging.id[i]] = std::lround(staging.y[i] * scale);
+    }
+
+    const size_t first_described = keyframe ? 0 : staging.first_new_id;
+    put_varint(m_block, count);
+    put_varint(m_block, first_described);
+    for (size_t id = first_described; id < count; id++) {
+      put_raw(m_block, m_radius[id]);
+      put_raw(m_block, m_color[id]);
+    }
+    put_deltas(m_qx, m_last_x, count);
+    put_deltas(m_qy, m_last_y, count);
+
+    m_frame_count++;
+    if (++m_block_frames == m_header.frames_per_block)
+      flush_block();
+  }
+};
+
+// streams frames back out of a recording, in order or from any frame
+struct Reader {
+  std::FILE *m_file = nullptr;
+  FileHeader m_header;
+  std::vector<IndexEntry> m_index;
+  uint32_t m_frame_count = 0;
+
+  // payload of the current block and the decoding position in it
+  std::vector<uint8_t> m_block;
+  int m_block_number = -1;
+  const uint8_t *m_cursor = nullptr;
+  // next frame `m_cursor` decodes, -1 before the first `read_frame()`
+  int64_t m_next_frame = -1;
+  std::vector<int64_t> m_qx, m_qy;
+  std::vector<float> m_radius;
+  std::vector<sf::Color> m_color;
+
+  Reader() = default;
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+
+  ~Reader() { close(); }
+
+  void close() {
+    if (m_file)
+      std::fclose(m_file);
+    m_file = nullptr;
+  }
+
+  int frame_count() const { return m_frame_count; }
+
+  bool open(const std::string &path, std::string &error) {
+    close();
+    errno = 0;
+    m_file = std::fopen(path.c_str(), "rb");
+    if (!m_file)
+      return fail(error, "could not open", path);
+
+    if (std::fread(&m_header, sizeof m_header, 1, m_file) != 1 ||
+        std::memcmp(m_header.magic, FILE_MAGIC, sizeof FILE_MAGIC) != 0) {
+      close();
+      errno = 0;
+      return fail(error, "not a trajectory:", path);
+    }
+    if (m_header.version != VERSION || !(m_header.quantum > 0.0f)) {
+      close();
+      errno = 0;
+      return fail(error, "unsupported trajectory version in", path);
+    }
+
+    m_index.clear();
+    m_frame_count = 0;
+    m_block_number = -1;
+    m_next_frame = -1;
+    if (!read_index())
+      scan_blocks();
+    return true;
+  }
+
+  // copies frame `frame` into `store`, positions, radii and colors by id
+  // sequential reads decode one frame each, a jump decodes from the start
+  // of the frame's block
+  // false past the last frame or on a corrupt block
+  bool read_frame(int frame, ParticleStore &store) {
+    if (frame < 0 || uint32_t(frame) >= m_frame_count)
+      return false;
+
+    if (frame != m_next_frame) {
+      // the last block whose first frame is not past `frame`
+      auto block = std::upper_bound(
+          m_index.begin(), m_index.end(), uint32_t(frame),
+          [](uint32_t f, const IndexEntry &entry) {
+            return f < entry.first_frame;
+          });
+      if (block == m_index.begin() || !load_block(block - m_index.begin() - 1))
+        return false;
+    }
+    while (m_next_frame <= frame) {
+      const IndexEntry &entry = m_index[m_block_number];
+      if (m_next_frame == entry.first_frame + entry.frame_count &&
+          !load_block(m_block_number + 1))
+        return false;
+      if (!decode_frame())
+        return false;
+    }
+
+    const size_t count = m_qx.size();
+    const float quantum = m_header.quantum;
+    store.x.resize(count);
+    store.y.resize(count);
+    for (size_t id = 0; id < count; id++) {
+      store.x[id] = m_qx[id] * quantum;
+      store.y[id] = m_qy[id] * quantum;
+    }
+    // at rest, ids in index order
+    store.last_x = store.x;
+    store.last_y = store.y;
+    store.acc_x.assign(count, 0.0f);
+    store.acc_y.assign(count, 0.0f);
+    store.cell.assign(count, -1);
+    store.radius.assign(m_radius.begin(), m_radius.begin() + count);
+    store.color.assign(m_color.begin(), m_color.begin() + count);
+    store.id.resize(count);
+    store.index_of.resize(count);
+    for (size_t id = 0; id < count; id++)
+      store.id[id] = store.index_of[id] = id;
+    return true;
+  }
+
+  bool read_index() {
+    Trailer trailer;
+    if (std::fseek(m_file, -long(sizeof trailer), SEEK_END) != 0 ||
+        std::fread(&trailer, sizeof trailer, 1, m_file) != 1 ||
+        std::memcmp(trailer.magic, INDEX_MAGIC, sizeof INDEX_MAGIC) != 0)
+      return false;
+    m_index.resize(trailer.block_count);
+    if (std::fseek(m_file, trailer.index_offset, SEEK_SET) != 0 ||
+        std::fread(m_index.data(), sizeof(IndexEntry), m_index.size(),
+                   m_file) != m_index.size()) {
+      m_index.clear();
+      return false;
+    }
+    m_frame_count = trailer.frame_count;
+    return true;
+  }
+
+  // index of a file that was not closed, every complete block
+  void scan_blocks() {
+    uint64_t offset = sizeof m_header;
+    BlockHeader header;
+    while (std::fseek(m_file, offset, SEEK_SET) == 0 &&
+           std::fread(&header, sizeof header, 1, m_file) == 1 &&
+           header.magic == BLOCK_MAGIC &&
+           header.first_frame == m_frame_count) {
+      // a block cut short by the crash is dropped
+      if (std::fseek(m_file, offset + sizeof header + header.payload_size - 1,
+                     SEEK_SET) != 0 ||
+          std::fgetc(m_file) == EOF)
+        break;
+      m_index.push_back({offset, header.first_frame, header.frame_count});
+      m_frame_count += header.frame_count;
+      offset += sizeof header + header.payload_size;
+    }
+  }
+
+  bool load_block(int number) {
+    if (number < 0 || size_t(number) >= m_index.size())
+      return false;
+    const IndexEntry &entry = m_index[number];
+    BlockHeader header;
+    if (std::fseek(m_file, entry.offset, SEEK_SET) != 0 ||
+        std::fread(&header, sizeof header, 1, m_file) != 1 ||
+        header.magic != BLOCK_MAGIC)
+      return false;
+    m_block.resize(header.payload_size);
+    if (std::fread(m_block.data(), 1, m_block.size(), m_file) != m_block.size())
+      return false;
+    m_block_number = number;
+    m_cursor = m_block.data();
+    m_next_frame = entry.first_frame;
+    return true;
+  }
+
+  bool get_deltas(std::vector<int64_t> &values, size_t count,
+                  const uint8_t *end) {
+    uint64_t value;
+    for (size_t i = 0; i < count;) {
+      if (!get_varint(m_cursor, end, value))
+        return false;
+      int64_t delta = unzigzag(value);
+      values[i++] += delta;
+      if (delta != 0)
+        continue;
+      if (!get_varint(m_cursor, end, value) || value > count - i)
+        return false;
+      i += value;
+    }
+    return true;
+  }
+
+  bool decode_frame() {
+    const uint8_t *end = m_block.data() + m_block.size();
+    const bool keyframe = m_next_frame == m_index[m_block_number].first_frame;
+    uint64_t count, first_described;
+    if (!get_varint(m_cursor, end, count) ||
+        !get_varint(m_cursor, end, first_described) || first_described > count)
+      return false;
+    if (uint64_t(end - m_cursor) < (count - first_described) * 8)
+      return false;
+
+    m_radius.resize(std::max<size_t>(m_radius.size(), count));
+    m_color.resize(std::max<size_t>(m_color.size(), count));
+    for (size_t id = first_described; id < count; id++) {
+      std::memcpy(&m_radius[id], m_cursor, 4);
+      std::memcpy(&m_color[id], m_cursor + 4, 4);
+      m_cursor += 8;
+    }
+
+    m_qx.resize(count, 0);
+    m_qy.resize(count, 0);
+    if (keyframe) {
+      std::fill(m_qx.begin(), m_qx.end(), 0);
+      std::fill(m_qy.begin(), m_qy.end(), 0);
+    }
+    if (!get_deltas(m_qx, count, end) || !get_deltas(m_qy, count, end))
+      return false;
+    m_next_frame++;
+    return true;
+  }
+};
+
+} // namespace trajectory
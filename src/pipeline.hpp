@@ -0,0 +1,216 @@
+#pragma once
+#include <SFML/Graphics/Color.hpp>
+#include <SFML/System/Vector2.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./physics/simulator.hpp"
+#include "./profiler.hpp"
+#include "./thread_pool.hpp"
+
+// hands the latest of a stream of values from one producer thread to one
+// consumer thread, neither ever waits for the other
+// the producer fills `back()` and publishes it, the consumer takes whatever
+// was published last, values published in between are skipped
+template <typename T> struct TripleBuffer {
+  // set on the shared index while the consumer has not taken it yet
+  static constexpr int FRESH = 4;
+
+  std::array<T, 3> m_slots;
+  // the slot last published, owned by neither side
+  std::atomic<int> m_shared = 1;
+  int m_back = 0;
+  int m_front = 2;
+
+  T &back() { return m_slots[m_back]; }
+
+  const T &front() const { return m_slots[m_front]; }
+
+  void publish() {
+    m_back = m_shared.exchange(m_back | FRESH, std::memory_order_acq_rel) &
+             ~FRESH;
+  }
+
+  // false if nothing was published since the last call, `front()` is then
+  // unchanged
+  bool take() {
+    if (!(m_shared.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    m_front = m_shared.exchange(m_front, std::memory_order_acq_rel) & ~FRESH;
+    return true;
+  }
+};
+
+// what the renderer needs of one simulation step, by particle id so that
+// reorders between steps do not matter
+struct FrameSnapshot {
+  using clock = std::chrono::steady_clock;
+
+  // positions at the previous publication and at this one, particles spawned
+  // since start at their current position
+  std::vector<float> prev_x, prev_y, x, y;
+  std::vector<float> radius;
+  std::vector<sf::Color> color;
+  uint64_t step = 0;
+  clock::time_point time;
+  // of this step, the window shows them instead of timing `update()` itself
+  Simulator::PhaseTimings timings;
+  double update_ms = 0.0;
+
+  size_t size() const { return x.size(); }
+
+  // where the renderer draws particle `id`, `alpha` of the way from the
+  // previous to this publication
+  sf::Vector2f position(int id, float alpha) const {
+    return {prev_x[id] + (x[id] - prev_x[id]) * alpha,
+            prev_y[id] + (y[id] - prev_y[id]) * alpha};
+  }
+};
+
+// runs a simulator on its own thread at a fixed rate and publishes a
+// `FrameSnapshot` after every step
+// the simulator belongs to the loop's thread while it runs: other threads
+// reach it through `post()`, which queues a command for the start of the next
+// step
+// a step that overruns its period delays the next ones, the loop does not try
+// to catch up, so a slow phase slows the simulation down instead of freezing
+// the display
+class SimulationLoop {
+public:
+  using clock = FrameSnapshot::clock;
+  using Command = std::function<void(Simulator &)>;
+
+private:
+  Simulator &simulator;
+  // the snapshot copies run on it, the simulator's pool
+  ThreadPool &thread_pool;
+  clock::duration period;
+
+  TripleBuffer<FrameSnapshot> m_snapshots;
+  // by id, the positions of the last publication
+  std::vector<float> m_last_x, m_last_y;
+  uint64_t m_step = 0;
+
+  std::mutex m_mutex;
+  std::vector<Command> m_pending;
+  // swapped with `m_pending` under the lock, run without it
+  std::vector<Command> m_running;
+
+  std::atomic<bool> m_stopping = false;
+  std::thread m_thread;
+
+  void publish(double update_ms) {
+    PROFILE_SCOPE("publish");
+    const ParticleStore &entities = simulator.entities;
+    const int count = entities.index_of.size();
+    FrameSnapshot &snapshot = m_snapshots.back();
+    snapshot.prev_x.resize(count);
+    snapshot.prev_y.resize(count);
+    snapshot.x.resize(count);
+    snapshot.y.resize(count);
+    snapshot.radius.resize(count);
+    snapshot.color.resize(count);
+    const int known = m_last_x.size();
+    m_last_x.resize(count);
+    m_last_y.resize(count);
+
+    thread_pool.parallel(count, [&](int start, int end) {
+      for (int id = start; id < end; id++) {
+        const int i = entities.index_of[id];
+        snapshot.x[id] = entities.x[i];
+        snapshot.y[id] = entities.y[i];
+        snapshot.prev_x[id] = id < known ? m_last_x[id] : entities.x[i];
+        snapshot.prev_y[id] = id < known ? m_last_y[id] : entities.y[i];
+        snapshot.radius[id] = entities.radius[i];
+        snapshot.color[id] = entities.color[i];
+        m_last_x[id] = entities.x[i];
+        m_last_y[id] = entities.y[i];
+      }
+    });
+    snapshot.step = ++m_step;
+    snapshot.time = clock::now();
+    snapshot.timings = simulator.last_timings;
+    snapshot.update_ms = update_ms;
+    m_snapshots.publish();
+  }
+
+  template <typename Step> void run(Step step) {
+    PROFILE_THREAD_NAME("simulation");
+    clock::time_point next_step = clock::now();
+    while (!m_stopping.load(std::memory_order_acquire)) {
+      {
+        std::lock_guard<std::mutex> lock_guard{m_mutex};
+        m_running.swap(m_pending);
+      }
+      for (Command &command : m_running)
+        command(simulator);
+      m_running.clear();
+
+      clock::time_point start = clock::now();
+      step(simulator);
+      double update_ms =
+          std::chrono::duration<double, std::milli>(clock::now() - start).count();
+      publish(update_ms);
+
+      next_step = std::max(next_step + period, clock::now() - period);
+      std::this_thread::sleep_until(next_step);
+    }
+  }
+
+public:
+  // `steps_per_second` also sets the simulator's step, so simulated time
+  // follows wall-clock time
+  SimulationLoop(Simulator &simulator_, ThreadPool &thread_pool_,
+                 double steps_per_second)
+      : simulator{simulator_}, thread_pool{thread_pool_},
+        period{std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(1.0 / steps_per_second))} {
+    simulator.set_step_dt(1.0 / steps_per_second);
+  }
+
+  SimulationLoop(const SimulationLoop &) = delete;
+  SimulationLoop &operator=(const SimulationLoop &) = delete;
+
+  ~SimulationLoop() { stop(); }
+
+  // `step(simulator)` advances the simulation by one step, usually
+  // `simulator.update()` plus whatever feeds it
+  template <typename Step> void start(Step step) {
+    m_stopping.store(false, std::memory_order_release);
+    m_thread = std::thread([this, step]() { run(step); });
+  }
+
+  // returns after the current step, the simulator is the caller's again
+  void stop() {
+    m_stopping.store(true, std::memory_order_release);
+    if (m_thread.joinable())
+      m_thread.join();
+  }
+
+  void post(Command command) {
+    std::lock_guard<std::mutex> lock_guard{m_mutex};
+    m_pending.push_back(std::move(command));
+  }
+
+  // the consumer side, for one thread only
+  // true if a newer snapshot arrived since the last call
+  bool take_snapshot() { return m_snapshots.take(); }
+
+  // empty until the first step is published
+  const FrameSnapshot &snapshot() const { return m_snapshots.front(); }
+
+  // how far the display is between the snapshot's previous publication and
+  // its own, rendering one step behind the simulation
+  float alpha(clock::time_point now) const {
+    const FrameSnapshot &latest = snapshot();
+    return std::clamp(std::chrono::duration<float>(now - latest.time) / period,
+                      0.0f, 1.0f);
+  }
+};
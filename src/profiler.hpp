@@ -0,0 +1,239 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// scoped instrumentation, compiled in with `-DVERLET_PROFILE` (`make
+// PROFILE=1`), the macros expand to nothing otherwise
+// each thread appends complete events to its own ring buffer, no locks and
+// no allocation after the thread's first event, the oldest events are
+// overwritten once a buffer is full
+// an exiting thread hands its buffer, events included, to the next new
+// thread, so runs that keep creating pools reuse the same rows
+// `profiler::write_chrome_trace()` exports every buffer as Chrome trace JSON,
+// which chrome://tracing and https://ui.perfetto.dev open
+namespace profiler {
+
+using clock = std::chrono::steady_clock;
+
+// `name` must outlive the profiler, string literals do
+struct Event {
+  const char *name = nullptr;
+  int64_t start_ns = 0;
+  int64_t end_ns = 0;
+};
+
+// single producer, the owning thread
+// `m_head` counts every event ever written, the export reads it first and
+// skips whatever the owner may have overwritten since
+struct ThreadBuffer {
+  static constexpr uint64_t capacity = 1 << 16;
+
+  std::array<Event, capacity> m_events;
+  std::atomic<uint64_t> m_head = 0;
+  int tid = 0;
+  std::string name;
+
+  void push(const Event &event) {
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    m_events[head % capacity] = event;
+    m_head.store(head + 1, std::memory_order_release);
+  }
+};
+
+struct Registry {
+  static constexpr int max_threads = 256;
+
+  std::array<std::atomic<ThreadBuffer *>, max_threads> m_buffers{};
+  std::atomic<int> m_count = 0;
+  // buffers live as long as the process, threads may exit before the export
+  std::array<std::unique_ptr<ThreadBuffer>, max_threads> m_owned;
+  // buffers of exited threads, handed to the next threads to register
+  std::vector<ThreadBuffer *> m_free;
+  std::mutex m_free_mutex;
+  // threads that found every slot taken, their events are dropped
+  std::atomic<int> m_dropped = 0;
+  clock::time_point m_origin = clock::now();
+
+  static Registry &get() {
+    static Registry registry;
+    return registry;
+  }
+
+  // a buffer of an exited thread if any, else a new one, nullptr once
+  // `max_threads` threads are alive at the same time
+  ThreadBuffer *register_thread() {
+    {
+      std::lock_guard<std::mutex> lock{m_free_mutex};
+      if (!m_free.empty()) {
+        ThreadBuffer *buffer = m_free.back();
+        m_free.pop_back();
+        return buffer;
+      }
+    }
+    int slot = m_count.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= max_threads) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    m_owned[slot] = std::make_unique<ThreadBuffer>();
+    ThreadBuffer *buffer = m_owned[slot].get();
+    buffer->tid = slot;
+    buffer->name = "thread " + std::to_string(slot);
+    m_buffers[slot].store(buffer, std::memory_order_release);
+    return buffer;
+  }
+
+  // called as the owning thread exits, its events stay for the export
+  void release_thread(ThreadBuffer *buffer) {
+    std::lock_guard<std::mutex> lock{m_free_mutex};
+    m_free.push_back(buffer);
+  }
+
+  int64_t now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                                m_origin)
+        .count();
+  }
+
+  int64_t to_ns(clock::time_point time) const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time -
+                                                                m_origin)
+        .count();
+  }
+};
+
+// the calling thread's buffer, returned to the registry when it exits
+struct ThreadSlot {
+  ThreadBuffer *buffer = Registry::get().register_thread();
+
+  ~ThreadSlot() {
+    if (buffer)
+      Registry::get().release_thread(buffer);
+  }
+};
+
+inline ThreadBuffer *thread_buffer() {
+  static thread_local ThreadSlot slot;
+  return slot.buffer;
+}
+
+inline void record(const char *name, int64_t start_ns, int64_t end_ns) {
+  if (ThreadBuffer *buffer = thread_buffer())
+    buffer->push({name, start_ns, end_ns});
+}
+
+// an event over an interval that was timed anyway
+inline void record(const char *name, clock::time_point start,
+                   clock::time_point end) {
+  const Registry &registry = Registry::get();
+  record(name, registry.to_ns(start), registry.to_ns(end));
+}
+
+// names the calling thread's row in the trace
+inline void set_thread_name(const std::string &name) {
+  if (ThreadBuffer *buffer = thread_buffer())
+    buffer->name = name;
+}
+
+struct Scope {
+  const char *name;
+  int64_t start_ns;
+
+  explicit Scope(const char *name_)
+      : name{name_}, start_ns{Registry::get().now_ns()} {}
+
+  ~Scope() { record(name, start_ns, Registry::get().now_ns()); }
+
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+};
+
+// writes the events still held by every buffer, best taken while the
+// threads are idle, events overwritten during the export are skipped
+// warns on stderr if threads went unrecorded
+inline bool write_chrome_trace(const std::string &path) {
+  std::ofstream out(path);
+  if (!out)
+    return false;
+
+  Registry &registry = Registry::get();
+  if (int dropped = registry.m_dropped.load(std::memory_order_relaxed))
+    std::cerr << "profiler: " << dropped << " threads found all "
+              << Registry::max_threads
+              << " buffers taken, their events are missing from " << path
+              << "\n";
+  const int count =
+      std::min(registry.m_count.load(std::memory_order_acquire),
+               Registry::max_threads);
+  out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+  bool first = true;
+  auto separator = [&]() -> const char * {
+    const char *s = first ? "\n" : ",\n";
+    first = false;
+    return s;
+  };
+
+  for (int slot = 0; slot < count; slot++) {
+    const ThreadBuffer *buffer =
+        registry.m_buffers[slot].load(std::memory_order_acquire);
+    if (!buffer)
+      continue;
+    out << separator()
+        << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+        << buffer->tid << ", \"args\": {\"name\": \"" << buffer->name
+        << "\"}}";
+
+    const uint64_t head = buffer->m_head.load(std::memory_order_acquire);
+    const uint64_t first_event =
+        head > ThreadBuffer::capacity ? head - ThreadBuffer::capacity : 0;
+    for (uint64_t e = first_event; e < head; e++) {
+      const Event event = buffer->m_events[e % ThreadBuffer::capacity];
+      // lapped by the owner while copying
+      if (buffer->m_head.load(std::memory_order_acquire) - e >
+          ThreadBuffer::capacity)
+        continue;
+      // microseconds, the unit of the format
+      out << separator() << "{\"name\": \"" << event.name
+          << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->tid
+          << ", \"ts\": " << event.start_ns / 1000.0
+          << ", \"dur\": " << (event.end_ns - event.start_ns) / 1000.0 << "}";
+    }
+  }
+  out << "\n]}\n";
+  return bool(out);
+}
+
+constexpr bool enabled =
+#ifdef VERLET_PROFILE
+    true;
+#else
+    false;
+#endif
+
+} // namespace profiler
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+#ifdef VERLET_PROFILE
+// times the rest of the enclosing scope as event `name`
+#define PROFILE_SCOPE(name)                                                    \
+  profiler::Scope PROFILE_CONCAT(profile_scope_, __LINE__) { name }
+// records [start, end), two `profiler::clock::time_point`s, as event `name`
+#define PROFILE_EVENT(name, start, end) profiler::record(name, start, end)
+#define PROFILE_THREAD_NAME(name) profiler::set_thread_name(name)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_EVENT(name, start, end)
+#define PROFILE_THREAD_NAME(name)
+#endif
@@ -1,11 +1,15 @@
 #pragma once
 #include <SFML/Graphics.hpp>
+#include <cmath>
 #include <string>
 
 #include "./physics/simulator.hpp"
+#include "./pipeline.hpp"
+#include "./profiler.hpp"
 #include "./thread_pool.hpp"
 
 static const std::string CIRCLE_TEXTURE_PATH = "./assets/circle.png";
+static const sf::Color COLLIDER_COLOR{96, 96, 96};
 
 class Renderer {
 private:
@@ -18,6 +22,11 @@ private:
   // 2 triangles per entity
   sf::VertexArray m_entity_vertex_array{sf::PrimitiveType::Triangles};
 
+  // untextured triangles of the static colliders, rebuilt when their
+  // `version` changes
+  sf::VertexArray m_collider_vertex_array{sf::PrimitiveType::Triangles};
+  int m_collider_version = -1;
+
 public:
   Renderer(sf::RenderWindow &window_, ThreadPool &thread_pool_,
            Simulator &solver_)
@@ -29,58 +38,147 @@ public:
 
   void new_render() {
     render_target.clear(sf::Color::Black);
+    draw_colliders();
     update_vertex_array();
+    draw_vertex_array();
+  }
 
-    sf::RenderStates render_states;
-    render_states.texture = &m_entity_texture;
-    render_target.draw(m_entity_vertex_array, render_states);
+  // asynchronous mode: draws `snapshot` `alpha` of the way from its previous
+  // positions to its current ones
+  // the colliders are read from the simulator, they must not change while a
+  // `SimulationLoop` runs
+  void new_render(const FrameSnapshot &snapshot, float alpha) {
+    render_target.clear(sf::Color::Black);
+    draw_colliders();
+    update_vertex_array(snapshot, alpha);
+    draw_vertex_array();
   }
 
   void update_vertex_array() {
+    PROFILE_SCOPE("update_vertex_array");
     size_t entityCount = simulator.entities.size();
 
     // 6 vertices per 2 triangles
     m_entity_vertex_array.resize(entityCount * 6);
-    const float texture_size = 1024.0f;
 
-    // assuming all have same radius
-    const float radius =
-        simulator.entities.empty() ? 0.0f : simulator.entities[0].radius;
+    const ParticleStore &entities = simulator.entities;
 
     thread_pool.parallel(entityCount, [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        const Particle &ent = simulator.entities[i];
-        int id = i * 6;
-        sf::Vector2f topLeft = ent.position + sf::Vector2f{-radius, -radius};
-        sf::Vector2f topRight = ent.position + sf::Vector2f{radius, -radius};
-        sf::Vector2f bottomRight = ent.position + sf::Vector2f{radius, radius};
-        sf::Vector2f bottomLeft = ent.position + sf::Vector2f{-radius, radius};
-
-        // triangle 1
-        m_entity_vertex_array[id].position = topLeft;
-        m_entity_vertex_array[id].texCoords = {0.0f, 0.0f};
-
-        m_entity_vertex_array[id + 1].position = topRight;
-        m_entity_vertex_array[id + 1].texCoords = {texture_size, 0.0f};
-
-        m_entity_vertex_array[id + 2].position = bottomRight;
-        m_entity_vertex_array[id + 2].texCoords = {texture_size, texture_size};
-
-        // triangle 2
-        m_entity_vertex_array[id + 3].position = bottomRight;
-        m_entity_vertex_array[id + 3].texCoords = {texture_size, texture_size};
-
-        m_entity_vertex_array[id + 4].position = bottomLeft;
-        m_entity_vertex_array[id + 4].texCoords = {0.0f, texture_size};
-
-        m_entity_vertex_array[id + 5].position = topLeft;
-        m_entity_vertex_array[id + 5].texCoords = {0.0f, 0.0f};
-
-        // color for all 6 vertices
-        for (int j = 0; j < 6; ++j) {
-          m_entity_vertex_array[id + j].color = ent.color;
-        }
-      }
+      for (int i = start; i < end; i++)
+        write_quad(i * 6, entities.get_position(i), entities.radius[i],
+                   entities.color[i]);
+    });
+  }
+
+  void update_vertex_array(const FrameSnapshot &snapshot, float alpha) {
+    PROFILE_SCOPE("update_vertex_array");
+    size_t entityCount = snapshot.size();
+    m_entity_vertex_array.resize(entityCount * 6);
+
+    thread_pool.parallel(entityCount, [&](int start, int end) {
+      for (int id = start; id < end; id++)
+        write_quad(id * 6, snapshot.position(id, alpha), snapshot.radius[id],
+                   snapshot.color[id]);
     });
   }
+
+private:
+  void draw_colliders() {
+    const ColliderSet &colliders = simulator.get_colliders();
+    if (colliders.version != m_collider_version) {
+      m_collider_version = colliders.version;
+      m_collider_vertex_array.clear();
+      for (const ColliderSet::Shape &shape : colliders.shapes)
+        append_shape(colliders, shape);
+    }
+    if (m_collider_vertex_array.getVertexCount() > 0)
+      render_target.draw(m_collider_vertex_array);
+  }
+
+  void append_triangle(sf::Vector2f a, sf::Vector2f b, sf::Vector2f c) {
+    for (sf::Vector2f position : {a, b, c})
+      m_collider_vertex_array.append({position, COLLIDER_COLOR, {}});
+  }
+
+  void append_disc(sf::Vector2f center, float radius) {
+    const int segments = 24;
+    for (int k = 0; k < segments; k++) {
+      float a0 = 2.0f * M_PI * k / segments;
+      float a1 = 2.0f * M_PI * (k + 1) / segments;
+      append_triangle(center,
+                      center + radius * sf::Vector2f{std::cos(a0), std::sin(a0)},
+                      center + radius * sf::Vector2f{std::cos(a1), std::sin(a1)});
+    }
+  }
+
+  void append_shape(const ColliderSet &colliders,
+                    const ColliderSet::Shape &shape) {
+    const sf::Vector2f *corner = colliders.points.data() + shape.first_point;
+    switch (shape.kind) {
+    case ColliderSet::Kind::Circle:
+      append_disc(corner[0], shape.radius);
+      break;
+    case ColliderSet::Kind::Segment: {
+      // a capsule, at least a pixel wide so bare lines show
+      const float half_width = std::max(shape.radius, 0.5f);
+      sf::Vector2f along = corner[1] - corner[0];
+      float length = along.length();
+      sf::Vector2f side = length > 0.0f ? half_width / length *
+                                              sf::Vector2f{-along.y, along.x}
+                                        : sf::Vector2f{};
+      append_triangle(corner[0] + side, corner[1] + side, corner[1] - side);
+      append_triangle(corner[1] - side, corner[0] - side, corner[0] + side);
+      if (shape.radius > 0.5f) {
+        append_disc(corner[0], shape.radius);
+        append_disc(corner[1], shape.radius);
+      }
+      break;
+    }
+    case ColliderSet::Kind::Polygon:
+      for (int k = 1; k + 1 < shape.point_count; k++)
+        append_triangle(corner[0], corner[k], corner[k + 1]);
+      break;
+    }
+  }
+
+  void draw_vertex_array() {
+    sf::RenderStates render_states;
+    render_states.texture = &m_entity_texture;
+    render_target.draw(m_entity_vertex_array, render_states);
+  }
+
+  // the 6 vertices from `id` on, a textured square around `position`
+  void write_quad(int id, sf::Vector2f position, float radius,
+                  sf::Color color) {
+    const float texture_size = 1024.0f;
+    sf::Vector2f topLeft = position + sf::Vector2f{-radius, -radius};
+    sf::Vector2f topRight = position + sf::Vector2f{radius, -radius};
+    sf::Vector2f bottomRight = position + sf::Vector2f{radius, radius};
+    sf::Vector2f bottomLeft = position + sf::Vector2f{-radius, radius};
+
+    // triangle 1
+    m_entity_vertex_array[id].position = topLeft;
+    m_entity_vertex_array[id].texCoords = {0.0f, 0.0f};
+
+    m_entity_vertex_array[id + 1].position = topRight;
+    m_entity_vertex_array[id + 1].texCoords = {texture_size, 0.0f};
+
+    m_entity_vertex_array[id + 2].position = bottomRight;
+    m_entity_vertex_array[id + 2].texCoords = {texture_size, texture_size};
+
+    // triangle 2
+    m_entity_vertex_array[id + 3].position = bottomRight;
+    m_entity_vertex_array[id + 3].texCoords = {texture_size, texture_size};
+
+    m_entity_vertex_array[id + 4].position = bottomLeft;
+    m_entity_vertex_array[id + 4].texCoords = {0.0f, texture_size};
+
+    m_entity_vertex_array[id + 5].position = topLeft;
+    m_entity_vertex_array[id + 5].texCoords = {0.0f, 0.0f};
+
+    // color for all 6 vertices
+    for (int j = 0; j < 6; ++j) {
+      m_entity_vertex_array[id + j].color = color;
+    }
+  }
 };
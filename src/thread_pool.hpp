@@ -1,102 +1,265 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
-#include <functional>
+#include <cstdint>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
-struct TaskQueue {
-  std::queue<std::function<void()>> m_tasks;
+#include "./profiler.hpp"
+
+// join counter of one fork/join region, `ThreadPool::wait()` returns once
+// every task submitted with it has finished
+struct TaskGroup {
+  std::atomic<int> m_pending = 0;
+};
+
+// plain function pointer plus context instead of `std::function`, so queuing a
+// task never allocates
+// `ctx` points at the caller's callable, which outlives the task since the
+// caller waits on `group` before returning
+struct Task {
+  void (*fn)(void *ctx, int start, int end) = nullptr;
+  void *ctx = nullptr;
+  int start = 0;
+  int end = 0;
+  TaskGroup *group = nullptr;
+};
+
+// fixed-capacity double-ended queue of one worker
+// the owner pushes and pops at the back (LIFO, cache-warm), thieves take from
+// the front (FIFO, the oldest and usually largest tasks)
+// a mutex per deque is enough, contention only happens while stealing
+struct WorkDeque {
+  static constexpr int capacity = 256;
+
   std::mutex m_mutex;
-  std::atomic<int> m_remaining_tasks = 0;
+  Task m_tasks[capacity];
+  // `m_head` is the front, `m_tail` one past the back, both grow forever and
+  // wrap through `% capacity`
+  uint64_t m_head = 0;
+  uint64_t m_tail = 0;
 
-  void enqueue_task(std::function<void()> &&callback) {
+  bool push(const Task &task) {
     std::lock_guard<std::mutex> lock_guard{m_mutex};
-    m_tasks.push(std::move(callback));
-    m_remaining_tasks++;
+    if (m_tail - m_head == capacity)
+      return false;
+    m_tasks[m_tail++ % capacity] = task;
+    return true;
   }
 
-  void get_task(std::function<void()> &task) {
+  bool pop(Task &task) {
     std::lock_guard<std::mutex> lock_guard{m_mutex};
-    if (m_tasks.empty())
-      return;
-    task = std::move(m_tasks.front());
-    m_tasks.pop();
+    if (m_tail == m_head)
+      return false;
+    task = m_tasks[--m_tail % capacity];
+    return true;
   }
 
-  void await_completion() const {
-    while (m_remaining_tasks > 0) {
-      // `yield()` is a hint to the implementation to reschedule the execution
-      // of threads essentially forfeits the remainder of the thread's time
-      // slice (allocated by the OS)
-      std::this_thread::yield();
-    }
+  bool steal(Task &task) {
+    std::lock_guard<std::mutex> lock_guard{m_mutex};
+    if (m_tail == m_head)
+      return false;
+    task = m_tasks[m_head++ % capacity];
+    return true;
   }
-
-  void finish_task() { m_remaining_tasks--; }
 };
 
+struct ThreadPool;
+
 struct Worker {
   int id = 0;
   std::thread m_thread;
-  // `task` is a pointer to a function that takes no arguments and returns
-  // nothing
-  std::function<void()> task = nullptr;
-  bool running = true;
-  TaskQueue *task_queue = nullptr;
-
-  Worker(TaskQueue &task_queue_, int id_) : id{id_}, task_queue{&task_queue_} {
-    m_thread = std::thread([this]() { run(); });
-  }
+  WorkDeque m_deque;
+  ThreadPool *pool = nullptr;
 
-  void run() {
-    while (running) {
-      task_queue->get_task(task);
-      if (task == nullptr)
-        std::this_thread::yield();
-      else {
-        task();
-        task_queue->finish_task();
-        task = nullptr;
-      }
-    }
-  }
+  Worker(ThreadPool &pool_, int id_) : id{id_}, pool{&pool_} {}
 
-  void stop() {
-    running = false;
-    m_thread.join();
-  }
+  void run();
 };
 
-// `struct` instead of `class` makes all members public, easy access without
-// getters perhaps should refactor, open/closed principle would suggest this is
-// a bad design
+// work-stealing pool
+// `parallel()` splits a range into chunks, spreads them over the workers'
+// deques and helps running them until all are done
+// idle workers park on a futex-backed `std::atomic::wait` instead of spinning
+// tasks may call `parallel()` themselves, a waiting thread keeps running other
+// tasks, so nested regions cannot deadlock
 struct ThreadPool {
-  TaskQueue m_task_queue;
   int m_thread_count = 1;
-  std::vector<Worker> m_workers;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+
+  // bumped whenever tasks are queued, a group completes or the pool stops,
+  // parked threads wait for it to change
+  // completions signal here rather than on the group, the group may be gone
+  // as soon as its counter hits zero
+  std::atomic<uint32_t> m_signal = 0;
+  std::atomic<bool> m_stopping = false;
+  // spreads tasks submitted from outside the pool over the deques
+  std::atomic<uint32_t> m_next_deque = 0;
+
+  // worker index of the current thread, -1 outside of this pool
+  static inline thread_local int t_worker_id = -1;
+  static inline thread_local ThreadPool *t_pool = nullptr;
+
+  ThreadPool(int thread_count_) : m_thread_count{std::max(1, thread_count_)} {
+    m_workers.reserve(m_thread_count);
+    for (int i = 0; i < m_thread_count; i++)
+      m_workers.push_back(std::make_unique<Worker>(*this, i));
+    // threads start once every deque exists, they steal from each other
+    for (auto &worker : m_workers)
+      worker->m_thread = std::thread([w = worker.get()]() { w->run(); });
+  }
+
+  // no workers, `parallel()` runs every chunk in order on the calling thread
+  // for work that is itself one task of another pool, e.g. a small simulation
+  // among many, see `ensemble.cpp`
+  ThreadPool() = default;
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() { stop(); }
+
+  // joins the workers, the pool cannot be used afterwards
+  // safe to call more than once
+  void stop() {
+    if (m_stopping.exchange(true))
+      return;
+    wake_workers();
+    for (auto &worker : m_workers)
+      if (worker->m_thread.joinable())
+        worker->m_thread.join();
+  }
 
-  ThreadPool(int thread_count_) : m_thread_count{thread_count_} {
-    m_workers.reserve(thread_count_);
-    for (int i = 0; i < thread_count_; i++)
-      m_workers.emplace_back(m_task_queue, i);
+  int current_worker() const { return t_pool == this ? t_worker_id : -1; }
+
+  void wake_workers() {
+    m_signal.fetch_add(1, std::memory_order_release);
+    m_signal.notify_all();
+  }
+
+  // the current thread's deque first, then the others, starting after it
+  bool find_task(Task &task) {
+    int self = current_worker();
+    if (self >= 0 && m_workers[self]->m_deque.pop(task))
+      return true;
+    for (int i = 1; i <= m_thread_count; i++) {
+      int victim = (std::max(self, 0) + i) % m_thread_count;
+      if (victim != self && m_workers[victim]->m_deque.steal(task))
+        return true;
+    }
+    return false;
+  }
+
+  void execute(const Task &task) {
+    {
+      PROFILE_SCOPE("task");
+      task.fn(task.ctx, task.start, task.end);
+    }
+    if (task.group->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      wake_workers();
   }
 
-  // `&&` denotes rvalue reference, allows moving the lambda instead of copying
-  void parallel(int entity_count,
-                std::function<void(int start, int end)> &&callback) {
-    int slice_size = entity_count / m_thread_count;
-    for (int i = 0; i < m_thread_count; i++) {
-      int start = i * slice_size;
-      int end = start + slice_size;
-      m_task_queue.enqueue_task(
-          [start, end, &callback]() { callback(start, end); });
+  // queues `fn(start, end)` for every chunk of [begin, end) on `group`
+  // `fn` must stay alive until `wait(group)` returns
+  template <typename Fn>
+  void submit(TaskGroup &group, int begin, int end, Fn &fn, int chunk_count) {
+    int count = end - begin;
+    if (count <= 0)
+      return;
+    chunk_count = std::clamp(chunk_count, 1, count);
+    // remainder spread over the first chunks
+    auto chunk_start = [&](int chunk) {
+      return begin + static_cast<int>(static_cast<int64_t>(count) * chunk /
+                                      chunk_count);
+    };
+    if (m_workers.empty()) {
+      for (int chunk = 0; chunk < chunk_count; chunk++)
+        fn(chunk_start(chunk), chunk_start(chunk + 1));
+      return;
     }
-    if (slice_size * m_thread_count < entity_count) {
-      int start = slice_size * m_thread_count;
-      callback(start, entity_count);
+
+    auto invoke = [](void *ctx, int start, int end) {
+      (*static_cast<Fn *>(ctx))(start, end);
+    };
+
+    int self = current_worker();
+    group.m_pending.fetch_add(chunk_count, std::memory_order_relaxed);
+    for (int chunk = 0; chunk < chunk_count; chunk++) {
+      Task task{invoke, const_cast<std::remove_const_t<Fn> *>(&fn),
+                chunk_start(chunk), chunk_start(chunk + 1), &group};
+
+      int deque = self >= 0 ? self
+                            : m_next_deque.fetch_add(1, std::memory_order_relaxed) %
+                                  m_thread_count;
+      // a full deque runs the chunk right away rather than allocating
+      if (!m_workers[deque]->m_deque.push(task))
+        execute(task);
+    }
+    wake_workers();
+  }
+
+  // fork/join barrier: runs queued tasks until every task of `group` is done,
+  // parks only when there is nothing left to steal
+  void wait(TaskGroup &group) {
+    PROFILE_SCOPE("wait");
+    Task task;
+    while (true) {
+      // read the signal first, a completion in between changes it
+      uint32_t signal = m_signal.load(std::memory_order_acquire);
+      if (group.m_pending.load(std::memory_order_acquire) == 0)
+        return;
+      if (find_task(task)) {
+        execute(task);
+        continue;
+      }
+      m_signal.wait(signal, std::memory_order_acquire);
     }
-    m_task_queue.await_completion();
+  }
+
+  // runs `callback(start, end)` over chunks of [begin, end) and returns once all
+  // are done, the calling thread helps
+  // defaults to one chunk per worker
+  template <typename Fn>
+  void parallel(int begin, int end, Fn &&callback, int chunk_count = 0) {
+    if (end <= begin)
+      return;
+    if (chunk_count <= 0)
+      chunk_count = m_thread_count;
+    TaskGroup group;
+    submit(group, begin, end, callback, chunk_count);
+    wait(group);
+  }
+
+  template <typename Fn> void parallel(int entity_count, Fn &&callback) {
+    parallel(0, entity_count, callback);
   }
 };
+
+inline void Worker::run() {
+  ThreadPool::t_worker_id = id;
+  ThreadPool::t_pool = pool;
+  PROFILE_THREAD_NAME("worker " + std::to_string(id));
+
+  Task task;
+  while (true) {
+    if (pool->find_task(task)) {
+      pool->execute(task);
+      continue;
+    }
+
+    // read the signal before the second look, a submit in between changes it
+    // and `wait()` returns straight away
+    uint32_t signal = pool->m_signal.load(std::memory_order_acquire);
+    if (pool->m_stopping.load(std::memory_order_acquire))
+      return;
+    if (pool->find_task(task)) {
+      pool->execute(task);
+      continue;
+    }
+    pool->m_signal.wait(signal, std::memory_order_acquire);
+  }
+}
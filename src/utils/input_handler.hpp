@@ -1,4 +1,5 @@
 #include "../physics/simulator.hpp"
+#include "../pipeline.hpp"
 
 class InputHandler {
 private:
@@ -8,12 +9,24 @@ private:
   Simulator &simulator;
   sf::RenderWindow &window;
   const float window_width;
+  // set while the simulator runs on its own thread, actions are then queued
+  // for its next step
+  SimulationLoop *loop = nullptr;
+
+  template <typename Fn> void act(Fn &&fn) {
+    if (loop)
+      loop->post(fn);
+    else
+      fn(simulator);
+  }
 
 public:
   InputHandler(Simulator &solver_, sf::RenderWindow &window_,
                float window_width_)
       : simulator{solver_}, window{window_}, window_width{window_width_} {};
 
+  void set_loop(SimulationLoop *loop_) { loop = loop_; }
+
   void handle_input() {
     // `pollEvent()` is non-blocking
     while (const std::optional event = window.pollEvent()) {
@@ -37,24 +50,28 @@ public:
       // (entails runtime type checking)
       sf::Vector2f mouse_window_coords =
           static_cast<sf::Vector2f>(sf::Mouse::getPosition(window)) * ratio;
-      simulator.mouse_pull(mouse_window_coords, m_pull_radius);
+      act([mouse_window_coords, radius = m_pull_radius](Simulator &target) {
+        target.mouse_pull(mouse_window_coords, radius);
+      });
     }
     if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Right)) {
       float ratio = window_width / window.getSize().x;
       sf::Vector2f mouse_window_coords =
           static_cast<sf::Vector2f>(sf::Mouse::getPosition(window)) * ratio;
-      simulator.mouse_push(mouse_window_coords, m_push_radius);
+      act([mouse_window_coords, radius = m_push_radius](Simulator &target) {
+        target.mouse_push(mouse_window_coords, radius);
+      });
     }
 
     if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Space))
       std::this_thread::sleep_for(std::chrono::milliseconds(360));
     if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Up))
-      simulator.set_up_gravity();
+      act([](Simulator &target) { target.set_up_gravity(); });
     if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Down))
-      simulator.set_down_gravity();
+      act([](Simulator &target) { target.set_down_gravity(); });
     if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Left))
-      simulator.set_left_gravity();
+      act([](Simulator &target) { target.set_left_gravity(); });
     if (sf::Keyboard::isKeyPressed(sf::Keyboard::Key::Right))
-      simulator.set_right_gravity();
+      act([](Simulator &target) { target.set_right_gravity(); });
   };
 };
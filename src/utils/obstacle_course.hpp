@@ -0,0 +1,52 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+#include <SFML/System/Vector2.hpp>
+
+#include "../physics/simulator.hpp"
+
+// static colliders of every kind, scaled to the world: a funnel in the upper
+// half, staggered rows of `pegs` pegs below it, alternating circles, triangles
+// and short thick segments, and a ramp in each lower corner
+struct ObstacleCourse {
+  float world_size;
+  int pegs = 60;
+
+  void build(Simulator &simulator) const {
+    const float w = world_size;
+    simulator.add_segment({0.15f * w, 0.2f * w}, {0.45f * w, 0.35f * w}, 2.0f);
+    simulator.add_segment({0.85f * w, 0.2f * w}, {0.55f * w, 0.35f * w}, 2.0f);
+    simulator.add_polygon({{0.0f, 0.8f * w}, {0.3f * w, w}, {0.0f, w}});
+    simulator.add_polygon({{w, 0.8f * w}, {w, w}, {0.7f * w, w}});
+    if (pegs <= 0)
+      return;
+
+    // a field 0.8 wide and 0.28 high, with about as many columns per unit of
+    // width as rows per unit of height
+    const float field_x = 0.1f * w, field_y = 0.42f * w;
+    const float field_width = 0.8f * w, field_height = 0.28f * w;
+    const int columns = std::ceil(std::sqrt(pegs * field_width / field_height));
+    const int rows = (pegs + columns - 1) / columns;
+    const float spacing_x = field_width / columns;
+    const float spacing_y = field_height / rows;
+    const float size = std::max(1.0f, 0.2f * std::min(spacing_x, spacing_y));
+
+    for (int k = 0; k < pegs; k++) {
+      const int row = k / columns, col = k % columns;
+      const sf::Vector2f center = {
+          field_x + (col + 0.25f + 0.5f * (row % 2)) * spacing_x,
+          field_y + (row + 0.5f) * spacing_y};
+      if (k % 3 == 0)
+        simulator.add_circle_collider(center, size);
+      else if (k % 3 == 1)
+        simulator.add_polygon({center + sf::Vector2f{0.0f, -size},
+                               center + sf::Vector2f{size, size},
+                               center + sf::Vector2f{-size, size}});
+      else
+        simulator.add_segment(center - sf::Vector2f{size, 0.5f * size},
+                              center + sf::Vector2f{size, 0.5f * size},
+                              0.5f * size);
+    }
+  }
+};
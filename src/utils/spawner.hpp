@@ -0,0 +1,54 @@
+#pragma once
+#include <algorithm>
+
+#include <SFML/Graphics/Color.hpp>
+#include <SFML/System/Vector2.hpp>
+
+#include "../physics/simulator.hpp"
+
+// two interleaved columns of spawners on opposite walls, shooting particles
+// diagonally towards the floor
+struct DualSpawner {
+  float world_size;
+  float particle_radius;
+  unsigned max_entities;
+
+  float spawn_velocity = 500.0f;
+  float spawner_spacing = 4.0f;
+  unsigned spawner_count = 20;
+
+  bool is_full(const Simulator &simulator) const {
+    return simulator.entities.size() >= max_entities;
+  }
+
+  // emits one particle per spawner, capped at `max_entities`
+  void spawn(Simulator &simulator, sf::Color color) const {
+    const sf::Vector2f spawn_pos_1 = {4.0f, 50.0f};
+    // `- particle_radius + spawner_spacing` to offset the discrepancy from the
+    // spawn logic
+    const sf::Vector2f spawn_pos_2 = {
+        world_size - 4.0f, 50.0f - (particle_radius + spawner_spacing)};
+    const sf::Vector2f spawn_angle_1 = sf::Vector2f{0.5, 0.5};
+    const sf::Vector2f spawn_angle_2 = sf::Vector2f{-0.5, 0.5};
+
+    unsigned entity_count = simulator.entities.size();
+    if (entity_count >= max_entities)
+      return;
+
+    for (unsigned spawner_idx = 0;
+         spawner_idx < std::min(spawner_count, max_entities - entity_count);
+         spawner_idx++) {
+      sf::Vector2f spawner_offset =
+          sf::Vector2f{0.0f, spawner_idx * spawner_spacing};
+      sf::Vector2f spawn_pos =
+          (spawner_idx % 2 == 0) ? spawn_pos_1 : spawn_pos_2;
+      sf::Vector2f spawn_angle =
+          (spawner_idx % 2 == 0) ? spawn_angle_1 : spawn_angle_2;
+
+      Particle new_entity =
+          simulator.add_entity(spawn_pos + spawner_offset, particle_radius);
+      new_entity.set_color(color);
+      simulator.set_entity_velocity(new_entity, spawn_velocity * spawn_angle);
+    }
+  }
+};